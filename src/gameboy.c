@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 
 bool32 handleKey(GameBoy* gb, KeyIndex index, PressFlag pressFlag) {
     enum JoypadButton button;
@@ -64,7 +65,123 @@ void releaseButton(GameBoy* gb, enum JoypadButton button) {
     gb->joypad = setBit(gb->joypad, button);
 }
 
-uint8 readMemory(GameBoy* gb, uint16 address) {
+static void mapPages(GameBoy* gb, uint16 start, uint16 size,
+                     const uint8* readBase, uint8* writeBase) {
+    for (uint16 offset = 0; offset < size; offset += MEMORY_PAGE_SIZE) {
+        uint8 page = (start + offset) / MEMORY_PAGE_SIZE;
+
+        gb->readPages[page] = readBase ? readBase + offset : 0;
+        gb->writePages[page] = writeBase ? writeBase + offset : 0;
+    }
+}
+
+// ROM bank mapped at the address, 0 outside of ROM
+uint16 getAddressBank(GameBoy* gb, uint16 address) {
+    const uint8* page = gb->readPages[address / MEMORY_PAGE_SIZE];
+    if (address >= VRAM_START || !page) {
+        return 0;
+    }
+
+    return (page - gb->rom) / ROM_SWITCHABLE_BANK_START;
+}
+
+void updateBanks(GameBoy* gb) {
+    const Cartridge* cartridge = gb->cartridge;
+
+    if (cartridge && cartridge->type == CART_MBC1) {
+        uint16 upperBits = gb->mbc1.ramBankIndex << 5;
+        uint16 bankIndex = (upperBits | gb->mbc1.romBankIndex) % gb->mbc1.romBankCount;
+        
+        // In mode 1, the upper bits also select the bank seen at
+        // 0x0000 (large ROMs) and the cartridge RAM bank
+        if (gb->mbc1.bankingMode) {
+            gb->mbc1.rom0BankPtr = gb->rom + (upperBits % gb->mbc1.romBankCount) * 0x4000;
+        } else {
+            gb->mbc1.rom0BankPtr = gb->rom;
+        }
+        gb->mbc1.romBankPtr = gb->rom + bankIndex * 0x4000;
+
+        if (gb->mbc1.ramEnable && gb->mbc1.ramBankCount) {
+            uint8 ramBankIndex = gb->mbc1.bankingMode ?
+                gb->mbc1.ramBankIndex % gb->mbc1.ramBankCount : 0;
+
+            gb->mbc1.ramBankPtr = gb->externalRam + ramBankIndex * 0x2000;
+        } else {
+            gb->mbc1.ramBankPtr = 0;
+        }
+    } else if (cartridge && cartridge->type == CART_ROM_ONLY) {
+        gb->mbc1.rom0BankPtr = gb->rom;
+        gb->mbc1.romBankPtr = gb->rom + ROM_SWITCHABLE_BANK_START;
+        gb->mbc1.ramBankPtr = gb->mbc1.ramBankCount ? gb->externalRam : 0;
+    } else {
+        gb->mbc1.rom0BankPtr = 0;
+        gb->mbc1.romBankPtr = 0;
+        gb->mbc1.ramBankPtr = 0;
+    }
+
+    // ROM : readable directly, writes go to the MBC registers
+    mapPages(gb, 0x0000, 0x4000, gb->mbc1.rom0BankPtr, 0);
+    mapPages(gb, ROM_SWITCHABLE_BANK_START, 0x4000, gb->mbc1.romBankPtr, 0);
+    mapPages(gb, EXTERNAL_RAM_START, 0x2000, gb->mbc1.ramBankPtr, gb->mbc1.ramBankPtr);
+}
+
+void updateMemoryMap(GameBoy* gb) {
+    updateBanks(gb);
+
+    mapPages(gb, VRAM_START, 0x2000, gb->vram, gb->vram);
+    mapPages(gb, TILE_DATA_BLOCK0, TILE_DATA_SIZE, gb->vram, 0);
+    mapPages(gb, INTERNAL_RAM_START, 0x2000, gb->ram, gb->ram);
+
+    // echo RAM, OAM, IO registers and HRAM are handled by
+    // readUnmappedMemory/writeUnmappedMemory
+    mapPages(gb, ECHO_RAM_START, 0x2000, 0, 0);
+
+    flushDecodeCache(gb);
+}
+
+void flushDecodeCache(GameBoy* gb) {
+    for (uint32 i = 0; gb->decodedBlocks && i < DECODE_CACHE_SIZE; i++) {
+        gb->decodedBlocks[i].instructionCount = 0;
+    }
+
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++) {
+        gb->codePages[page] = false;
+    }
+}
+
+// Called when code is decoded from a RAM page : further writes to the
+// page have to invalidate it
+void protectCodePage(GameBoy* gb, uint16 page) {
+    gb->codePages[page] = true;
+
+    if (page * MEMORY_PAGE_SIZE >= INTERNAL_RAM_START
+        && page * MEMORY_PAGE_SIZE < ECHO_RAM_START) {
+        gb->writePages[page] = 0;
+    }
+}
+
+static void invalidateCodePage(GameBoy* gb, uint16 page) {
+    gb->codePageGenerations[page]++;
+    gb->codePages[page] = false;
+
+    uint16 address = page * MEMORY_PAGE_SIZE;
+    if (address >= INTERNAL_RAM_START && address < ECHO_RAM_START) {
+        gb->writePages[page] = gb->ram + (address - INTERNAL_RAM_START);
+    }
+}
+
+// For when the whole of RAM was replaced (save states) : only the
+// blocks decoded from RAM pages are dropped, the ROM ones are keyed by
+// bank and stay valid, along with their generated code
+void flushRamDecodeCache(GameBoy* gb) {
+    for (uint32 page = 0; page < MEMORY_PAGE_COUNT; page++) {
+        if (gb->codePages[page]) {
+            invalidateCodePage(gb, page);
+        }
+    }
+}
+
+static uint8 readUnmappedMemory(GameBoy* gb, uint16 address) {
     if (address == IE_ADDRESS) {
         return gb->ie;
     } else if (address >= HRAM_START) {
@@ -83,6 +200,13 @@ uint8 readMemory(GameBoy* gb, uint16 address) {
                 return 0x0F | (reg & 0xF0);
             }
             break;
+        case IO_DIV:
+            gb->timerReads++;
+            return gb->clock / 16384;
+        case IO_TIMA:
+            gb->timerReads++;
+            syncTimer(gb);
+            return IO(TIMA);
         case IO_STAT: {
             uint8 bit2 = (IO(LY) == IO(LYC));
 
@@ -101,33 +225,34 @@ uint8 readMemory(GameBoy* gb, uint16 address) {
     } else if (address >= ECHO_RAM_START) {
         gbError(gb, "Reading from invalid memory location 0x%04X (echo RAM)\n", address);
         return 0;
-    } else if (address >= INTERNAL_RAM_START) {
-        return gb->ram[address - INTERNAL_RAM_START];
     } else if (address >= EXTERNAL_RAM_START) {
-        uint16 ramAddress = address - EXTERNAL_RAM_START;
-        return gb->externalRam[gb->mbc1.ramBankIndex * 0x2000 + ramAddress];
-    } else if (address >= VRAM_START) {
-        return gb->vram[address - VRAM_START];
-    } else if (address >= ROM_SWITCHABLE_BANK_START) {
-        if (gb->rom[CART_TYPE] == CART_ROM_ONLY) {
-            return gb->rom[address];
-        } else if (gb->rom[CART_TYPE] == CART_MBC1) {
-            uint8 bankIndex = (gb->mbc1.ramBankIndex << 5) | gb->mbc1.romBankIndex;
-            bankIndex = bankIndex % gb->mbc1.romBankCount;
-            return gb->rom[bankIndex * 0x4000 + address - ROM_SWITCHABLE_BANK_START];
-        } else {
-            gbError(gb, "Reading from invalid memory location 0x%04X (switchable ROM bank)\n", address);
-        }
+        // cartridge RAM disabled or absent
+        return 0xFF;
     } else {
-        return gb->rom[address];
+        gbError(gb, "Reading from invalid memory location 0x%04X (switchable ROM bank)\n", address);
+        return 0;
     }
 }
 
-void writeMemory(GameBoy* gb, uint16 address, uint8 value) {
+uint8 readMemory(GameBoy* gb, uint16 address) {
+    const uint8* page = gb->readPages[address / MEMORY_PAGE_SIZE];
+
+    if (page) {
+        return page[address % MEMORY_PAGE_SIZE];
+    }
+
+    return readUnmappedMemory(gb, address);
+}
+
+static void writeUnmappedMemory(GameBoy* gb, uint16 address, uint8 value) {
     if (address == IE_ADDRESS) {
         gb->ie = value;
     } else if (address >= HRAM_START) {
         gb->hram[address - HRAM_START] = value;
+
+        if (gb->codePages[address / MEMORY_PAGE_SIZE]) {
+            invalidateCodePage(gb, address / MEMORY_PAGE_SIZE);
+        }
     } else if (address >= IO_PORTS_START) {
         switch (address) {
         case IO_DMA: {
@@ -148,9 +273,20 @@ void writeMemory(GameBoy* gb, uint16 address, uint8 value) {
         case IO_DIV:
             IO(DIV) = 0;
             return;
+        case IO_TIMA:
+        case IO_TAC:
+            // count the cycles so far with the old values
+            syncTimer(gb);
+            gb->io[address & 0xFF] = value;
+            scheduleTimer(gb);
+            return;
         case IO_STAT:
             IO(STAT) = (value & 0xF8) | (IO(STAT) & 0x7);
             break;
+        case IO_LY:
+            IO(LY) = value;
+            scheduleModeCheck(gb);
+            return;
         default:
             gb->io[address & 0xFF] = value;
         }
@@ -161,18 +297,20 @@ void writeMemory(GameBoy* gb, uint16 address, uint8 value) {
     } else if (address >= ECHO_RAM_START) {
         gbError(gb, "Writing to invalid memory location 0x%04X (echo RAM)\n", address);
     } else if (address >= INTERNAL_RAM_START) {
+        // page holding cached code
         gb->ram[address - INTERNAL_RAM_START] = value;
+        invalidateCodePage(gb, address / MEMORY_PAGE_SIZE);
     } else if (address >= EXTERNAL_RAM_START) {
-        uint16 ramAddress = address - EXTERNAL_RAM_START;
-        gb->externalRam[gb->mbc1.ramBankIndex * 0x2000 + ramAddress] = value;
+        gbprintf(gb, "Write to disabled cartridge RAM at 0x%04X\n", address);
     } else if (address >= VRAM_START) {
-        gb->vram[address - VRAM_START] = value;
-    } else if (address >= ROM_SWITCHABLE_BANK_START) {
-        gbprintf(gb, "Attempt to write to ROM at 0x%04X (bank 1+)\n", address);
+        // tile data
+        uint16 offset = address - VRAM_START;
+        gb->vram[offset] = value;
+        gb->dirtyTileRows[offset / 16] |= 1 << (offset % 16 / 2);
     } else {
-        gbprintf(gb, "Attempt to write to ROM at 0x%04X (bank 0)\n", address);
+        gbprintf(gb, "Attempt to write to ROM at 0x%04X\n", address);
 
-        if (gb->rom[CART_TYPE] == CART_MBC1) {
+        if (gb->cartridge && gb->cartridge->type == CART_MBC1) {
             if (address >= 0x6000) {
                 gb->mbc1.bankingMode = value & 0x01;
             } else if (address >= 0x4000) {
@@ -185,10 +323,35 @@ void writeMemory(GameBoy* gb, uint16 address, uint8 value) {
             } else {
                 gb->mbc1.ramEnable = (value & 0x0F) == 0x0A;
             }
+
+            updateBanks(gb);
         }
     }
 }
 
+void writeMemory(GameBoy* gb, uint16 address, uint8 value) {
+    uint8* page = gb->writePages[address / MEMORY_PAGE_SIZE];
+
+    if (page) {
+        page[address % MEMORY_PAGE_SIZE] = value;
+        return;
+    }
+
+    writeUnmappedMemory(gb, address, value);
+}
+
+// Draw only one frame in renderInterval, or none but the ones asked
+// with requestFrame if it is 0.  Takes effect at the next frame.
+void setFrameSkip(GameBoy* gb, uint32 renderInterval) {
+    gb->renderInterval = renderInterval;
+    gb->framesSkipped = 0;
+}
+
+// Draw the next frame, whatever the frame skip
+void requestFrame(GameBoy* gb) {
+    gb->frameRequested = true;
+}
+
 void triggerInterrupt(GameBoy* gb, enum Interrupt interrupt) {
     uint8 ifFlag = readMemory(gb, IO_IF);
     writeMemory(gb, IO_IF, setBit(ifFlag, interrupt));
@@ -219,90 +382,120 @@ uint8 getBit(uint8 byte, uint8 index) {
 }
 
 uint8 getHighByte(GameBoy* gb, enum Register16 reg) {
-    return gb->registers[reg] >> 8;
+    return gb->registers.pairs[reg] >> 8;
 }
 
 uint8 getLowByte(GameBoy* gb, enum Register16 reg) {
-    return gb->registers[reg] & 0xFF;
+    return gb->registers.pairs[reg] & 0xFF;
 }
 
 void setHighByte(GameBoy* gb, enum Register16 reg, uint8 value) {
-    gb->registers[reg] =
-        (value << 8) | (gb->registers[reg] & 0xFF);
+    gb->registers.pairs[reg] =
+        (value << 8) | (gb->registers.pairs[reg] & 0xFF);
 }
 
 void setLowByte(GameBoy* gb, enum Register16 reg, uint8 value) {
-    gb->registers[reg] =
-        (gb->registers[reg] & 0xFF00) | value;
+    gb->registers.pairs[reg] =
+        (gb->registers.pairs[reg] & 0xFF00) | value;
+}
+
+// F as it would be if the pending lazy flags had been computed
+uint8 evaluateFlags(GameBoy* gb) {
+    uint8 lhs = gb->lazyFlags.lhs;
+    uint8 rhs = gb->lazyFlags.rhs;
+    uint8 result = gb->lazyFlags.result;
+    uint8 z = (result == 0) << FLAG_Z;
+
+    switch (gb->lazyFlags.op) {
+    case LAZY_FLAGS_NONE:
+        return REG8(REG_F);
+    case LAZY_FLAGS_ADD:
+        return z
+            | (((lhs ^ rhs ^ result) & 0x10) << (FLAG_H - 4))
+            | ((result < lhs) << FLAG_C);
+    case LAZY_FLAGS_SUB:
+        return z
+            | (1 << FLAG_N)
+            | (((lhs ^ rhs ^ result) & 0x10) << (FLAG_H - 4))
+            | ((lhs < rhs) << FLAG_C);
+    case LAZY_FLAGS_AND:
+        return z | (1 << FLAG_H);
+    case LAZY_FLAGS_OR:
+        return z;
+    case LAZY_FLAGS_INC:
+        return z
+            | (((lhs & 0x0F) == 0x0F) << FLAG_H)
+            | (rhs << FLAG_C);
+    case LAZY_FLAGS_DEC:
+        return z
+            | (1 << FLAG_N)
+            | (((lhs & 0x0F) == 0) << FLAG_H)
+            | (rhs << FLAG_C);
+    case LAZY_FLAGS_SHIFT:
+        return z | (rhs << FLAG_C);
+    case LAZY_FLAGS_ROTATE_A:
+        return rhs << FLAG_C;
+    default:
+        // not gbError, printGameboyState would end up here again
+        fprintf(stderr, "Unknown lazy flags operation %u\n", gb->lazyFlags.op);
+        exit(1);
+    }
+}
+
+void materializeFlags(GameBoy* gb) {
+    if (gb->lazyFlags.op != LAZY_FLAGS_NONE) {
+        REG8(REG_F) = evaluateFlags(gb);
+        gb->lazyFlags.op = LAZY_FLAGS_NONE;
+    }
 }
 
 bool32 getFlag(GameBoy* gb, enum CPUFlag flag) {
-    uint8 flags = getLowByte(gb, REG_AF);
+    uint8 flags = evaluateFlags(gb);
 
     return getBit(flags, flag);
 }
 
 void setFlag(GameBoy* gb, enum CPUFlag flag, bool32 value) {
-    uint8 flags = getLowByte(gb, REG_AF);
+    materializeFlags(gb);
+    
+    uint8 flags = REG8(REG_F);
     uint8 value01 = (value != 0);
 
     flags = flags & ~(1 << flag); // turn it off
     flags = flags | (value01 << flag);
 
-    setLowByte(gb, REG_AF, flags);
+    REG8(REG_F) = flags;
+
+#ifdef GAMEBOY_LAZY_FLAGS_CHECK
+    gb->lazyFlags.checked = (gb->lazyFlags.checked & ~(1 << flag)) | (value01 << flag);
+#endif
+}
+
+void setFlags(GameBoy* gb, uint8 flags) {
+    REG8(REG_F) = flags;
+    gb->lazyFlags.op = LAZY_FLAGS_NONE;
+
+#ifdef GAMEBOY_LAZY_FLAGS_CHECK
+    gb->lazyFlags.checked = flags;
+#endif
 }
 
 uint8 getReg8(GameBoy* gb, uint8 index) {
-    switch (index) {
-    case REG_B:
-        return getHighByte(gb, REG_BC);
-    case REG_C:
-        return getLowByte(gb, REG_BC);
-    case REG_D:
-        return getHighByte(gb, REG_DE);
-    case REG_E:
-        return getLowByte(gb, REG_DE);
-    case REG_H:
-        return getHighByte(gb, REG_HL);
-    case REG_L:
-        return getLowByte(gb, REG_HL);
-    case REG_A:
-        return getHighByte(gb, REG_AF);
-    case REG_F:
-        return getLowByte(gb, REG_AF);
-    default:
+    if (index == REG_F) {
+        return evaluateFlags(gb);
+    } else if (index > REG_A) {
         gbError(gb, "Unknown 8-bit register index %u", index);
-        break;
     }
+    
+    return REG8(index);
 }
 
 void setReg8(GameBoy* gb, uint8 index, uint8 value) {
-    switch (index) {
-    case REG_B:
-        setHighByte(gb, REG_BC, value);
-        break;
-    case REG_C:
-        setLowByte(gb, REG_BC, value);
-        break;
-    case REG_D:
-        setHighByte(gb, REG_DE, value);
-        break;
-    case REG_E:
-        setLowByte(gb, REG_DE, value);
-        break;
-    case REG_H:
-        setHighByte(gb, REG_HL, value);
-        break;
-    case REG_L:
-        setLowByte(gb, REG_HL, value);
-        break;
-    case REG_A:
-        setHighByte(gb, REG_AF, value);
-        break;
-    default:
+    if (index == REG_F || index > REG_A) {
         gbError(gb, "Unknown 8-bit register index %u", index);
-        break;
     }
+    
+    REG8(index) = value;
 }
 
 void printGameboyState(GameBoy* gb) {
@@ -329,12 +522,12 @@ void printGameboyState(GameBoy* gb) {
     printf("H  = 0x%02X   (%u)\n", h, h);
     printf("L  = 0x%02X   (%u)\n", l, l);
     
-    uint16 af = gb->registers[REG_AF];
-    uint16 bc = gb->registers[REG_BC];
-    uint16 de = gb->registers[REG_DE];
-    uint16 hl = gb->registers[REG_HL];
-    uint16 sp = gb->registers[REG_SP];
-    uint16 pc = gb->registers[REG_PC];
+    uint16 af = (a << 8) | evaluateFlags(gb);
+    uint16 bc = REG(BC);
+    uint16 de = REG(DE);
+    uint16 hl = REG(HL);
+    uint16 sp = REG(SP);
+    uint16 pc = REG(PC);
     
     printf("AF = 0x%04X (%u)\n", af, af);
     printf("BC = 0x%04X (%u)\n", bc, bc);
@@ -347,94 +540,204 @@ void printGameboyState(GameBoy* gb) {
 }
 
 void printGameboyLogLine(FILE* file, GameBoy* gb) {
-    uint8 a = getReg8(gb, REG_A);
-    uint8 f = getReg8(gb, REG_F);
-    uint8 b = getReg8(gb, REG_B);
-    uint8 c = getReg8(gb, REG_C);
-    uint8 d = getReg8(gb, REG_D);
-    uint8 e = getReg8(gb, REG_E);
-    uint8 h = getReg8(gb, REG_H);
-    uint8 l = getReg8(gb, REG_L);
-    
-    uint16 sp = gb->registers[REG_SP];
-    uint16 pc = gb->registers[REG_PC];
+    TraceRecord record;
+    fillTraceRecord(gb, &record);
+    printTraceLogLine(file, &record);
+}
+
+void printGameboyStats(FILE* file, GameBoy* gb) {
+    char title[CART_TITLE_LENGTH + 1] = {0};
+    for (uint32 i = 0; gb->cartridge && i < CART_TITLE_LENGTH; i++) {
+        char c = gb->rom[CART_TITLE + i];
+        if (!c) {
+            break;
+        }
+        title[i] = (c >= ' ' && c <= '~') ? c : '?';
+    }
 
-    fprintf(file, "A: %02X F: %02X B: %02X C: %02X D: %02X E: %02X H: %02X L: %02X SP: %04X PC: 00:%04X (%02X %02X %02X %02X)\n",
-            a, f, b, c, d, e, h, l, sp, pc,
-            readMemory(gb, pc),
-            readMemory(gb, pc + 1),
-            readMemory(gb, pc + 2),
-            readMemory(gb, pc + 3));
+    fprintf(file, "Statistics for '%s' :\n", title);
+    fprintf(file, "  cycles          %u\n", gb->clock);
+    fprintf(file, "  idle loop skips %u (%llu cycles, %.1f%%)\n",
+            gb->stats.idleLoopSkips,
+            (unsigned long long)gb->stats.idleLoopCycles,
+            gb->clock ? 100.0 * gb->stats.idleLoopCycles / gb->clock : 0.0);
 }
 
-bool32 loadRom(GameBoy* gb, const char* filename) {
-    bool32 success;
-    uint64 fsize = platform.getFileSize(filename, &success);
+// FNV-1a, 64 bits
+static uint64 hashMemory(const uint8* data, uint64 size) {
+    uint64 hash = 0xCBF29CE484222325ull;
 
-    if (!success) {
-        gbError(gb, "Failed to open file %s", filename);
-        return false;
+    for (uint64 i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
     }
 
-    if (fsize > sizeof(gb->rom)) {
-        gbError(gb, "File %s is larger than maximum supported size %zu\n",
-                filename, sizeof(gb->rom));
+    return hash;
+}
+
+// Checked by the boot ROM, which doesn't start the game if it's wrong
+static uint8 computeHeaderChecksum(const uint8* rom) {
+    uint8 checksum = 0;
+
+    for (uint16 address = CART_TITLE; address < CART_HEADER_CHECKSUM; address++) {
+        checksum = checksum - rom[address] - 1;
     }
-    success = platform.readFileIntoMemory(filename, gb->rom, fsize);
 
-    switch (gb->rom[CART_TYPE]) {
+    return checksum;
+}
+
+// Sum of every byte but its own two, never checked by the hardware
+static uint16 computeGlobalChecksum(const uint8* rom, uint64 size) {
+    uint16 checksum = 0;
+
+    for (uint64 i = 0; i < size; i++) {
+        checksum += rom[i];
+    }
+
+    return checksum - rom[CART_GLOBAL_CHECKSUM] - rom[CART_GLOBAL_CHECKSUM + 1];
+}
+
+static bool32 readCartridgeHeader(Cartridge* cartridge, const char* filename) {
+    const uint8* rom = cartridge->rom;
+    uint64 size = cartridge->romSize;
+
+    if (size < CART_HEADER_END || size > CART_MAX_ROM_SIZE) {
+        fprintf(stderr, "File %s is %llu bytes, ROMs have a header and at most %u bytes\n",
+                filename, (unsigned long long)size, CART_MAX_ROM_SIZE);
+        return false;
+    }
+
+    cartridge->type = rom[CART_TYPE];
+    switch (cartridge->type) {
     case CART_ROM_ONLY:
         break;
     case CART_MBC1:
         break;
     default:
-        fprintf(stderr, "Unknown cart type %02X\n", gb->rom[CART_TYPE]);
+        fprintf(stderr, "Unknown cart type %02X\n", cartridge->type);
         return false;
     }
 
-    if (gb->rom[CART_ROM_SIZE] > 0x08) {
-        fprintf(stderr, "Unknown cart ROM size %02X\n", gb->rom[CART_ROM_SIZE]);
+    if (rom[CART_ROM_SIZE] > 0x08) {
+        fprintf(stderr, "Unknown cart ROM size %02X\n", rom[CART_ROM_SIZE]);
         return false;
     }
-    gb->mbc1.romBankCount = (2 << (gb->rom[CART_ROM_SIZE]));
+    cartridge->romBankCount = (2 << (rom[CART_ROM_SIZE]));
 
-    switch (gb->rom[CART_RAM_SIZE]) {
+    // the banks are read straight from the mapping, all of them have to
+    // be in the file
+    if (size < (uint64)cartridge->romBankCount * 0x4000) {
+        fprintf(stderr, "File %s is %llu bytes, its header says %u rom banks of 16KB\n",
+                filename, (unsigned long long)size, cartridge->romBankCount);
+        return false;
+    }
+
+    switch (rom[CART_RAM_SIZE]) {
     case 0x00:
-        gb->mbc1.ramBankCount = 0;
+        cartridge->ramBankCount = 0;
         break;
     case 0x02:
-        gb->mbc1.ramBankCount = 1;
+        cartridge->ramBankCount = 1;
         break;
     case 0x03:
-        gb->mbc1.ramBankCount = 4;
+        cartridge->ramBankCount = 4;
         break;
     case 0x04:
-        gb->mbc1.ramBankCount = 16;
+        cartridge->ramBankCount = 16;
         break;
     case 0x05:
-        gb->mbc1.ramBankCount = 8;
+        cartridge->ramBankCount = 8;
         break;
     default:
-        fprintf(stderr, "Unknown cart RAM size %02X\n", gb->rom[CART_RAM_SIZE]);
+        fprintf(stderr, "Unknown cart RAM size %02X\n", rom[CART_RAM_SIZE]);
         return false;
     }
 
-    printf("Loaded a cartridge of size %zu, %u rom banks and %u ram banks\n",
-           fsize,
-           gb->mbc1.romBankCount,
-           gb->mbc1.ramBankCount);
+    // Only warnings : test ROMs and homebrew often leave them out
+    uint8 headerChecksum = computeHeaderChecksum(rom);
+    if (headerChecksum != rom[CART_HEADER_CHECKSUM]) {
+        fprintf(stderr, "Warning : header checksum is %02X, the header says %02X\n",
+                headerChecksum, rom[CART_HEADER_CHECKSUM]);
+    }
+
+    uint16 globalChecksum = computeGlobalChecksum(rom, size);
+    uint16 expectedGlobalChecksum = (rom[CART_GLOBAL_CHECKSUM] << 8) | rom[CART_GLOBAL_CHECKSUM + 1];
+    if (globalChecksum != expectedGlobalChecksum) {
+        fprintf(stderr, "Warning : global checksum is %04X, the header says %04X\n",
+                globalChecksum, expectedGlobalChecksum);
+    }
+
+    return true;
+}
+
+// Maps the ROM file and reads its header, without copying anything :
+// the pages are shared by every GameBoy the cartridge is inserted in,
+// and with the other processes running the same file.  The cartridge
+// is read-only from then on, see insertCartridge.
+bool32 loadRom(Cartridge* cartridge, const char* filename) {
+    uint64 size = 0;
+    const uint8* rom = platform.mapFile(filename, &size);
+
+    if (!rom) {
+        fprintf(stderr, "Failed to open file %s\n", filename);
+        return false;
+    }
+
+    cartridge->rom = rom;
+    cartridge->romSize = size;
+    if (!readCartridgeHeader(cartridge, filename)) {
+        unloadRom(cartridge);
+        return false;
+    }
+    cartridge->hash = hashMemory(rom, size);
+
+    fprintf(stderr, "Loaded a cartridge of size %llu, %u rom banks and %u ram banks\n",
+            (unsigned long long)size,
+            cartridge->romBankCount,
+            cartridge->ramBankCount);
     
-    return success;
+    return true;
 }
 
-void initializeGameboy(GameBoy* gb) {
+// No GameBoy can have the cartridge inserted anymore
+void unloadRom(Cartridge* cartridge) {
+    if (cartridge->rom) {
+        platform.unmapFile((void*)cartridge->rom, cartridge->romSize);
+        cartridge->rom = 0;
+    }
+}
+
+uint64 getExternalRamSize(const Cartridge* cartridge) {
+    return (uint64)cartridge->ramBankCount * 0x2000;
+}
+
+// externalRam is getExternalRamSize(cartridge) bytes (or 0 if that's
+// 0) that belong to gb, the cartridge can be shared
+void insertCartridge(GameBoy* gb, const Cartridge* cartridge, uint8* externalRam) {
+    gb->cartridge = cartridge;
+    gb->rom = cartridge->rom;
+    gb->externalRam = externalRam;
+    gb->mbc1.romBankCount = cartridge->romBankCount;
+    gb->mbc1.ramBankCount = cartridge->ramBankCount;
+
+    updateMemoryMap(gb);
+}
+
+// decodedBlocks : DECODE_CACHE_SIZE blocks, or 0 to run without the
+// decode cache.  tileCache : 0 is meant for instances that never draw a
+// frame (frame skip 0), drawing still works but decodes every tile row
+// it reads.  Nothing is mapped at 0x0000-0x7FFF and 0xA000-0xBFFF until
+// insertCartridge.
+void initializeGameboy(GameBoy* gb, DecodedBlock* decodedBlocks, TileCache* tileCache) {
+    gb->decodedBlocks = decodedBlocks;
+    gb->tileCache = tileCache;
     gb->joypad = 0xFF;
     gb->mbc1.ramEnable = 0;
     gb->mbc1.romBankIndex = 1;
     gb->mbc1.ramBankIndex = 0;
     gb->mbc1.bankingMode = 0;
     
-    REG(AF) = 0x01B0;
+    REG8(REG_A) = 0x01;
+    setFlags(gb, 0xB0);
     REG(BC) = 0x0013;
     REG(DE) = 0x00D8;
     REG(HL) = 0x014D;
@@ -483,7 +786,28 @@ void initializeGameboy(GameBoy* gb) {
 
     gb->ie = 0x00;
     gb->clock = 0;
-    gb->timerAccumulator = 0;
-    gb->renderingAccumulator = 0;
     gb->halted = false;
+    gb->timerReads = 0;
+
+    for (uint32 tile = 0; tile < TILE_COUNT; tile++) {
+        gb->dirtyTileRows[tile] = 0xFF;
+    }
+
+    gb->renderInterval = 1;
+    gb->framesSkipped = 0;
+    gb->frameRequested = false;
+    gb->drawingFrame = true;
+    gb->stats.idleLoopCycles = 0;
+    gb->stats.idleLoopSkips = 0;
+    gb->callStackHeight = 0;
+    gb->tracing = 0;
+    gb->traceBuffer = 0;
+    gb->guestProfile = 0;
+    gb->sampleInterval = 0;
+#ifdef GAMEBOY_OPCODE_PROFILE
+    gb->opcodeProfile = 0;
+#endif
+    initializeScheduler(gb);
+
+    updateMemoryMap(gb);
 }
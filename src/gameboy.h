@@ -6,6 +6,20 @@
 #define GAMEBOY_CYCLES_PER_SCANLINE 456
 #define GAMEBOY_LY_VBLANK 144
 #define GAMEBOY_LY_MAX 154
+#define GAMEBOY_CYCLES_PER_FRAME (GAMEBOY_CYCLES_PER_SCANLINE * GAMEBOY_LY_MAX)
+#define MAX_SPRITES_PER_LINE 10
+
+#define TILE_COUNT 384 // tiles in the three tile data blocks
+#define TILE_DATA_SIZE (TILE_COUNT * 16)
+#define TILE_SHEET_WIDTH (16 * 8)
+#define TILE_SHEET_HEIGHT (TILE_COUNT / 16 * 8)
+
+#define MEMORY_PAGE_SIZE 256
+#define MEMORY_PAGE_COUNT (0x10000 / MEMORY_PAGE_SIZE)
+
+#define DECODE_CACHE_BITS 12
+#define DECODE_CACHE_SIZE (1 << DECODE_CACHE_BITS)
+#define DECODED_BLOCK_MAX_INSTRUCTIONS 16
 
 
 #include <stdio.h>
@@ -22,22 +36,262 @@ enum JoypadButton {
     JP_DOWN,
 };
 
-typedef struct FIFOPixel {
-    uint8 colorIndex;
-} FIFOPixel;
+// GAMEBOY_OPCODE_PROFILE : primary opcodes, then 0x100 + the CB opcodes.
+// About 1 MB with the pairs, given by the host with setOpcodeProfile.
+#define OPCODE_PROFILE_SIZE 512
+
+typedef struct OpcodeProfile {
+    uint64 counts[OPCODE_PROFILE_SIZE];
+    uint64 cycles[OPCODE_PROFILE_SIZE]; // emulated
+    uint64 ticks[OPCODE_PROFILE_SIZE]; // host TSC
+    // [previous][current], how often an opcode directly follows another
+    uint32 pairCounts[OPCODE_PROFILE_SIZE][OPCODE_PROFILE_SIZE];
+    uint16 previous;
+    bool32 hasPrevious;
+} OpcodeProfile;
+
+enum SchedulerEvent {
+    EVENT_TIMER, // TIMA overflow
+    EVENT_PPU_MODE, // mode change within a visible scanline
+    EVENT_SCANLINE, // LY increment, vblank and end of frame
+    EVENT_PROFILE_SAMPLE, // see startGuestProfile
+    EVENT_COUNT,
+};
 
-typedef struct PixelFIFO {
-    FIFOPixel pixels[16];
-    uint8 start;
-    uint8 end;
-} PixelFIFO;
+// Shadow call stack : one frame per call, rst and interrupt, popped by
+// the ret that reads the return address (or any ret from further up
+// the guest stack, for routines that drop their return address)
+#define CALL_STACK_SIZE 64
+
+typedef struct CallFrame {
+    uint16 bank; // ROM bank of the routine, 0 outside of 0x4000-0x7FFF
+    uint16 address; // routine entry point
+    uint16 sp; // address of the return address on the guest stack
+} CallFrame;
+
+// Sampling profiler : (bank, PC) every sampleInterval cycles, in a
+// histogram and in a tree of the call stacks, all in a fixed-size
+// block of memory provided by the platform layer
+#define PROFILE_HISTOGRAM_SIZE 65536 // power of 2, open addressing
+#define PROFILE_NODE_COUNT 65536
+#define PROFILE_MAX_SYMBOLS 16384
+#define PROFILE_SYMBOL_LENGTH 48
+#define PROFILE_DEFAULT_INTERVAL 4096 // about 1000 samples per second
+
+// bank << 16 | address
+typedef uint32 ProfileKey;
+
+typedef struct ProfileSymbol {
+    ProfileKey key;
+    char name[PROFILE_SYMBOL_LENGTH];
+} ProfileSymbol;
+
+// Node of the call tree : a routine entry for the inner nodes, the
+// sampled PC for the leaves
+typedef struct ProfileNode {
+    ProfileKey key;
+    uint32 parent;
+    uint32 firstChild; // 0 : none, node 0 is the root
+    uint32 nextSibling;
+    uint32 count; // samples that ended on this node
+} ProfileNode;
+
+typedef struct ProfileEntry {
+    ProfileKey key;
+    uint32 count; // 0 : empty slot
+} ProfileEntry;
+
+typedef struct GuestProfile {
+    uint32 sampleCount;
+    uint32 droppedSamples; // the histogram or the tree was full
+
+    ProfileEntry histogram[PROFILE_HISTOGRAM_SIZE];
+    ProfileEntry sorted[PROFILE_HISTOGRAM_SIZE]; // scratch for writeProfileHistogram
+
+    uint32 nodeCount;
+    ProfileNode nodes[PROFILE_NODE_COUNT];
+
+    uint32 symbolCount;
+    ProfileSymbol symbols[PROFILE_MAX_SYMBOLS]; // sorted by key
+} GuestProfile;
+
+// Save state : a fixed header with a table of sections, each one the
+// raw bytes of a GameBoy field (see SAVESTATE_FIELDS in savestate.c),
+// aligned so that a mapped file can be loaded with one memcpy per
+// section.  The ROM isn't in the state, only its hash.
+#define SAVESTATE_MAGIC 0x53534247 // "GBSS"
+#define SAVESTATE_VERSION 2
+#define SAVESTATE_MAX_SECTIONS 64
+#define SAVESTATE_ALIGNMENT 64
+
+typedef struct SaveStateSection {
+    uint32 id; // index in SAVESTATE_FIELDS
+    uint32 size;
+    uint64 offset; // from the start of the state
+} SaveStateSection;
+
+typedef struct SaveStateHeader {
+    uint32 magic;
+    uint32 version;
+    uint64 romHash; // see Cartridge.hash
+    uint64 size; // of the whole state
+    uint32 sectionCount;
+    uint32 reserved;
+    SaveStateSection sections[SAVESTATE_MAX_SECTIONS];
+} SaveStateHeader;
+
+// Rewind : a save state every frame, XORed with the state of the last
+// keyframe (one every REWIND_KEYFRAME_INTERVAL frames, stored XORed
+// with zeros) and run-length encoded into a ring of compressed records.
+// The oldest group of a keyframe and its deltas is dropped when the
+// ring is full.  All in one block of memory given by the platform layer.
+#define REWIND_KEYFRAME_INTERVAL 60
+#define REWIND_MAX_FRAMES (1 << 16) // about 18 minutes
+#define REWIND_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+typedef struct RewindFrame {
+    uint64 start; // offset in the ring, counting from the first record ever
+    uint32 size;
+    bool32 keyframe;
+} RewindFrame;
+
+typedef struct RewindBuffer {
+    uint64 stateSize;
+    uint8* state; // scratch, the state recorded or restored
+    uint8* keyframe; // state of the keyframe of the newest group
+    uint8* encoded; // scratch, the record being written
+
+    RewindFrame* frames; // REWIND_MAX_FRAMES, indexed by frame number
+    uint64 firstFrame; // always a keyframe
+    uint64 endFrame;
+    uint64 keyframeFrame; // keyframe of the newest group
+
+    uint8* data;
+    uint64 capacity;
+    uint64 end; // offset after the newest record
+
+    // statistics, see printRewindStats
+    uint64 recordedFrames;
+    uint64 recordedBytes;
+} RewindBuffer;
+
+// Run-ahead : each frame shown, emulate the next frame and save the
+// state, emulate frames more with the same input and draw the last
+// one, then load the state back.  Input shows up that many frames
+// sooner, for frames + 1 emulated frames per frame shown.
+#define RUN_AHEAD_MAX_FRAMES 4
+
+typedef struct RunAhead {
+    uint32 frames; // 0 : off
+    void* state; // getSaveStateSize bytes, from the platform layer
+    uint64 stateSize;
+
+    // Cost per frame shown, in microseconds, see printRunAheadStats
+    uint64 frameCount;
+    uint64 lastTime;
+    uint64 maxTime;
+    uint64 totalTime;
+    uint64 emulationTime;
+    uint64 saveTime;
+    uint64 loadTime;
+} RunAhead;
+
+typedef struct DecodedInstruction {
+    uint8 opcode;
+    uint8 length;
+    uint8 operands[2];
+    uint16 cycles; // same as the handler table, including VARIABLE_CYCLES
+} DecodedInstruction;
+
+// Straight-line run of instructions ending at the first jump, call,
+// return or halt.  Never crosses a 256-byte page, so that a write to
+// one page invalidates every block decoded from it.
+typedef struct DecodedBlock {
+    uint16 bank;
+    uint16 pc;
+    uint32 generation; // codePageGenerations[] of the page when decoded
+    uint16 fixedCycles; // total of the non-variable instruction cycles
+    uint8 instructionCount; // 0 if the entry is empty
+    bool32 idleLoop; // jumps back to itself and doesn't write, see runIdleLoop
+    uint8 idleLoopMisses;
+    DecodedInstruction instructions[DECODED_BLOCK_MAX_INSTRUCTIONS];
+
+    // GAMEBOY_JIT only : number of executions and compiled code, valid
+    // while jitGeneration matches the code arena
+    uint32 hits;
+    uint32 jitGeneration;
+    void* jitCode;
+} DecodedBlock;
+
+// The tiles of VRAM decoded to color indices, as is and flipped
+// horizontally
+typedef uint8 TileCache[2][TILE_COUNT][8][8];
+
+// CPU registers.  The byte of an 8-bit register is
+// bytes[REG8_INDEX(reg)], with the register numbered as in the 3-bit
+// operand field of the opcodes (B, C, D, E, H, L, (HL), A), so
+// handlers index it with that field directly.  B/C, D/E and H/L share
+// storage with the BC, DE and HL pairs.  The only way to also get A
+// at index 7 is to make it the low byte of its pair, so the AF slot
+// holds F in its high byte : read A and F separately, never pairs[REG_AF].
+typedef union Registers {
+    uint16 pairs[6]; // indexed by enum Register16
+    uint8 bytes[12];
+} Registers;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define REG8_INDEX(reg) (reg)
+#else
+#define REG8_INDEX(reg) ((reg) ^ 1)
+#endif
+
+// Binary trace : one record per instruction while gb->tracing is set,
+// in a ring buffer provided by the platform layer (an mmap'd file in
+// gameboy-headless).  gb-trace turns the records into text.
+#define TRACE_MAGIC 0x52544247 // "GBTR"
+#define TRACE_DEFAULT_CAPACITY (1 << 18)
+
+// State before the instruction at pc runs
+typedef struct TraceRecord {
+    uint32 clock;
+    uint16 pc;
+    uint16 bank;
+    uint16 sp;
+    uint8 a, f, b, c, d, e, h, l;
+    uint8 bytes[4]; // memory at pc : the instruction and what follows
+} TraceRecord;
+
+typedef struct TraceBuffer {
+    uint32 magic;
+    uint32 capacity; // records
+    uint64 written; // total, the last ones are at written % capacity
+    TraceRecord records[];
+} TraceBuffer;
+
+#define TRACE_BUFFER_SIZE(capacity) (sizeof(TraceBuffer) + (uint64)(capacity) * sizeof(TraceRecord))
+
+#define CART_MAX_ROM_SIZE (2 * 1024 * 1024) // Max 16Mb = 2MB total rom
+#define CART_MAX_RAM_SIZE (128 * 1024)
+
+// The ROM image and what loadRom reads from its header.  Never written
+// once loaded : any number of GameBoys can run the same cartridge,
+// each with its own external RAM (see insertCartridge).
+typedef struct Cartridge {
+    const uint8* rom; // the file, mapped read-only until unloadRom
+    uint64 romSize;
+    uint64 hash; // FNV-1a of the ROM file, to match save states with it
+    uint8 type;
+    uint16 romBankCount;
+    uint16 ramBankCount;
+} Cartridge;
 
 typedef struct GameBoy {
     // memory
-    uint16 registers[6];
-    uint8 rom[2 * 1024 * 1024]; // Max 16Mb = 2MB total rom
+    Registers registers;
+    const Cartridge* cartridge; // 0 until insertCartridge
+    const uint8* rom; // cartridge->rom
     uint8 ram[8 * 1024]; // 8KB base RAM
-    uint8 externalRam[128 * 1024]; // up to 128KB cartridge RAM
+    uint8* externalRam; // getExternalRamSize bytes, from the host
     uint8 vram[8 * 1024]; // 8KB video RAM
     uint8 oam[160];
     uint8 io[128];
@@ -45,6 +299,36 @@ typedef struct GameBoy {
     uint8 ie;
     uint8 ime;
 
+    // Lazy flags : the ALU instructions record their operands here
+    // instead of computing F, which is only up to date while op is
+    // LAZY_FLAGS_NONE.  Go through getFlag/setFlag, getReg8(REG_F) or
+    // materializeFlags rather than reading the low byte of AF.
+    struct {
+        uint8 op; // enum LazyFlagsOp
+        uint8 lhs;
+        uint8 rhs; // carry for the ops that don't have a right operand
+        uint8 result;
+        uint8 checked; // GAMEBOY_LAZY_FLAGS_CHECK only : F computed eagerly
+    } lazyFlags;
+
+    // Memory map : one pointer per 256-byte page of the address
+    // space, or 0 if accesses to that page need special handling (IO
+    // registers, MBC control, forbidden regions).  Rebuilt by
+    // updateMemoryMap whenever the bank configuration changes.
+    const uint8* readPages[MEMORY_PAGE_COUNT];
+    uint8* writePages[MEMORY_PAGE_COUNT];
+
+    // Decode cache, indexed by a hash of (bank, PC).  WRAM pages with
+    // cached code are unmapped in writePages so that writes to them go
+    // through writeUnmappedMemory, which bumps the page generation and
+    // thereby invalidates the blocks decoded from it.  The blocks
+    // (DECODE_CACHE_SIZE of them) come from the host, 0 turns the cache
+    // off and every instruction goes through executeCycle.
+    DecodedBlock* decodedBlocks;
+    uint32 codePageGenerations[MEMORY_PAGE_COUNT];
+    uint8 codePages[MEMORY_PAGE_COUNT];
+    uint8* nextOperand; // operand bytes of the instruction being executed
+
     uint8 joypad;
 
     // Memory bank controller
@@ -56,35 +340,97 @@ typedef struct GameBoy {
         
         uint16 romBankCount;
         uint16 ramBankCount;
+
+        // Banks currently visible at 0x0000, 0x4000 and 0xA000,
+        // recomputed by updateBanks when the registers above change.
+        // ramBankPtr is 0 while the cartridge RAM is disabled.
+        const uint8* rom0BankPtr;
+        const uint8* romBankPtr;
+        uint8* ramBankPtr;
     } mbc1;
 
     // timing
     uint16 variableCycles;
     uint32 clock;
+
+    // Scheduler : the timer and the PPU only do work at the clock of
+    // their next event, stepClock just compares the clock with the
+    // earliest one.  The timer is brought up to date lazily (syncTimer)
+    // when TIMA is read or TIMA/TAC are written.
+    uint32 eventClocks[EVENT_COUNT];
+    uint32 nextEventClock;
+    uint8 scheduledEvents; // one bit per enum SchedulerEvent
+    uint32 timerClock; // clock up to which TIMA and timerAccumulator are counted
     uint16 timerAccumulator;
-    uint16 renderingAccumulator;
+    uint32 scanlineClock; // clock at which the current scanline started
+    uint32 timerReads; // DIV and TIMA reads, which depend on the clock
     
     bool32 halted;
 
     // rendering
     uint8 screen[GAMEBOY_SCREEN_HEIGHT][GAMEBOY_SCREEN_WIDTH];
-    PixelFIFO backgroundFifo;
-    PixelFIFO spriteFifo;
+
+    // Frame skip : the PPU timing and interrupts are the same, but
+    // drawScreenRow is only called during the frames that are drawn,
+    // one in renderInterval (0 : only the ones asked with requestFrame).
+    // screen keeps the last frame drawn.
+    uint32 renderInterval;
+    uint32 framesSkipped; // since the last frame drawn
+    bool32 frameRequested;
+    bool32 drawingFrame; // whether the frame in progress is drawn
+
+    // Tile cache, from the host like the decode cache.  Tile data pages
+    // are unmapped in writePages so that writes go through
+    // writeUnmappedMemory, which sets the bit of the row in
+    // dirtyTileRows.  Read through getTileRow, which decodes the row
+    // again every time when there is no cache.
+    TileCache* tileCache;
+    uint8 dirtyTileRows[TILE_COUNT];
+    uint8 decodedTileRow[2][8]; // getTileRow's result without a tile cache
     bool32 frameReady;
     uint8 renderingMode; // 0 = HBlank, 1 = VBlank, 2 = Searching OAM, 3 = data to LCD
     
     // debugging
     uint16 callStackHeight;
-    uint32 tracing;
+    CallFrame callStack[CALL_STACK_SIZE]; // see pushCallFrame
+    uint32 tracing; // instructions left to trace into traceBuffer
+    TraceBuffer* traceBuffer;
+    GuestProfile* guestProfile; // 0 unless profiling
+    uint32 sampleInterval;
+
+    // Statistics since the ROM was loaded, see printGameboyStats
+    struct {
+        uint64 idleLoopCycles; // cycles skipped in idle loops
+        uint32 idleLoopSkips;
+    } stats;
+
+#ifdef GAMEBOY_OPCODE_PROFILE
+    OpcodeProfile* opcodeProfile; // 0 unless profiling, see printOpcodeProfile
+#endif
+
+#ifdef GAMEBOY_JIT
+    // The block running with generated code, see jitTick.  The code
+    // arena itself is shared by every GameBoy : with GAMEBOY_JIT, any
+    // number of instances can run one after the other, but only on one
+    // thread.
+    struct {
+        uint32 startClock; // of the runCycles call in progress
+        uint32 cycleBudget;
+        uint16 codePage; // the block was compiled from
+        const uint8* codePagePointer; // readPages[codePage] when the block started
+    } jit;
+#endif
 } GameBoy;
 
-#define REG(name) gb->registers[REG_##name]
+#define REG(name) gb->registers.pairs[REG_##name]
+// 8-bit register by number, not for REG_F (see getFlag) or (HL)
+#define REG8(index) gb->registers.bytes[REG8_INDEX(index)]
 
 enum Register16 {
-    REG_AF,
     REG_BC,
     REG_DE,
     REG_HL,
+    REG_AF, // F:A, see Registers
     REG_SP,
     REG_PC,
 };
@@ -154,6 +500,18 @@ enum CPUFlag {
     FLAG_Z = 7,
 };
 
+enum LazyFlagsOp {
+    LAZY_FLAGS_NONE, // F is up to date
+    LAZY_FLAGS_ADD,
+    LAZY_FLAGS_SUB, // also cp
+    LAZY_FLAGS_AND,
+    LAZY_FLAGS_OR, // also xor
+    LAZY_FLAGS_INC, // rhs is the unchanged carry
+    LAZY_FLAGS_DEC, // rhs is the unchanged carry
+    LAZY_FLAGS_SHIFT, // CB rotates, shifts and swap, rhs is the carry out
+    LAZY_FLAGS_ROTATE_A, // rlca, rla, rrca, rra : same without Z
+};
+
 enum SpecialAddress {
     ROM_SWITCHABLE_BANK_START = 0x4000,
     VRAM_START = 0x8000,
@@ -176,9 +534,14 @@ enum SpecialAddress {
     SPRITE_TILES_TABLE = 0x8000,
     SPRITE_ATTRIBUTE_TABLE = 0xFE00,
 
+    CART_TITLE = 0x0134,
+    CART_TITLE_LENGTH = 16,
     CART_TYPE = 0x0147,
     CART_ROM_SIZE = 0x0148,
     CART_RAM_SIZE = 0x0149,
+    CART_HEADER_CHECKSUM = 0x014D,
+    CART_GLOBAL_CHECKSUM = 0x014E, // big endian
+    CART_HEADER_END = 0x0150,
 };
 
 enum Interrupt {
@@ -211,9 +574,21 @@ void releaseButton(GameBoy* gb, enum JoypadButton button);
 
 uint8 readMemory(GameBoy* gb, uint16 address);
 void writeMemory(GameBoy* gb, uint16 address, uint8 value);
+void updateMemoryMap(GameBoy* gb);
+void updateBanks(GameBoy* gb);
+void flushDecodeCache(GameBoy* gb);
+void flushRamDecodeCache(GameBoy* gb);
+void protectCodePage(GameBoy* gb, uint16 page);
 
 void triggerInterrupt(GameBoy* gb, enum Interrupt interrupt);
 
+void initializeScheduler(GameBoy* gb);
+void resumeScheduler(GameBoy* gb);
+void runEvents(GameBoy* gb);
+void syncTimer(GameBoy* gb);
+void scheduleTimer(GameBoy* gb);
+void scheduleModeCheck(GameBoy* gb);
+
 uint8 getBit(uint8 byte, uint8 index);
 uint8 resetBit(uint8 value, uint8 index);
 uint8 setBit(uint8 value, uint8 index);
@@ -225,20 +600,80 @@ void setLowByte(GameBoy* gb, enum Register16 reg, uint8 value);
 
 bool32 getFlag(GameBoy* gb, enum CPUFlag flag);
 void setFlag(GameBoy* gb, enum CPUFlag flag, bool32 value);
+void setFlags(GameBoy* gb, uint8 flags);
+uint8 evaluateFlags(GameBoy* gb);
+void materializeFlags(GameBoy* gb);
 
 uint8 getReg8(GameBoy* gb, uint8 index);
 void setReg8(GameBoy* gb, uint8 index, uint8 value);
 
 void executeCycle(GameBoy* gb);
+// One instruction at PC, without stepping the clock, returns its cycles
+uint8 executeInstruction(GameBoy* gb);
+// Runs until a frame is complete or at least cycleCount cycles have
+// elapsed, returns the number of cycles actually run
+uint32 runCycles(GameBoy* gb, uint32 cycleCount);
 
 void gbprintf(GameBoy* gb, const char* message, ...);
 void printGameboyState(GameBoy* gb);
 void printGameboyLogLine(FILE* file, GameBoy* gb);
-
-bool32 loadRom(GameBoy* gb, const char* filename);
+void printGameboyStats(FILE* file, GameBoy* gb);
+#ifdef GAMEBOY_OPCODE_PROFILE
+void setOpcodeProfile(GameBoy* gb, OpcodeProfile* profile);
+void printOpcodeProfile(FILE* file, GameBoy* gb);
+#endif
+
+void initializeTraceBuffer(TraceBuffer* buffer, uint32 capacity);
+void startTrace(GameBoy* gb, TraceBuffer* buffer, uint32 instructionCount);
+void stopTrace(GameBoy* gb);
+void recordTrace(GameBoy* gb);
+void fillTraceRecord(GameBoy* gb, TraceRecord* record);
+void printTraceLogLine(FILE* file, TraceRecord* record);
+uint32 getTraceRecordCount(TraceBuffer* buffer);
+TraceRecord* getTraceRecord(TraceBuffer* buffer, uint32 index);
+bool32 writeTraceBuffer(TraceBuffer* buffer, const char* filename);
+bool32 parseTraceLogLine(const char* line, TraceRecord* record);
+bool32 printTraceDifferences(FILE* file, TraceRecord* expected, TraceRecord* actual);
+void disassembleInstruction(FILE* file, uint8* bytes);
+
+uint64 getSaveStateSize(GameBoy* gb);
+uint64 writeSaveState(GameBoy* gb, void* buffer, uint64 bufferSize);
+bool32 readSaveState(GameBoy* gb, void* buffer, uint64 size);
+const char* getSaveStateSectionName(uint32 id);
+
+bool32 initializeRewindBuffer(RewindBuffer* buffer, uint64 stateSize,
+                              void* memory, uint64 memorySize);
+void recordRewindFrame(RewindBuffer* buffer, GameBoy* gb);
+bool32 rewindFrame(RewindBuffer* buffer, GameBoy* gb);
+void printRewindStats(FILE* file, RewindBuffer* buffer);
+
+void initializeRunAhead(RunAhead* runAhead, void* state, uint64 stateSize);
+void setRunAheadFrames(GameBoy* gb, RunAhead* runAhead, uint32 frames);
+void runFrameAhead(GameBoy* gb, RunAhead* runAhead);
+void printRunAheadStats(FILE* file, RunAhead* runAhead);
+
+void startGuestProfile(GameBoy* gb, GuestProfile* profile, uint32 sampleInterval);
+void stopGuestProfile(GameBoy* gb);
+void recordProfileSample(GameBoy* gb);
+void clearGuestProfile(GuestProfile* profile);
+bool32 loadProfileSymbols(GuestProfile* profile, const char* filename);
+bool32 loadRomSymbols(GuestProfile* profile, const char* romFilename);
+void writeProfileHistogram(FILE* file, GuestProfile* profile);
+void writeFoldedStacks(FILE* file, GuestProfile* profile);
+
+bool32 loadRom(Cartridge* cartridge, const char* filename);
+void unloadRom(Cartridge* cartridge);
+uint64 getExternalRamSize(const Cartridge* cartridge);
+void insertCartridge(GameBoy* gb, const Cartridge* cartridge, uint8* externalRam);
 
 void drawScreenRow(GameBoy* gb, uint8 y);
+void setFrameSkip(GameBoy* gb, uint32 renderInterval);
+void requestFrame(GameBoy* gb);
+uint8* getTileRow(GameBoy* gb, uint16 tile, uint8 row, bool32 flipped);
+void drawTileSheet(GameBoy* gb, uint8 pixels[TILE_SHEET_HEIGHT][TILE_SHEET_WIDTH]);
+
+uint16 getAddressBank(GameBoy* gb, uint16 address);
 
 void gbError(GameBoy* gb, const char* message, ...);
 
-void initializeGameboy(GameBoy* gb);
+void initializeGameboy(GameBoy* gb, DecodedBlock* decodedBlocks, TileCache* tileCache);
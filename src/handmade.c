@@ -7,6 +7,7 @@
 
 PlatformFunctions platform;
 OpenGLFunctions gl;
+static bool32 libraryLoaded; // false again after every hot reload
 
 void openglDebugCallback(GLenum source,
                          GLenum type,
@@ -101,6 +102,43 @@ internal GLuint createShaderProgramFromSources(MemoryArena* arena,
     return program;
 }
 
+// Write the tile viewer image as a binary PGM file
+internal void dumpTileSheet(GameBoy* gb, const char* filename) {
+    uint8 pixels[TILE_SHEET_HEIGHT][TILE_SHEET_WIDTH];
+    drawTileSheet(gb, pixels);
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return;
+    }
+
+    fprintf(file, "P5\n%d %d\n255\n", TILE_SHEET_WIDTH, TILE_SHEET_HEIGHT);
+    fwrite(pixels, 1, sizeof(pixels), file);
+    fclose(file);
+
+    fprintf(stderr, "Tiles written to %s\n", filename);
+}
+
+// Write the profile of the guest as profile.txt (histogram) and
+// profile.folded (for flamegraph.pl)
+internal void writeGuestProfile(GuestProfile* profile) {
+    FILE* file = fopen("profile.txt", "w");
+    if (file) {
+        writeProfileHistogram(file, profile);
+        fclose(file);
+    }
+
+    file = fopen("profile.folded", "w");
+    if (file) {
+        writeFoldedStacks(file, profile);
+        fclose(file);
+    }
+
+    fprintf(stderr, "Profile of %u samples written to profile.txt and profile.folded\n",
+            profile->sampleCount);
+}
+
 typedef struct ProgramState {
     bool32 isInitialized;
     bool32 paused;
@@ -113,6 +151,19 @@ typedef struct ProgramState {
     uint32 vbo;
     uint32 texture;
 
+    Cartridge* cartridge; // ROM mapped from the file, unmapped on reset
+    GuestProfile* guestProfile; // allocated the first time profiling starts
+    TraceBuffer* traceBuffer; // same for tracing
+    void* saveState; // F2 / F3, allocated on the first save
+    uint64 saveStateSize;
+
+    // R held : one frame back per frame displayed
+    RewindBuffer rewindBuffer; // in the transient arena
+    bool32 rewindAvailable;
+    bool32 rewinding;
+
+    RunAhead runAhead; // F4 changes the number of frames
+
     GameBoy gb;
 } ProgramState;
 
@@ -133,19 +184,10 @@ UPDATE_PROGRAM_AND_RENDER(updateProgramAndRender) {
     if (!state->isInitialized) {
         input->windowTitle = "Gameboy emulator";
 
-        // Initialize GB
-        state->paused = false;
-        initializeGameboy(gb);
-        
-        if (input->argc != 2) {
-            fprintf(stderr, "Usage : ./gameboy-emulator <rom>\n");
+        if (input->argc != 2 && input->argc != 3) {
+            fprintf(stderr, "Usage : ./gameboy-emulator <rom> [rewind buffer size in MB]\n");
             exit(1);
         }
-        
-        if (!loadRom(gb, input->argv[1])) {
-            fprintf(stderr, "Failed to load ROM\n");
-            return true;
-        }
 
         // Memory arenas
         initializeMemoryArena(&state->transientArena,
@@ -153,7 +195,43 @@ UPDATE_PROGRAM_AND_RENDER(updateProgramAndRender) {
                               memory->transientStorage);
         initializeMemoryArena(&state->permanentArena,
                               memory->permanentStorageSize - sizeof(ProgramState),
-                              (uint8*)memory->transientStorage + sizeof(ProgramState));
+                              (uint8*)memory->permanentStorage + sizeof(ProgramState));
+
+        // Initialize GB
+        state->paused = false;
+        initializeGameboy(gb, pushArray(&state->permanentArena, DECODE_CACHE_SIZE, DecodedBlock),
+                          pushOne(&state->permanentArena, TileCache));
+#ifdef GAMEBOY_OPCODE_PROFILE
+        setOpcodeProfile(gb, pushOne(&state->permanentArena, OpcodeProfile));
+#endif
+
+        state->cartridge = pushOne(&state->permanentArena, Cartridge);
+        if (!loadRom(state->cartridge, input->argv[1])) {
+            fprintf(stderr, "Failed to load ROM\n");
+            return true;
+        }
+        insertCartridge(gb, state->cartridge,
+                        pushSize_(&state->permanentArena,
+                                  getExternalRamSize(state->cartridge)));
+
+        uint64 rewindBudget = REWIND_DEFAULT_BUDGET;
+        if (input->argc == 3) {
+            rewindBudget = strtoull(input->argv[2], 0, 10) * 1024 * 1024;
+        }
+        initializeRunAhead(&state->runAhead,
+                           pushSize_(&state->permanentArena, getSaveStateSize(gb)),
+                           getSaveStateSize(gb));
+
+        state->rewinding = false;
+        state->rewindAvailable = rewindBudget
+            && rewindBudget <= state->transientArena.size - state->transientArena.used
+            && initializeRewindBuffer(&state->rewindBuffer, getSaveStateSize(gb),
+                                      pushSize_(&state->transientArena, rewindBudget),
+                                      rewindBudget);
+        if (rewindBudget && !state->rewindAvailable) {
+            fprintf(stderr, "No rewind buffer of %llu MB, rewind disabled\n",
+                    (unsigned long long)(rewindBudget / (1024 * 1024)));
+        }
 
         // Shader
         const char* vertexShaderSource =
@@ -243,10 +321,17 @@ UPDATE_PROGRAM_AND_RENDER(updateProgramAndRender) {
             " - A :      I\n"
             " - B :      J\n"
             " - Start :  5\n"
-            " - Select : 6\n");
+            " - Select : 6\n"
+            " - Rewind : R (hold)\n"
+            " - Run-ahead frames : F4\n");
 
         state->isInitialized = true;
+    } else if (!libraryLoaded) {
+        // Hot reload : the JIT code of the decoded blocks went away with
+        // the previous library
+        updateMemoryMap(gb);
     }
+    libraryLoaded = true;
 
     for (uint32 eventIndex = 0; eventIndex < input->eventCount; eventIndex++) {
         InputEvent* event = &input->events[eventIndex];
@@ -255,28 +340,106 @@ UPDATE_PROGRAM_AND_RENDER(updateProgramAndRender) {
             if (event->key.pressFlag == PRESS) {
                 switch (event->key.index) {
                 case KID_F5:
+                    unloadRom(state->cartridge);
                     platform.resetProgramMemory(memory);
                     return false;
+                case KID_F2:
+                    if (!state->saveState) {
+                        state->saveStateSize = getSaveStateSize(gb);
+                        state->saveState = pushSize_(&state->permanentArena,
+                                                     state->saveStateSize);
+                    }
+                    writeSaveState(gb, state->saveState, state->saveStateSize);
+                    fprintf(stderr, "State saved\n");
+                    break;
+                case KID_F3:
+                    if (state->saveState
+                        && readSaveState(gb, state->saveState, state->saveStateSize)) {
+                        fprintf(stderr, "State loaded\n");
+                    }
+                    break;
+                case KID_F4:
+                    setRunAheadFrames(gb, &state->runAhead,
+                                      (state->runAhead.frames + 1) % (RUN_AHEAD_MAX_FRAMES + 1));
+                    fprintf(stderr, "Run-ahead of %u frames\n", state->runAhead.frames);
+                    break;
                 case KID_SPACE:
                     state->paused = !state->paused;
                     break;
                 case KID_T:
-                    gb->tracing = gb->tracing ? 0 : ~0;
+                    if (gb->tracing) {
+                        stopTrace(gb);
+                        if (writeTraceBuffer(state->traceBuffer, "trace.bin")) {
+                            fprintf(stderr, "Trace written to trace.bin\n");
+                        }
+                    } else {
+                        if (!state->traceBuffer) {
+                            state->traceBuffer = (TraceBuffer*)pushSize_(
+                                &state->permanentArena, TRACE_BUFFER_SIZE(TRACE_DEFAULT_CAPACITY));
+                        }
+                        initializeTraceBuffer(state->traceBuffer, TRACE_DEFAULT_CAPACITY);
+                        startTrace(gb, state->traceBuffer, ~0);
+                    }
+                    break;
+                case KID_P:
+                    printGameboyStats(stderr, gb);
+                    if (state->rewindAvailable) {
+                        printRewindStats(stderr, &state->rewindBuffer);
+                    }
+                    if (state->runAhead.frames) {
+                        printRunAheadStats(stderr, &state->runAhead);
+                    }
+#ifdef GAMEBOY_OPCODE_PROFILE
+                    printOpcodeProfile(stderr, gb);
+#endif
+                    break;
+                case KID_V:
+                    dumpTileSheet(gb, "tiles.pgm");
+                    break;
+                case KID_O:
+                    if (gb->guestProfile) {
+                        stopGuestProfile(gb);
+                        writeGuestProfile(state->guestProfile);
+                    } else {
+                        if (!state->guestProfile) {
+                            state->guestProfile = pushOne(&state->permanentArena, GuestProfile);
+                            loadRomSymbols(state->guestProfile, input->argv[1]);
+                        }
+                        clearGuestProfile(state->guestProfile);
+                        startGuestProfile(gb, state->guestProfile, PROFILE_DEFAULT_INTERVAL);
+                        fprintf(stderr, "Profiling started\n");
+                    }
                     break;
                 }
             }
 
+            if (event->key.index == KID_R && event->key.pressFlag != REPEAT) {
+                state->rewinding = state->rewindAvailable
+                    && event->key.pressFlag == PRESS;
+            }
+
             if ((handleKey(gb, event->key.index, event->key.pressFlag))) {
                 triggerInterrupt(gb, INT_JOYPAD);
             }
         }
     }
 
-    if (!state->paused) {
-        while (!gb->frameReady) {
-            executeCycle(gb);
+    if (state->rewinding) {
+        // stays on the oldest frame once there is nothing left
+        rewindFrame(&state->rewindBuffer, gb);
+    } else if (!state->paused) {
+        if (state->runAhead.frames) {
+            runFrameAhead(gb, &state->runAhead);
+        } else {
+            while (!gb->frameReady) {
+                runCycles(gb, GAMEBOY_CYCLES_PER_FRAME);
+            }
+            gb->frameReady = false;
+        }
+
+        if (state->rewindAvailable) {
+            recordRewindFrame(&state->rewindBuffer, gb);
         }
-        gb->frameReady = false;
     }
 
     triggerInterrupt(gb, INT_VBLANK);
@@ -4,7 +4,11 @@
 
 #include <stdint.h>
 #include "handmade_types.h"
+// Headless builds (linux_headless.c) define HANDMADE_NO_GL so that the
+// core compiles without the OpenGL headers
+#ifndef HANDMADE_NO_GL
 #include "handmade_opengl.h"
+#endif
 #include "handmade_keyboard.h"
 
 #ifdef HANDMADE_INTERNAL
@@ -167,6 +171,9 @@ typedef struct PlatformFunctions {
     bool32 isInitialized;
     uint64 (*getFileSize)(const char* filepath, bool32* success);
     bool32 (*readFileIntoMemory)(const char* filepath, void* buffer, uint64 size);
+    // Read-only, private mapping of a whole file, 0 if it can't be mapped
+    void* (*mapFile)(const char* filepath, uint64* size);
+    void (*unmapFile)(void* data, uint64 size);
     uint64 (*getMicroseconds)(void);
     void (*outputBufferInConsole)(uint8* buffer, uint64 size);
     void (*resetProgramMemory)(struct ProgramMemory* memory);
@@ -176,7 +183,9 @@ typedef struct PlatformFunctions {
 typedef struct ProgramMemory {
     bool32 isInitialized;
     PlatformFunctions platform;
+#ifndef HANDMADE_NO_GL
     OpenGLFunctions gl;
+#endif
     
     uint64 transientStorageSize;
     void* transientStorage;
@@ -194,4 +203,6 @@ typedef UPDATE_PROGRAM_AND_RENDER(UpdateProgramAndRenderFunction);
 UPDATE_PROGRAM_AND_RENDER(update_program_and_render);
 
 extern PlatformFunctions platform;
+#ifndef HANDMADE_NO_GL
 extern OpenGLFunctions gl;
+#endif
@@ -5,6 +5,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+
+#ifdef GAMEBOY_OPCODE_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
 
 #define WR(address, value) writeMemory(gb, address, value)
 #define RD(address) readMemory(gb, address)
@@ -71,8 +80,9 @@ static void writeMemory16(GameBoy* gb, uint16 address, uint16 value) {
     writeMemory(gb, address + 1, value >> 8);
 }
 
+// Operands are fetched when the instruction is decoded
 static uint8 readImm8(GameBoy* gb) {
-    uint8 result = RD(REG(PC));
+    uint8 result = *gb->nextOperand++;
     REG(PC)++;
 
     return result;
@@ -91,33 +101,94 @@ static int8 readImmSigned(GameBoy* gb) {
     return (int8) readImm8(gb);
 }
 
-static void updateZeroFlag(GameBoy* gb, uint8 result) {
-    setFlag(gb, FLAG_Z, result == 0);
+#ifdef GAMEBOY_LAZY_FLAGS_CHECK
+
+// Flags of a lazy operation computed the way the handlers did before
+// lazy flags, checked against evaluateFlags after every instruction
+static uint8 computeCheckedFlags(GameBoy* gb, enum LazyFlagsOp op,
+                                 uint8 lhs, uint8 rhs, uint8 result) {
+    bool32 z = (result == 0);
+    bool32 n = 0;
+    bool32 h = 0;
+    bool32 c = 0;
+    
+    switch (op) {
+    case LAZY_FLAGS_ADD:
+        h = ((lhs & 0x0F) + (rhs & 0x0F)) & 0x10;
+        c = (lhs + rhs) >> 8;
+        break;
+    case LAZY_FLAGS_SUB:
+        n = 1;
+        h = ((lhs & 0x0F) - (rhs & 0x0F)) & 0x10;
+        c = ((uint16)(lhs - rhs)) >> 8;
+        break;
+    case LAZY_FLAGS_AND:
+        h = 1;
+        break;
+    case LAZY_FLAGS_OR:
+        break;
+    case LAZY_FLAGS_INC:
+        h = ((lhs & 0x0F) + 1) & 0x10;
+        c = getBit(gb->lazyFlags.checked, FLAG_C);
+        break;
+    case LAZY_FLAGS_DEC:
+        n = 1;
+        h = ((lhs & 0x0F) - 1) & 0x10;
+        c = getBit(gb->lazyFlags.checked, FLAG_C);
+        break;
+    case LAZY_FLAGS_SHIFT:
+        c = rhs;
+        break;
+    case LAZY_FLAGS_ROTATE_A:
+        z = 0;
+        c = rhs;
+        break;
+    default:
+        gbError(gb, "Unknown lazy flags operation %u", op);
+    }
+
+    return ((z != 0) << FLAG_Z) | ((n != 0) << FLAG_N)
+        | ((h != 0) << FLAG_H) | ((c != 0) << FLAG_C);
+}
+
+#endif
+
+// Records the operation instead of computing F, see evaluateFlags
+static void setLazyFlags(GameBoy* gb, enum LazyFlagsOp op,
+                         uint8 lhs, uint8 rhs, uint8 result) {
+#ifdef GAMEBOY_LAZY_FLAGS_CHECK
+    gb->lazyFlags.checked = computeCheckedFlags(gb, op, lhs, rhs, result);
+#endif
+    
+    gb->lazyFlags.op = op;
+    gb->lazyFlags.lhs = lhs;
+    gb->lazyFlags.rhs = rhs;
+    gb->lazyFlags.result = result;
 }
 
 INSTRUCTION_EXECUTE_FN(loadRegToReg) {
     enum Register8 src = opcode & 0x7;
     enum Register8 dst = (opcode >> 3) & 0x7;
 
-    setReg8(gb, dst, getReg8(gb, src));
+    REG8(dst) = REG8(src);
 }
 
 INSTRUCTION_EXECUTE_FN(loadImm8ToReg) {
     enum Register8 reg = (opcode - 6) >> 3;
 
-    setReg8(gb, reg, readImm8(gb));
+    REG8(reg) = readImm8(gb);
 }
 
 INSTRUCTION_EXECUTE_FN(loadAddrHLToReg) {
     enum Register8 dst = (opcode >> 3) & 0x7;
     
-    setReg8(gb, dst, RD(REG(HL)));
+    REG8(dst) = RD(REG(HL));
 }
 
 INSTRUCTION_EXECUTE_FN(loadRegToAddrHL) {
     enum Register8 src = opcode & 0x7;
     
-    WR(REG(HL), getReg8(gb, src));
+    WR(REG(HL), REG8(src));
 }
 
 INSTRUCTION_EXECUTE_FN(loadImm8ToAddrHL) {
@@ -125,69 +196,69 @@ INSTRUCTION_EXECUTE_FN(loadImm8ToAddrHL) {
 }
 
 INSTRUCTION_EXECUTE_FN(loadAddrBCToA) {
-    setReg8(gb, REG_A, RD(REG(BC)));
+    REG8(REG_A) = RD(REG(BC));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAddrDEToA) {
-    setReg8(gb, REG_A, RD(REG(DE)));
+    REG8(REG_A) = RD(REG(DE));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAToAddrBC) {
-    WR(REG(BC), getReg8(gb, REG_A));
+    WR(REG(BC), REG8(REG_A));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAToAddrDE) {
-    WR(REG(DE), getReg8(gb, REG_A));
+    WR(REG(DE), REG8(REG_A));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAToAddr16) {
-    WR(readImm16(gb), getReg8(gb, REG_A));
+    WR(readImm16(gb), REG8(REG_A));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAddr16ToA) {
-    setReg8(gb, REG_A, RD(readImm16(gb)));
+    REG8(REG_A) = RD(readImm16(gb));
 }
 
 INSTRUCTION_EXECUTE_FN(loadIOPortImm8ToA) {
-    setReg8(gb, REG_A, RD(0xFF00 + readImm8(gb)));
+    REG8(REG_A) = RD(0xFF00 + readImm8(gb));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAToIOPortImm8) {
-    WR(0xFF00 + readImm8(gb), getReg8(gb, REG_A));
+    WR(0xFF00 + readImm8(gb), REG8(REG_A));
 }
 
 INSTRUCTION_EXECUTE_FN(loadIOPortCToA) {
-    setReg8(gb, REG_A, RD(0xFF00 + getReg8(gb, REG_C)));
+    REG8(REG_A) = RD(0xFF00 + REG8(REG_C));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAToIOPortC) {
-    WR(0xFF00 + getReg8(gb, REG_C), getReg8(gb, REG_A));
+    WR(0xFF00 + REG8(REG_C), REG8(REG_A));
 }
 
 INSTRUCTION_EXECUTE_FN(loadAndIncrementAToAddrHL) {
-    WR(REG(HL), getReg8(gb, REG_A));
+    WR(REG(HL), REG8(REG_A));
     REG(HL)++;
 }
 
 INSTRUCTION_EXECUTE_FN(loadAndIncrementAddrHLToA) {
-    setReg8(gb, REG_A, RD(REG(HL)));
+    REG8(REG_A) = RD(REG(HL));
     REG(HL)++;
 }
 
 INSTRUCTION_EXECUTE_FN(loadAndDecrementAToAddrHL) {
-    WR(REG(HL), getReg8(gb, REG_A));
+    WR(REG(HL), REG8(REG_A));
     REG(HL)--;
 }
 
 INSTRUCTION_EXECUTE_FN(loadAndDecrementAddrHLToA) {
-    setReg8(gb, REG_A, RD(REG(HL)));
+    REG8(REG_A) = RD(REG(HL));
     REG(HL)--;
 }
 
 INSTRUCTION_EXECUTE_FN(loadImm16ToReg) {
     enum Register16 dst = BC_DE_HL_SP[(opcode - 1) >> 4];
 
-    gb->registers[dst] = readImm16(gb);
+    gb->registers.pairs[dst] = readImm16(gb);
 }
 
 INSTRUCTION_EXECUTE_FN(loadSPToAddr16) {
@@ -210,37 +281,61 @@ static uint16 doPop(GameBoy* gb) {
     return result;
 }
 
+// Called after pushing the return address, sp pointing to it
+static void pushCallFrame(GameBoy* gb, uint16 address, uint16 sp) {
+    if (gb->callStackHeight < CALL_STACK_SIZE) {
+        CallFrame* frame = &gb->callStack[gb->callStackHeight++];
+        frame->bank = getAddressBank(gb, address);
+        frame->address = address;
+        frame->sp = sp;
+    }
+}
+
+// Called before popping the return address at sp : drops its frame and
+// the ones of the routines that returned or jumped out some other way
+static void popCallFrames(GameBoy* gb, uint16 sp) {
+    while (gb->callStackHeight
+           && gb->callStack[gb->callStackHeight - 1].sp <= sp) {
+        gb->callStackHeight--;
+    }
+}
+
 INSTRUCTION_EXECUTE_FN(push) {
     enum Register16 src = BC_DE_HL_AF[(opcode - 0xC5) >> 4];
-    doPush(gb, gb->registers[src]);
+    
+    if (src == REG_AF) {
+        doPush(gb, (REG8(REG_A) << 8) | evaluateFlags(gb));
+    } else {
+        doPush(gb, gb->registers.pairs[src]);
+    }
 }
 
 INSTRUCTION_EXECUTE_FN(pop) {
     enum Register16 dst = BC_DE_HL_AF[(opcode - 0xC1) >> 4];
-    gb->registers[dst] = doPop(gb);
+    uint16 value = doPop(gb);
     
     if (dst == REG_AF) {
-        gb->registers[dst] = gb->registers[dst] & 0xFFF0;
+        REG8(REG_A) = value >> 8;
+        setFlags(gb, value & 0xF0);
+    } else {
+        gb->registers.pairs[dst] = value;
     }
 }
 
 static void doAdd(GameBoy* gb, uint8 rhs) {
-    uint8 lhs = getReg8(gb, REG_A);
+    uint8 lhs = REG8(REG_A);
     uint16 result16 = lhs + rhs;
     uint8 result = result16 & 0xFF;
     
-    setReg8(gb, REG_A, result);
+    REG8(REG_A) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) + (rhs & 0x0F)) & 0x10);
-    setFlag(gb, FLAG_C, result16 >> 8);
+    setLazyFlags(gb, LAZY_FLAGS_ADD, lhs, rhs, result);
 }
 
 INSTRUCTION_EXECUTE_FN(addReg) {
     enum Register8 rhs = opcode - 0x80;
 
-    doAdd(gb, getReg8(gb, rhs));
+    doAdd(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(addImm8) {
@@ -253,22 +348,21 @@ INSTRUCTION_EXECUTE_FN(addAddrHL) {
 
 
 static void doAdc(GameBoy* gb, uint8 rhs) {
-    uint8 lhs = getReg8(gb, REG_A);
+    uint8 lhs = REG8(REG_A);
     uint8 prevCarry = getFlag(gb, FLAG_C);
     uint16 result16 = lhs + rhs + prevCarry;
     uint8 result = result16 & 0xFF;
     
-    setReg8(gb, REG_A, result);
+    REG8(REG_A) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) + (rhs & 0x0F) + prevCarry) & 0x10);
-    setFlag(gb, FLAG_C, result16 >> 8);
+    setFlags(gb, ((result == 0) << FLAG_Z)
+             | ((((lhs & 0x0F) + (rhs & 0x0F) + prevCarry) & 0x10) << (FLAG_H - 4))
+             | ((result16 >> 8) << FLAG_C));
 }
 
 INSTRUCTION_EXECUTE_FN(adcReg) {
     enum Register8 rhs = opcode - 0x88;
-    doAdc(gb, getReg8(gb, rhs));
+    doAdc(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(adcImm8) {
@@ -280,21 +374,18 @@ INSTRUCTION_EXECUTE_FN(adcAddrHL) {
 }
 
 static void doSub(GameBoy* gb, uint8 rhs) {
-    uint8 lhs = getReg8(gb, REG_A);
+    uint8 lhs = REG8(REG_A);
     uint16 result16 = lhs - rhs;
     uint8 result = result16 & 0xFF;
     
-    setReg8(gb, REG_A, result);
+    REG8(REG_A) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 1);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) - (rhs & 0x0F)) & 0x10);
-    setFlag(gb, FLAG_C, result16 >> 8);
+    setLazyFlags(gb, LAZY_FLAGS_SUB, lhs, rhs, result);
 }
 
 INSTRUCTION_EXECUTE_FN(subReg) {
     enum Register8 rhs = opcode - 0x90;
-    doSub(gb, getReg8(gb, rhs));
+    doSub(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(subImm8) {
@@ -306,22 +397,22 @@ INSTRUCTION_EXECUTE_FN(subAddrHL) {
 }
 
 static void doSbc(GameBoy* gb, uint8 rhs) {
-    uint8 lhs = getReg8(gb, REG_A);
+    uint8 lhs = REG8(REG_A);
     uint8 prevCarry = getFlag(gb, FLAG_C);
     uint16 result16 = lhs - rhs - prevCarry;
     uint8 result = result16 & 0xFF;
     
-    setReg8(gb, REG_A, result);
+    REG8(REG_A) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 1);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) - (rhs & 0x0F) - prevCarry) & 0x10);
-    setFlag(gb, FLAG_C, result16 >> 8);
+    setFlags(gb, ((result == 0) << FLAG_Z)
+             | (1 << FLAG_N)
+             | ((((lhs & 0x0F) - (rhs & 0x0F) - prevCarry) & 0x10) << (FLAG_H - 4))
+             | (((result16 >> 8) != 0) << FLAG_C));
 }
 
 INSTRUCTION_EXECUTE_FN(sbcReg) {
     enum Register8 rhs = opcode - 0x98;
-    doSbc(gb, getReg8(gb, rhs));
+    doSbc(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(sbcImm8) {
@@ -334,19 +425,16 @@ INSTRUCTION_EXECUTE_FN(sbcAddrHL) {
 
 
 static void doAnd(GameBoy* gb, uint8 rhs) {
-    uint8 result = getReg8(gb, REG_A) & rhs;
-    setReg8(gb, REG_A, result);
+    uint8 result = REG8(REG_A) & rhs;
+    REG8(REG_A) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 1);
-    setFlag(gb, FLAG_C, 0);
+    setLazyFlags(gb, LAZY_FLAGS_AND, 0, 0, result);
 }
     
 
 INSTRUCTION_EXECUTE_FN(andReg) {
     enum Register8 rhs = opcode - 0xA0;
-    doAnd(gb, getReg8(gb, rhs));
+    doAnd(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(andImm8) {
@@ -359,18 +447,15 @@ INSTRUCTION_EXECUTE_FN(andAddrHL) {
 
 
 static void doXor(GameBoy* gb, uint8 rhs) {
-    uint8 result = getReg8(gb, REG_A) ^ rhs;
-    setReg8(gb, REG_A, result);
+    uint8 result = REG8(REG_A) ^ rhs;
+    REG8(REG_A) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, 0);
+    setLazyFlags(gb, LAZY_FLAGS_OR, 0, 0, result);
 }
 
 INSTRUCTION_EXECUTE_FN(xorReg) {
     enum Register8 rhs = opcode - 0xA8;
-    doXor(gb, getReg8(gb, rhs));
+    doXor(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(xorImm8) {
@@ -383,18 +468,15 @@ INSTRUCTION_EXECUTE_FN(xorAddrHL) {
 
 
 static void doOr(GameBoy* gb, uint8 rhs) {
-    uint8 result = getReg8(gb, REG_A) | rhs;
-    setReg8(gb, REG_A, result);
+    uint8 result = REG8(REG_A) | rhs;
+    REG8(REG_A) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, 0);
+    setLazyFlags(gb, LAZY_FLAGS_OR, 0, 0, result);
 }
 
 INSTRUCTION_EXECUTE_FN(orReg) {
     enum Register8 rhs = opcode - 0xB0;
-    doOr(gb, getReg8(gb, rhs));
+    doOr(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(orImm8) {
@@ -407,18 +489,15 @@ INSTRUCTION_EXECUTE_FN(orAddrHL) {
 
 
 void doCompare(GameBoy* gb, uint8 rhs) {
-    uint8 lhs = getReg8(gb, REG_A);
+    uint8 lhs = REG8(REG_A);
     
-    setFlag(gb, FLAG_Z, lhs == rhs);
-    setFlag(gb, FLAG_N, 1);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) - (rhs & 0x0F)) & 0x10);
-    setFlag(gb, FLAG_C, lhs < rhs);
+    setLazyFlags(gb, LAZY_FLAGS_SUB, lhs, rhs, lhs - rhs);
 }
 
 INSTRUCTION_EXECUTE_FN(compareReg) {
     enum Register8 rhs = opcode - 0xB8;
 
-    doCompare(gb, getReg8(gb, rhs));
+    doCompare(gb, REG8(rhs));
 }
 
 INSTRUCTION_EXECUTE_FN(compareImm8) {
@@ -433,43 +512,35 @@ INSTRUCTION_EXECUTE_FN(compareAddrHL) {
 INSTRUCTION_EXECUTE_FN(incReg) {
     enum Register8 reg = (opcode - 0x04) >> 3;
 
-    uint8 lhs = getReg8(gb, reg);
+    uint8 lhs = REG8(reg);
     uint8 result = lhs + 1;
-    setReg8(gb, reg, result);
+    REG8(reg) = result;
 
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) + 1) & 0x10);
+    setLazyFlags(gb, LAZY_FLAGS_INC, lhs, getFlag(gb, FLAG_C), result);
 }
 
 INSTRUCTION_EXECUTE_FN(incAddrHL) {
     uint8 lhs = RD(REG(HL));
     WR(REG(HL), lhs + 1);
     
-    updateZeroFlag(gb, RD(REG(HL)));
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) + 1) & 0x10);
+    setLazyFlags(gb, LAZY_FLAGS_INC, lhs, getFlag(gb, FLAG_C), RD(REG(HL)));
 }
 
 INSTRUCTION_EXECUTE_FN(decReg) {
     enum Register8 reg = (opcode - 0x05) >> 3;
 
-    uint8 lhs = getReg8(gb, reg);
+    uint8 lhs = REG8(reg);
     uint8 result = lhs - 1;
-    setReg8(gb, reg, result);
+    REG8(reg) = result;
     
-    updateZeroFlag(gb, result);
-    setFlag(gb, FLAG_N, 1);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) - 1) & 0x10);
+    setLazyFlags(gb, LAZY_FLAGS_DEC, lhs, getFlag(gb, FLAG_C), result);
 }
 
 INSTRUCTION_EXECUTE_FN(decAddrHL) {
     uint8 lhs = RD(REG(HL));
     WR(REG(HL), lhs - 1);
 
-    updateZeroFlag(gb, RD(REG(HL)));
-    setFlag(gb, FLAG_N, 1);
-    setFlag(gb, FLAG_H, ((lhs & 0x0F) - 1) & 0x10);
+    setLazyFlags(gb, LAZY_FLAGS_DEC, lhs, getFlag(gb, FLAG_C), RD(REG(HL)));
 }
 
 // Source : https://forums.nesdev.org/viewtopic.php?t=15944
@@ -478,7 +549,7 @@ INSTRUCTION_EXECUTE_FN(decimalAdjust) {
     bool32 c = getFlag(gb, FLAG_C);
     bool32 n = getFlag(gb, FLAG_N);
     
-    uint8 a = getReg8(gb, REG_A);
+    uint8 a = REG8(REG_A);
     
     // note: assumes a is a uint8_t and wraps from 0xff to 0
     if (!n) {
@@ -500,7 +571,7 @@ INSTRUCTION_EXECUTE_FN(decimalAdjust) {
         }
     }
 
-    setReg8(gb, REG_A, a);
+    REG8(REG_A) = a;
     
     // these flags are always updated
     setFlag(gb, FLAG_Z, (a == 0));
@@ -508,7 +579,7 @@ INSTRUCTION_EXECUTE_FN(decimalAdjust) {
 }
 
 INSTRUCTION_EXECUTE_FN(complement) {
-    setReg8(gb, REG_A, ~getReg8(gb, REG_A));
+    REG8(REG_A) = ~REG8(REG_A);
     setFlag(gb, FLAG_N, 1);
     setFlag(gb, FLAG_H, 1);
 }
@@ -518,7 +589,7 @@ INSTRUCTION_EXECUTE_FN(addReg16ToHL) {
     enum Register16 reg = BC_DE_HL_SP[(opcode - 0x09) >> 4];
 
     uint16 lhs = REG(HL);
-    uint16 rhs = gb->registers[reg];
+    uint16 rhs = gb->registers.pairs[reg];
     uint32 result32 = lhs + rhs;
     
     REG(HL) = result32 & 0xFFFF;
@@ -531,13 +602,13 @@ INSTRUCTION_EXECUTE_FN(addReg16ToHL) {
 INSTRUCTION_EXECUTE_FN(incReg16) {
     enum Register16 reg = BC_DE_HL_SP[(opcode - 0x03) >> 4];
 
-    gb->registers[reg]++;
+    gb->registers.pairs[reg]++;
 }
 
 INSTRUCTION_EXECUTE_FN(decReg16) {
     enum Register16 reg = BC_DE_HL_SP[(opcode - 0x08) >> 4];
     
-    gb->registers[reg]--;
+    gb->registers.pairs[reg]--;
 }
 
 INSTRUCTION_EXECUTE_FN(addSignedToSP) {
@@ -576,70 +647,52 @@ static uint8 rotateRight(uint8 value) {
 }
 
 INSTRUCTION_EXECUTE_FN(rotateALeft) {
-    uint8 a = getReg8(gb, REG_A);
+    uint8 a = REG8(REG_A);
     a = rotateLeft(a);
-    setReg8(gb, REG_A, a);
+    REG8(REG_A) = a;
     
-    setFlag(gb, FLAG_Z, 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, a & 1);
+    setLazyFlags(gb, LAZY_FLAGS_ROTATE_A, 0, a & 1, a);
 }
 
+// The carry out is left to the caller
 static uint8 rotateLeftThroughCarry(GameBoy* gb, uint8 value) {
-    uint8 oldCarry = getFlag(gb, FLAG_C);
-    setFlag(gb, FLAG_C, value >> 7);
-
-    return (value << 1) | oldCarry;
+    return (value << 1) | getFlag(gb, FLAG_C);
 }
 
 static uint8 rotateRightThroughCarry(GameBoy* gb, uint8 value) {
-    uint8 oldCarry = getFlag(gb, FLAG_C);
-    setFlag(gb, FLAG_C, value & 1);
-
-    return (value >> 1) | (oldCarry << 7);
+    return (value >> 1) | (getFlag(gb, FLAG_C) << 7);
 }
 
 INSTRUCTION_EXECUTE_FN(rotateALeftThroughCarry) {
-    uint8 a = getReg8(gb, REG_A);
-    a = rotateLeftThroughCarry(gb, a);
+    uint8 a = REG8(REG_A);
+    uint8 rotated = rotateLeftThroughCarry(gb, a);
     
-    setReg8(gb, REG_A, a);
+    REG8(REG_A) = rotated;
 
-    setFlag(gb, FLAG_Z, 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
+    setLazyFlags(gb, LAZY_FLAGS_ROTATE_A, 0, a >> 7, rotated);
 }
 
 INSTRUCTION_EXECUTE_FN(rotateARight) {
-    uint8 a = getReg8(gb, REG_A);
+    uint8 a = REG8(REG_A);
     a = rotateRight(a);
-    setReg8(gb, REG_A, a);
+    REG8(REG_A) = a;
 
-    setFlag(gb, FLAG_Z, 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, a >> 7);
+    setLazyFlags(gb, LAZY_FLAGS_ROTATE_A, 0, a >> 7, a);
 }
 
 INSTRUCTION_EXECUTE_FN(rotateARightThroughCarry) {
-    uint8 a = getReg8(gb, REG_A);
-    a = rotateRightThroughCarry(gb, a);
+    uint8 a = REG8(REG_A);
+    uint8 rotated = rotateRightThroughCarry(gb, a);
     
-    setReg8(gb, REG_A, a);
+    REG8(REG_A) = rotated;
 
-    setFlag(gb, FLAG_Z, 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
+    setLazyFlags(gb, LAZY_FLAGS_ROTATE_A, 0, a & 1, rotated);
 }
 
 static uint8 doRotateLeft(GameBoy* gb, uint8 value) {
     uint8 rotated = rotateLeft(value);
     
-    setFlag(gb, FLAG_Z, rotated == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, value >> 7);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, value >> 7, rotated);
 
     return rotated;
 }
@@ -647,7 +700,7 @@ static uint8 doRotateLeft(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(rotateRegLeft) {
     enum Register8 reg = opcode;
 
-    setReg8(gb, reg, doRotateLeft(gb, getReg8(gb, reg)));
+    REG8(reg) = doRotateLeft(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(rotateAddrHLLeft) {
@@ -657,9 +710,7 @@ INSTRUCTION_EXECUTE_FN(rotateAddrHLLeft) {
 static uint8 doRotateLeftThroughCarry(GameBoy* gb, uint8 value) {
     uint8 rotated = rotateLeftThroughCarry(gb, value);
     
-    setFlag(gb, FLAG_Z, rotated == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, value >> 7, rotated);
 
     return rotated;
 }
@@ -667,7 +718,7 @@ static uint8 doRotateLeftThroughCarry(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(rotateRegLeftThroughCarry) {
     enum Register8 reg = opcode - 0x10;
 
-    setReg8(gb, reg, doRotateLeftThroughCarry(gb, getReg8(gb, reg)));
+    REG8(reg) = doRotateLeftThroughCarry(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(rotateAddrHLLeftThroughCarry) {
@@ -677,10 +728,7 @@ INSTRUCTION_EXECUTE_FN(rotateAddrHLLeftThroughCarry) {
 static uint8 doRotateRight(GameBoy* gb, uint8 value) {
     uint8 rotated = rotateRight(value);
     
-    setFlag(gb, FLAG_Z, rotated == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, value & 1);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, value & 1, rotated);
 
     return rotated;
 }
@@ -688,7 +736,7 @@ static uint8 doRotateRight(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(rotateRegRight) {
     enum Register8 reg = opcode - 0x08;
 
-    setReg8(gb, reg, doRotateRight(gb, getReg8(gb, reg)));
+    REG8(reg) = doRotateRight(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(rotateAddrHLRight) {
@@ -698,9 +746,7 @@ INSTRUCTION_EXECUTE_FN(rotateAddrHLRight) {
 static uint8 doRotateRightThroughCarry(GameBoy* gb, uint8 value) {
     uint8 rotated = rotateRightThroughCarry(gb, value);
     
-    setFlag(gb, FLAG_Z, rotated == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, value & 1, rotated);
 
     return rotated;
 }
@@ -708,7 +754,7 @@ static uint8 doRotateRightThroughCarry(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(rotateRegRightThroughCarry) {
     enum Register8 reg = opcode - 0x18;
 
-    setReg8(gb, reg, doRotateRightThroughCarry(gb, getReg8(gb, reg)));
+    REG8(reg) = doRotateRightThroughCarry(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(rotateAddrHLRightThroughCarry) {
@@ -718,10 +764,7 @@ INSTRUCTION_EXECUTE_FN(rotateAddrHLRightThroughCarry) {
 static uint8 doShiftLeftArithmetic(GameBoy* gb, uint8 value) {
     uint8 result = value << 1;
 
-    setFlag(gb, FLAG_Z, result == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, value >> 7);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, value >> 7, result);
 
     return result;
 }
@@ -729,7 +772,7 @@ static uint8 doShiftLeftArithmetic(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(shiftRegLeftArithmetic) {
     enum Register8 reg = opcode - 0x20;
 
-    setReg8(gb, reg, doShiftLeftArithmetic(gb, getReg8(gb, reg)));
+    REG8(reg) = doShiftLeftArithmetic(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(shiftAddrHLLeftArithmetic) {
@@ -739,10 +782,7 @@ INSTRUCTION_EXECUTE_FN(shiftAddrHLLeftArithmetic) {
 static uint8 doShiftRightArithmetic(GameBoy* gb, uint8 value) {
     uint8 result = (value >> 1) | (value & 0x80);
 
-    setFlag(gb, FLAG_Z, result == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, value & 1);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, value & 1, result);
 
     return result;
 }
@@ -750,7 +790,7 @@ static uint8 doShiftRightArithmetic(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(shiftRegRightArithmetic) {
     enum Register8 reg = opcode - 0x28;
 
-    setReg8(gb, reg, doShiftRightArithmetic(gb, getReg8(gb, reg)));
+    REG8(reg) = doShiftRightArithmetic(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(shiftAddrHLRightArithmetic) {
@@ -760,10 +800,7 @@ INSTRUCTION_EXECUTE_FN(shiftAddrHLRightArithmetic) {
 uint8 doSwapNibbles(GameBoy* gb, uint8 value) {
     uint8 result = (value >> 4) | (value << 4);
     
-    setFlag(gb, FLAG_Z, result == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, 0);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, 0, result);
 
     return result;
 }
@@ -771,7 +808,7 @@ uint8 doSwapNibbles(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(swapNibblesReg) {
     enum Register8 reg = opcode - 0x30;
 
-    setReg8(gb, reg, doSwapNibbles(gb, getReg8(gb, reg)));
+    REG8(reg) = doSwapNibbles(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(swapNibblesAddrHL) {
@@ -782,10 +819,7 @@ INSTRUCTION_EXECUTE_FN(swapNibblesAddrHL) {
 uint8 doShiftRightLogical(GameBoy* gb, uint8 value) {
     uint8 result = value >> 1;
     
-    setFlag(gb, FLAG_Z, result == 0);
-    setFlag(gb, FLAG_N, 0);
-    setFlag(gb, FLAG_H, 0);
-    setFlag(gb, FLAG_C, value & 1);
+    setLazyFlags(gb, LAZY_FLAGS_SHIFT, 0, value & 1, result);
 
     return result;
 }
@@ -793,7 +827,7 @@ uint8 doShiftRightLogical(GameBoy* gb, uint8 value) {
 INSTRUCTION_EXECUTE_FN(shiftRegRightLogical) {
     enum Register8 reg = opcode - 0x38;
 
-    setReg8(gb, reg, doShiftRightLogical(gb, getReg8(gb, reg)));
+    REG8(reg) = doShiftRightLogical(gb, REG8(reg));
 }
 
 INSTRUCTION_EXECUTE_FN(shiftAddrHLRightLogical) {
@@ -813,7 +847,7 @@ INSTRUCTION_EXECUTE_FN(testBitReg) {
     enum Register8 reg = opcode % 8;
 
     uint8 bitIndex = (opcode - 0x40) >> 3;
-    doTestBit(gb, getReg8(gb, reg), bitIndex);
+    doTestBit(gb, REG8(reg), bitIndex);
 }
 
 INSTRUCTION_EXECUTE_FN(testBitAddrHL) {
@@ -824,9 +858,9 @@ INSTRUCTION_EXECUTE_FN(testBitAddrHL) {
 INSTRUCTION_EXECUTE_FN(setBitReg) {
     enum Register8 reg = opcode % 8;
     uint8 bitIndex = (opcode - 0xC0) >> 3;
-    uint8 regVal = getReg8(gb, reg);
+    uint8 regVal = REG8(reg);
 
-    setReg8(gb, reg, setBit(regVal, bitIndex));
+    REG8(reg) = setBit(regVal, bitIndex);
 }
 
 INSTRUCTION_EXECUTE_FN(setBitAddrHL) {
@@ -838,9 +872,9 @@ INSTRUCTION_EXECUTE_FN(setBitAddrHL) {
 INSTRUCTION_EXECUTE_FN(resetBitReg) {
     enum Register8 reg = opcode % 8;
     uint8 bitIndex = (opcode - 0x80) >> 3;
-    uint8 regVal = getReg8(gb, reg);
+    uint8 regVal = REG8(reg);
 
-    setReg8(gb, reg, resetBit(regVal, bitIndex));
+    REG8(reg) = resetBit(regVal, bitIndex);
 }
 
 INSTRUCTION_EXECUTE_FN(resetBitAddrHL) {
@@ -950,7 +984,7 @@ INSTRUCTION_EXECUTE_FN(callImm16) {
     doPush(gb, REG(PC));
     REG(PC) = callAddress;
 
-    gb->callStackHeight++;
+    pushCallFrame(gb, callAddress, REG(SP));
 
     gbprintf(gb, "call %04X -> %04X\n", prevPC, REG(PC));
 }
@@ -970,10 +1004,10 @@ INSTRUCTION_EXECUTE_FN(conditionalCallImm16) {
 INSTRUCTION_EXECUTE_FN(ret) {
     uint16 prevPC = REG(PC);
     
+    popCallFrames(gb, REG(SP));
     REG(PC) = doPop(gb);
 
     gbprintf(gb, "ret %04X -> %04X\n", prevPC, REG(PC));
-    gb->callStackHeight--;
 }
 
 INSTRUCTION_EXECUTE_FN(conditionalRet) {
@@ -995,6 +1029,7 @@ INSTRUCTION_EXECUTE_FN(retAndEnableInterrupts) {
 INSTRUCTION_EXECUTE_FN(reset) {
     uint16 address = opcode - 0xC7;
     doPush(gb, REG(PC));
+    pushCallFrame(gb, address, REG(SP));
 
     uint16 prevPC = REG(PC);
     REG(PC) = address;
@@ -1381,35 +1416,301 @@ static InstructionHandler instructionHandlers[256] = {
     INSTR(16, reset),
 };
 
-uint8 executeInstruction(GameBoy* gb) {
-    uint16 prevPC = REG(PC);
-    uint8 instr[4];
-    for (uint8 i = 0; i < 4; i++) {
-        instr[i] = RD(prevPC + i);
+static uint8 instructionLengths[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1, // 00
+    1, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 10
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 20
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1, // 30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 50
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // A0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // B0
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // C0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1, // D0
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // E0
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1, // F0
+};
+
+// Instructions after which execution may not continue with the next
+// address : jumps, calls, returns, resets, halt and stop
+static bool32 endsBasicBlock(uint8 opcode) {
+    switch (opcode) {
+    case 0x10: case 0x76:
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9:
+    case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC:
+    case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9:
+    case 0xC7: case 0xCF: case 0xD7: case 0xDF:
+    case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Instructions an idle loop can be made of, besides the jump back :
+// anything that only reads memory and changes registers.  Stores,
+// stack accesses, IME changes and halt/stop are left out.
+static bool32 isIdleLoopInstruction(DecodedInstruction* instr) {
+    uint8 opcode = instr->opcode;
+
+    if (opcode == 0xCB) {
+        // bit n,(hl) only reads, the other (hl) operations write back
+        uint8 cbOpcode = instr->operands[0];
+        return (cbOpcode & 0x07) != 6 || (cbOpcode >= 0x40 && cbOpcode < 0x80);
+    } else if (opcode >= 0x40 && opcode < 0xC0) {
+        // ld r,r', ALU ops, except for ld (hl),r and halt
+        return opcode < 0x70 || opcode > 0x77;
     }
     
-    
-    uint8 opcode = readImm8(gb);
+    switch (opcode) {
+    case 0x00:
+    case 0x01: case 0x11: case 0x21: case 0x31:
+    case 0x03: case 0x13: case 0x23: case 0x33:
+    case 0x0B: case 0x1B: case 0x2B: case 0x3B:
+    case 0x04: case 0x14: case 0x24: case 0x0C: case 0x1C: case 0x2C: case 0x3C:
+    case 0x05: case 0x15: case 0x25: case 0x0D: case 0x1D: case 0x2D: case 0x3D:
+    case 0x06: case 0x16: case 0x26: case 0x0E: case 0x1E: case 0x2E: case 0x3E:
+    case 0x07: case 0x0F: case 0x17: case 0x1F:
+    case 0x27: case 0x2F: case 0x37: case 0x3F:
+    case 0x09: case 0x19: case 0x29: case 0x39:
+    case 0x0A: case 0x1A: case 0x2A: case 0x3A:
+    case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+    case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+    case 0xF0: case 0xF2: case 0xFA:
+    case 0xF8: case 0xF9:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void decodeInstruction(GameBoy* gb, uint16 address, DecodedInstruction* instr) {
+    instr->opcode = RD(address);
+    instr->length = instructionLengths[instr->opcode];
+    instr->cycles = instructionHandlers[instr->opcode].cycles;
+    instr->operands[0] = 0;
+    instr->operands[1] = 0;
+
+    for (uint8 i = 1; i < instr->length; i++) {
+        instr->operands[i - 1] = RD(address + i);
+    }
+}
+
+#ifdef GAMEBOY_OPCODE_PROFILE
+
+static uint64 readProfileTicks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec res;
+    clock_gettime(CLOCK_MONOTONIC, &res);
+    return (uint64)res.tv_sec * 1000 * 1000 * 1000 + res.tv_nsec;
+#endif
+}
+
+static uint16 getProfileIndex(DecodedInstruction* instr) {
+    return instr->opcode == 0xCB ? 0x100 + instr->operands[0] : instr->opcode;
+}
+
+static void profileInstruction(GameBoy* gb, DecodedInstruction* instr,
+                               uint8 duration, uint64 ticks) {
+    OpcodeProfile* profile = gb->opcodeProfile;
+    if (!profile) {
+        return;
+    }
+
+    uint16 index = getProfileIndex(instr);
+
+    profile->counts[index]++;
+    profile->cycles[index] += duration;
+    profile->ticks[index] += ticks;
+
+    if (profile->hasPrevious) {
+        profile->pairCounts[profile->previous][index]++;
+    }
+    profile->previous = index;
+    profile->hasPrevious = true;
+}
+
+#define OPCODE_PROFILE_TOP_PAIRS 32
+
+// pair = previous * OPCODE_PROFILE_SIZE + current
+static uint32 getPairCount(OpcodeProfile* profile, uint32 pair) {
+    return profile->pairCounts[pair / OPCODE_PROFILE_SIZE][pair % OPCODE_PROFILE_SIZE];
+}
+
+static void printProfileOpcode(FILE* file, uint16 index) {
+    uint8 bytes[4] = {index, 0, 0, 0};
+    if (index >= 0x100) {
+        bytes[0] = 0xCB;
+        bytes[1] = index - 0x100;
+        fprintf(file, "CB %02X", bytes[1]);
+    } else {
+        fprintf(file, "%02X   ", bytes[0]);
+    }
+    fprintf(file, "  ");
+    instructionHandlers[bytes[0]].disassemble(file, bytes);
+}
+
+// Counts into profile from now on, cleared first, 0 stops counting.
+// Call it after initializeGameboy, which stops it.
+void setOpcodeProfile(GameBoy* gb, OpcodeProfile* profile) {
+    if (profile) {
+        memset(profile, 0, sizeof(*profile));
+    }
+    gb->opcodeProfile = profile;
+}
+
+// Opcodes sorted by host time, then the opcode pairs executed the most,
+// candidates for specialized or fused handlers
+void printOpcodeProfile(FILE* file, GameBoy* gb) {
+    OpcodeProfile* profile = gb->opcodeProfile;
+    if (!profile) {
+        return;
+    }
+
+    uint64 totalCount = 0;
+    uint64 totalCycles = 0;
+    uint64 totalTicks = 0;
+    uint16 order[OPCODE_PROFILE_SIZE];
+    uint16 orderCount = 0;
+
+    for (uint16 index = 0; index < OPCODE_PROFILE_SIZE; index++) {
+        if (!profile->counts[index]) {
+            continue;
+        }
+
+        totalCount += profile->counts[index];
+        totalCycles += profile->cycles[index];
+        totalTicks += profile->ticks[index];
+
+        // insertion sort, by decreasing ticks
+        uint16 at = orderCount++;
+        while (at && profile->ticks[order[at - 1]] < profile->ticks[index]) {
+            order[at] = order[at - 1];
+            at--;
+        }
+        order[at] = index;
+    }
+
+    if (!totalCount) {
+        fprintf(file, "Opcode profile : no instructions\n");
+        return;
+    }
+
+    fprintf(file, "Opcode profile : %llu instructions, %llu cycles, %llu ticks\n",
+            (unsigned long long)totalCount,
+            (unsigned long long)totalCycles,
+            (unsigned long long)totalTicks);
+    fprintf(file, "  %12s %6s %12s %6s %14s %6s %9s  opcode\n",
+            "count", "%", "cycles", "%", "ticks", "%", "ticks/op");
+
+    for (uint16 i = 0; i < orderCount; i++) {
+        uint16 index = order[i];
+        fprintf(file, "  %12llu %5.1f%% %12llu %5.1f%% %14llu %5.1f%% %9.1f  ",
+                (unsigned long long)profile->counts[index],
+                100.0 * profile->counts[index] / totalCount,
+                (unsigned long long)profile->cycles[index],
+                100.0 * profile->cycles[index] / totalCycles,
+                (unsigned long long)profile->ticks[index],
+                totalTicks ? 100.0 * profile->ticks[index] / totalTicks : 0.0,
+                (double)profile->ticks[index] / profile->counts[index]);
+        printProfileOpcode(file, index);
+        fprintf(file, "\n");
+    }
+
+    // top pairs, kept sorted by decreasing count
+    uint32 pairs[OPCODE_PROFILE_TOP_PAIRS];
+    uint32 pairCount = 0;
+
+    for (uint32 pair = 0; pair < OPCODE_PROFILE_SIZE * OPCODE_PROFILE_SIZE; pair++) {
+        uint32 count = getPairCount(profile, pair);
+        if (!count) {
+            continue;
+        }
+
+        uint32 at = pairCount;
+        if (pairCount < OPCODE_PROFILE_TOP_PAIRS) {
+            pairCount++;
+        } else if (count <= getPairCount(profile, pairs[at - 1])) {
+            continue;
+        } else {
+            at--;
+        }
+
+        while (at && getPairCount(profile, pairs[at - 1]) < count) {
+            pairs[at] = pairs[at - 1];
+            at--;
+        }
+        pairs[at] = pair;
+    }
+
+    fprintf(file, "Hottest opcode pairs :\n");
+    fprintf(file, "  %12s %6s  pair\n", "count", "%");
+
+    for (uint32 i = 0; i < pairCount; i++) {
+        uint16 first = pairs[i] / OPCODE_PROFILE_SIZE;
+        uint16 second = pairs[i] % OPCODE_PROFILE_SIZE;
+        uint32 count = getPairCount(profile, pairs[i]);
+
+        fprintf(file, "  %12u %5.1f%%  ", count, 100.0 * count / totalCount);
+        printProfileOpcode(file, first);
+        fprintf(file, "  ->  ");
+        printProfileOpcode(file, second);
+        fprintf(file, "\n");
+    }
+}
+
+#undef OPCODE_PROFILE_TOP_PAIRS
+
+#endif
+
+// bytes : opcode and operands, 4 bytes so that any instruction fits
+void disassembleInstruction(FILE* file, uint8* bytes) {
+    InstructionHandler* handler = &instructionHandlers[bytes[0]];
+
+    if (handler->disassemble) {
+        handler->disassemble(file, bytes);
+    } else {
+        fprintf(file, "db $%02X", bytes[0]);
+    }
+}
+
+static uint8 executeDecodedInstruction(GameBoy* gb, DecodedInstruction* instr) {
+#ifdef GAMEBOY_OPCODE_PROFILE
+    uint64 startTicks = readProfileTicks();
+#endif
+    uint16 prevPC = REG(PC);
+    uint8 opcode = instr->opcode;
     InstructionHandler* handler = &instructionHandlers[opcode];
 
     if (!handler->execute) {
         fprintf(stderr, "Invalid opcode %X at 0x%04X\n", opcode, prevPC);
         exit(1);
     }
-    
-    if (gb->tracing) {
-        printGameboyLogLine(stdout, gb);
-        printf("%04x ", prevPC);
-
-        handler->disassemble(stdout, instr);
-        printf("\n");
 
-        gb->tracing--;
+    if (gb->tracing) {
+        recordTrace(gb);
     }
 
+    REG(PC)++;
+
+    gb->nextOperand = instr->operands;
     gb->variableCycles = 0;
     handler->execute(gb, opcode);
 
+#ifdef GAMEBOY_LAZY_FLAGS_CHECK
+    if (evaluateFlags(gb) != gb->lazyFlags.checked) {
+        gbError(gb, "Lazy flags mismatch after opcode %02X at 0x%04X : F = %02X, expected %02X",
+                opcode, prevPC, evaluateFlags(gb), gb->lazyFlags.checked);
+    }
+#endif
+
     uint8 duration;
     if (handler->cycles != VARIABLE_CYCLES) {
         ASSERT(!gb->variableCycles);
@@ -1419,9 +1720,20 @@ uint8 executeInstruction(GameBoy* gb) {
         duration = gb->variableCycles;
     }
 
+#ifdef GAMEBOY_OPCODE_PROFILE
+    profileInstruction(gb, instr, duration, readProfileTicks() - startTicks);
+#endif
+
     return duration;
 }
 
+uint8 executeInstruction(GameBoy* gb) {
+    DecodedInstruction instr;
+    decodeInstruction(gb, REG(PC), &instr);
+
+    return executeDecodedInstruction(gb, &instr);
+}
+
 void handleInterrupt(GameBoy* gb) {
     uint16 interruptAddresses[] = {
         [INT_VBLANK] = 0x0040, // V-blank
@@ -1447,8 +1759,6 @@ void handleInterrupt(GameBoy* gb) {
          interruptIndex < INT_COUNT;
          interruptIndex++) {
         if (getBit(enabledPendingInterrupts, interruptIndex)) {
-            gb->callStackHeight++;
-            
             // disable interrupts
             gb->ime = 0;
 
@@ -1463,6 +1773,7 @@ void handleInterrupt(GameBoy* gb) {
             // jump to interrupt handler
             uint16 interruptAddress = 0x0040 + 0x08 * interruptIndex;
             REG(PC) = interruptAddress;
+            pushCallFrame(gb, interruptAddress, REG(SP));
 
             gbprintf(gb, "interrupt %04X -> %04X\n", prevPC, REG(PC));
             break;
@@ -1470,77 +1781,266 @@ void handleInterrupt(GameBoy* gb) {
     }
 }
 
-static void stepClock(GameBoy* gb, uint8 duration) {
-    gb->clock += duration;
-    IO(DIV) = gb->clock / 16384;
-    
-    uint8 tac = IO(TAC);
-    if (getBit(tac, 2)) {
-        uint16 clockPeriods[] = {
-            0x400,
-            0x10,
-            0x40,
-            0x100,
-        };
-
-        uint16 clockPeriod = clockPeriods[tac & 0x3];
-        gb->timerAccumulator += duration;
-
-        while (gb->timerAccumulator >= clockPeriod) {
-            gb->timerAccumulator -= clockPeriod;
-
-            IO(TIMA)++;
-            if (!IO(TIMA)) {
-                triggerInterrupt(gb, INT_TIMER);
-                IO(TIMA) = IO(TMA);
-            }
+static void updateNextEventClock(GameBoy* gb) {
+    // far enough to never come up before one of the PPU events
+    uint32 next = gb->clock + GAMEBOY_CYCLES_PER_FRAME;
+
+    for (uint32 event = 0; event < EVENT_COUNT; event++) {
+        if ((gb->scheduledEvents & (1 << event))
+            && (int32)(gb->eventClocks[event] - next) < 0) {
+            next = gb->eventClocks[event];
         }
     }
 
-    gb->renderingAccumulator += duration;
-    while (gb->renderingAccumulator > GAMEBOY_CYCLES_PER_SCANLINE) {
-        IO(LY)++;
-        
-        if (IO(LY) < GAMEBOY_SCREEN_HEIGHT) {
-            drawScreenRow(gb, IO(LY));
-        }
-        
-        if (IO(LY) == GAMEBOY_LY_VBLANK) {
-            triggerInterrupt(gb, INT_VBLANK);
-        } else if (IO(LY) == GAMEBOY_LY_MAX) {
-            IO(LY) = 0;
-            gb->frameReady = true;
-        }
+    gb->nextEventClock = next;
+}
 
-        if (IO(LY) == IO(LYC) && getBit(IO(STAT), 6)) {
-            triggerInterrupt(gb, INT_LCDC);
+static void scheduleEvent(GameBoy* gb, enum SchedulerEvent event, uint32 clock) {
+    gb->eventClocks[event] = clock;
+    gb->scheduledEvents |= 1 << event;
+}
+
+static void cancelEvent(GameBoy* gb, enum SchedulerEvent event) {
+    gb->scheduledEvents &= ~(1 << event);
+}
+
+static uint16 getTimerPeriod(GameBoy* gb) {
+    uint16 clockPeriods[] = {
+        0x400,
+        0x10,
+        0x40,
+        0x100,
+    };
+
+    return clockPeriods[IO(TAC) & 0x3];
+}
+
+// Count the TIMA increments between timerClock and the current clock
+void syncTimer(GameBoy* gb) {
+    uint32 elapsed = gb->clock - gb->timerClock;
+    gb->timerClock = gb->clock;
+
+    if (!getBit(IO(TAC), 2)) {
+        return;
+    }
+
+    uint16 clockPeriod = getTimerPeriod(gb);
+    uint32 total = gb->timerAccumulator + elapsed;
+    uint32 ticks = total / clockPeriod;
+    gb->timerAccumulator = total % clockPeriod;
+
+    while (ticks) {
+        // up to the next overflow, which reloads TMA
+        uint32 untilOverflow = 0x100 - IO(TIMA);
+        if (ticks < untilOverflow) {
+            IO(TIMA) += ticks;
+            break;
         }
 
-        gb->renderingAccumulator -= GAMEBOY_CYCLES_PER_SCANLINE;
+        ticks -= untilOverflow;
+        triggerInterrupt(gb, INT_TIMER);
+        IO(TIMA) = IO(TMA);
+    }
+}
+
+// Schedule the next TIMA overflow, the timer must be synced
+void scheduleTimer(GameBoy* gb) {
+    if (getBit(IO(TAC), 2)) {
+        uint32 untilOverflow = (0x100 - IO(TIMA)) * getTimerPeriod(gb)
+            - gb->timerAccumulator;
+        scheduleEvent(gb, EVENT_TIMER, gb->clock + untilOverflow);
+    } else {
+        cancelEvent(gb, EVENT_TIMER);
     }
 
+    updateNextEventClock(gb);
+}
+
+// Mode for the position in the current scanline, and the event for
+// the next change within it
+static void updateRenderingMode(GameBoy* gb) {
+    uint32 lineClock = gb->clock - gb->scanlineClock;
+
     if (IO(LY) >= GAMEBOY_LY_VBLANK) {
         if (gb->renderingMode != 1 && getBit(IO(STAT), 4)) {
             triggerInterrupt(gb, INT_LCDC);
         }
         
         gb->renderingMode = 1; // vblank
-    } else if (gb->renderingAccumulator < 80) {
+        cancelEvent(gb, EVENT_PPU_MODE);
+    } else if (lineClock < 80) {
         if (gb->renderingMode != 2 && getBit(IO(STAT), 5)) {
             triggerInterrupt(gb, INT_LCDC);
         }
         
         gb->renderingMode = 2; // oam read
-    } else if (gb->renderingAccumulator < 369) {
+        scheduleEvent(gb, EVENT_PPU_MODE, gb->scanlineClock + 80);
+    } else if (lineClock < 369) {
         // TODO(octave) : variable mode 3/0 duration
         gb->renderingMode = 3; // drawing pixels
+        scheduleEvent(gb, EVENT_PPU_MODE, gb->scanlineClock + 369);
     } else {
         if (gb->renderingMode != 0 && getBit(IO(STAT), 3)) {
             triggerInterrupt(gb, INT_LCDC);
         }
         
         gb->renderingMode = 0; // hblank
+        cancelEvent(gb, EVENT_PPU_MODE);
+    }
+}
+
+// Evaluate the mode at the next instruction boundary, after LY was
+// changed behind the PPU's back
+void scheduleModeCheck(GameBoy* gb) {
+    scheduleEvent(gb, EVENT_PPU_MODE, gb->clock + 1);
+    updateNextEventClock(gb);
+}
+
+// Frame skip : whether the frame that starts is drawn
+static void startFrame(GameBoy* gb) {
+    gb->drawingFrame = gb->frameRequested
+        || (gb->renderInterval && gb->framesSkipped + 1 >= gb->renderInterval);
+    gb->frameRequested = false;
+
+    if (gb->drawingFrame) {
+        gb->framesSkipped = 0;
+    } else {
+        gb->framesSkipped++;
+    }
+}
+
+static void runScanlineEvent(GameBoy* gb) {
+    IO(LY)++;
+        
+    if (IO(LY) < GAMEBOY_SCREEN_HEIGHT && gb->drawingFrame) {
+        drawScreenRow(gb, IO(LY));
     }
+        
+    if (IO(LY) == GAMEBOY_LY_VBLANK) {
+        triggerInterrupt(gb, INT_VBLANK);
+    } else if (IO(LY) == GAMEBOY_LY_MAX) {
+        IO(LY) = 0;
+        gb->frameReady = true;
+        startFrame(gb);
+    }
+
+    if (IO(LY) == IO(LYC) && getBit(IO(STAT), 6)) {
+        triggerInterrupt(gb, INT_LCDC);
+    }
+
+    gb->scanlineClock += GAMEBOY_CYCLES_PER_SCANLINE;
+    scheduleEvent(gb, EVENT_SCANLINE,
+                  gb->scanlineClock + GAMEBOY_CYCLES_PER_SCANLINE + 1);
+}
+
+void initializeScheduler(GameBoy* gb) {
+    gb->scheduledEvents = 0;
+    gb->timerClock = gb->clock;
+    gb->timerAccumulator = 0;
+    gb->scanlineClock = gb->clock;
+
+    scheduleEvent(gb, EVENT_SCANLINE,
+                  gb->scanlineClock + GAMEBOY_CYCLES_PER_SCANLINE + 1);
+    scheduleTimer(gb);
+    scheduleModeCheck(gb);
+}
+
+// After the scheduler fields were replaced by a save state : the
+// profiler samples belong to this instance, not to the state
+void resumeScheduler(GameBoy* gb) {
+    if (gb->guestProfile) {
+        scheduleEvent(gb, EVENT_PROFILE_SAMPLE, gb->clock + gb->sampleInterval);
+    } else {
+        cancelEvent(gb, EVENT_PROFILE_SAMPLE);
+    }
+
+    updateNextEventClock(gb);
+}
+
+// Run the events that are due, in clock order : several scanlines
+// can be due at once when the clock jumped ahead.  Like stepping the
+// PPU cycle by cycle would, the mode is only evaluated once at the
+// end.
+void runEvents(GameBoy* gb) {
+    bool32 ppuChanged = false;
+
+    for (;;) {
+        int32 due = -1;
+        for (int32 event = 0; event < EVENT_COUNT; event++) {
+            if ((gb->scheduledEvents & (1 << event))
+                && (int32)(gb->clock - gb->eventClocks[event]) >= 0
+                && (due < 0 || (int32)(gb->eventClocks[event] - gb->eventClocks[due]) < 0)) {
+                due = event;
+            }
+        }
+
+        if (due == EVENT_TIMER) {
+            syncTimer(gb);
+            scheduleTimer(gb);
+        } else if (due == EVENT_SCANLINE) {
+            runScanlineEvent(gb);
+            ppuChanged = true;
+        } else if (due == EVENT_PPU_MODE) {
+            cancelEvent(gb, EVENT_PPU_MODE);
+            ppuChanged = true;
+        } else if (due == EVENT_PROFILE_SAMPLE) {
+            recordProfileSample(gb);
+            scheduleEvent(gb, EVENT_PROFILE_SAMPLE,
+                          gb->eventClocks[EVENT_PROFILE_SAMPLE] + gb->sampleInterval);
+        } else {
+            break;
+        }
+    }
+
+    if (ppuChanged) {
+        updateRenderingMode(gb);
+    }
+
+    updateNextEventClock(gb);
+}
+
+// Samples (bank, PC) into the profile every sampleInterval cycles,
+// until stopGuestProfile
+void startGuestProfile(GameBoy* gb, GuestProfile* profile, uint32 sampleInterval) {
+    ASSERT(sampleInterval);
+
+    gb->guestProfile = profile;
+    gb->sampleInterval = sampleInterval;
+    scheduleEvent(gb, EVENT_PROFILE_SAMPLE, gb->clock + sampleInterval);
+    updateNextEventClock(gb);
+}
+
+void stopGuestProfile(GameBoy* gb) {
+    gb->guestProfile = 0;
+    cancelEvent(gb, EVENT_PROFILE_SAMPLE);
+    updateNextEventClock(gb);
+}
+
+static void stepClock(GameBoy* gb, uint32 duration) {
+    gb->clock += duration;
+
+    if ((int32)(gb->clock - gb->nextEventClock) >= 0) {
+        runEvents(gb);
+    }
+}
+
+// Cycles to stay halted in one go.  IF only changes in scheduled events
+// (or from the host, between runCycles calls), so the 4-cycle halt
+// steps are skipped up to the first one that reaches the next event or
+// the end of the cycle budget.
+static uint32 getHaltDuration(GameBoy* gb, uint32 budget) {
+    uint32 untilEvent = gb->nextEventClock - gb->clock;
+    if (IO(IF) || (int32)untilEvent <= 0) {
+        return 4;
+    }
+
+    uint32 steps = (untilEvent + 3) / 4;
+    uint32 budgetSteps = (budget + 3) / 4;
+    if (budgetSteps < steps) {
+        steps = budgetSteps;
+    }
+
+    return steps * 4;
 }
 
 void executeCycle(GameBoy* gb) {
@@ -1555,3 +2055,273 @@ void executeCycle(GameBoy* gb) {
     
     handleInterrupt(gb);
 }
+
+#define NOT_CACHEABLE 0xFFFF
+
+// Code in ROM, WRAM and HRAM goes through the decode cache, anything
+// else (cartridge RAM, VRAM, OAM) is decoded every time
+static uint16 getCodeBank(GameBoy* gb, uint16 address) {
+    if (address < VRAM_START) {
+        const uint8* page = gb->readPages[address / MEMORY_PAGE_SIZE];
+        if (!page) {
+            return NOT_CACHEABLE;
+        }
+        
+        return (page - gb->rom) / ROM_SWITCHABLE_BANK_START;
+    } else if (address >= INTERNAL_RAM_START && address < ECHO_RAM_START) {
+        return 0;
+    } else if (address >= HRAM_START && address < IE_ADDRESS) {
+        return 0;
+    } else {
+        return NOT_CACHEABLE;
+    }
+}
+
+// Block ending with a jump back to its own start, and only made of
+// instructions that don't write : a polling loop (see runIdleLoop)
+static bool32 isIdleLoopBlock(DecodedBlock* block, uint16 endPC) {
+    if (!block->instructionCount) {
+        return false;
+    }
+    
+    DecodedInstruction* jump = &block->instructions[block->instructionCount - 1];
+    uint16 target;
+    
+    switch (jump->opcode) {
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        target = endPC + (int8)jump->operands[0];
+        break;
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+        target = jump->operands[0] | (jump->operands[1] << 8);
+        break;
+    default:
+        return false;
+    }
+
+    if (target != block->pc) {
+        return false;
+    }
+
+    for (uint8 i = 0; i + 1 < block->instructionCount; i++) {
+        if (!isIdleLoopInstruction(&block->instructions[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void decodeBlock(GameBoy* gb, DecodedBlock* block, uint16 bank, uint16 address) {
+    uint16 page = address / MEMORY_PAGE_SIZE;
+    uint32 end = (page + 1) * MEMORY_PAGE_SIZE;
+    if (end > IE_ADDRESS) {
+        end = IE_ADDRESS;
+    }
+
+    block->bank = bank;
+    block->pc = address;
+    block->generation = gb->codePageGenerations[page];
+    block->fixedCycles = 0;
+    block->instructionCount = 0;
+    block->hits = 0;
+    block->jitCode = 0;
+
+    uint32 pc = address;
+    while (block->instructionCount < DECODED_BLOCK_MAX_INSTRUCTIONS) {
+        uint8 opcode = RD(pc);
+
+        // invalid opcodes and instructions straddling two pages are
+        // left to executeInstruction
+        if (!instructionHandlers[opcode].execute
+            || pc + instructionLengths[opcode] > end) {
+            break;
+        }
+
+        DecodedInstruction* instr = &block->instructions[block->instructionCount++];
+        decodeInstruction(gb, pc, instr);
+
+        if (instr->cycles != VARIABLE_CYCLES) {
+            block->fixedCycles += instr->cycles;
+        }
+        
+        pc += instr->length;
+
+        if (endsBasicBlock(opcode)) {
+            break;
+        }
+    }
+
+    block->idleLoop = isIdleLoopBlock(block, pc);
+    block->idleLoopMisses = 0;
+
+    if (block->instructionCount && address >= VRAM_START) {
+        protectCodePage(gb, page);
+    }
+}
+
+static DecodedBlock* getDecodedBlock(GameBoy* gb, uint16 address) {
+    uint16 bank = getCodeBank(gb, address);
+    if (bank == NOT_CACHEABLE || !gb->decodedBlocks) {
+        return 0;
+    }
+
+    uint32 hash = (((uint32)bank << 16) | address) * 2654435761u;
+    DecodedBlock* block = &gb->decodedBlocks[hash >> (32 - DECODE_CACHE_BITS)];
+    uint32 generation = gb->codePageGenerations[address / MEMORY_PAGE_SIZE];
+    
+    if (!block->instructionCount
+        || block->bank != bank
+        || block->pc != address
+        || block->generation != generation) {
+        decodeBlock(gb, block, bank, address);
+    }
+
+    return block->instructionCount ? block : 0;
+}
+
+// Same as calling executeCycle for each instruction, leaving the
+// block as soon as PC goes elsewhere (jump, interrupt), the block is
+// overwritten or its ROM bank is switched out
+static void runDecodedBlock(GameBoy* gb, DecodedBlock* block,
+                            uint32 startClock, uint32 cycleCount) {
+    uint16 page = block->pc / MEMORY_PAGE_SIZE;
+    const uint8* codePage = gb->readPages[page];
+    uint16 nextPC = block->pc;
+    
+    for (uint8 i = 0; i < block->instructionCount; i++) {
+        DecodedInstruction* instr = &block->instructions[i];
+            
+        stepClock(gb, executeDecodedInstruction(gb, instr));
+        handleInterrupt(gb);
+
+        nextPC += instr->length;
+        if (REG(PC) != nextPC
+            || gb->halted
+            || gb->frameReady
+            || (uint32)(gb->clock - startClock) >= cycleCount
+            || gb->codePageGenerations[page] != block->generation
+            || gb->readPages[page] != codePage) {
+            break;
+        }
+    }
+}
+
+#ifdef GAMEBOY_JIT
+
+#include "jit.c"
+
+#endif
+
+#define IDLE_LOOP_MAX_MISSES 4
+
+static void runBlock(GameBoy* gb, DecodedBlock* block,
+                     uint32 startClock, uint32 cycleCount) {
+#ifdef GAMEBOY_JIT
+    if (runJitBlock(gb, block, startClock, cycleCount)) {
+        return;
+    }
+#endif
+        
+    runDecodedBlock(gb, block, startClock, cycleCount);
+}
+
+// Run one iteration of an idle loop.  If it came back to its start with
+// the same registers, without reading DIV or TIMA and without an event
+// in between, the next iterations do exactly the same thing until an
+// event changes the memory they read (nothing else writes while the
+// loop runs) : the clock goes straight to the last whole iteration
+// before the next event or the end of the cycle budget.
+static void runIdleLoop(GameBoy* gb, DecodedBlock* block,
+                        uint32 startClock, uint32 cycleCount) {
+    materializeFlags(gb);
+    Registers registers = gb->registers;
+    uint32 clock = gb->clock;
+    uint32 nextEventClock = gb->nextEventClock;
+    uint32 timerReads = gb->timerReads;
+
+    runBlock(gb, block, startClock, cycleCount);
+    materializeFlags(gb);
+
+    if (REG(PC) != block->pc
+        || gb->halted
+        || gb->frameReady
+        || gb->nextEventClock != nextEventClock
+        || (uint32)(gb->clock - startClock) >= cycleCount) {
+        return;
+    }
+
+    if (gb->timerReads != timerReads
+        || memcmp(&registers, &gb->registers, sizeof(registers))) {
+        // the first iteration loads the polled value, a loop that
+        // keeps changing its registers counts or times something and
+        // isn't checked again until it is decoded again
+        if (++block->idleLoopMisses >= IDLE_LOOP_MAX_MISSES) {
+            block->idleLoop = false;
+        }
+        return;
+    }
+
+    block->idleLoopMisses = 0;
+
+    uint32 iterationCycles = gb->clock - clock;
+    uint32 untilEvent = gb->nextEventClock - gb->clock;
+    uint32 untilEnd = cycleCount - (gb->clock - startClock);
+    uint32 iterations = ((untilEvent < untilEnd ? untilEvent : untilEnd) - 1)
+        / iterationCycles;
+
+    if (iterations) {
+        gb->clock += iterations * iterationCycles;
+        gb->stats.idleLoopCycles += iterations * iterationCycles;
+        gb->stats.idleLoopSkips++;
+    }
+}
+
+static uint32 runCyclesWithHandlers(GameBoy* gb, uint32 cycleCount) {
+    uint32 startClock = gb->clock;
+
+    while (!gb->frameReady && (uint32)(gb->clock - startClock) < cycleCount) {
+        if (gb->halted) {
+            uint32 elapsed = gb->clock - startClock;
+            stepClock(gb, getHaltDuration(gb, cycleCount - elapsed));
+            handleInterrupt(gb);
+            continue;
+        }
+
+        DecodedBlock* block = 0;
+        if (!gb->tracing) {
+            block = getDecodedBlock(gb, REG(PC));
+        }
+
+        if (!block) {
+            executeCycle(gb);
+        } else if (block->idleLoop) {
+            runIdleLoop(gb, block, startClock, cycleCount);
+        } else {
+            runBlock(gb, block, startClock, cycleCount);
+        }
+    }
+
+    return gb->clock - startClock;
+}
+
+#undef NOT_CACHEABLE
+
+#if defined(GAMEBOY_THREADED_INTERPRETER) && defined(GAMEBOY_JIT)
+#error "GAMEBOY_JIT runs on top of the handler table, it can't be combined with GAMEBOY_THREADED_INTERPRETER"
+#endif
+
+#if defined(GAMEBOY_OPCODE_PROFILE) && (defined(GAMEBOY_THREADED_INTERPRETER) || defined(GAMEBOY_JIT))
+#error "GAMEBOY_OPCODE_PROFILE counts in executeDecodedInstruction, it needs the handler table backend"
+#endif
+
+#ifdef GAMEBOY_THREADED_INTERPRETER
+
+#include "interpreter.c"
+
+#else
+
+uint32 runCycles(GameBoy* gb, uint32 cycleCount) {
+    return runCyclesWithHandlers(gb, cycleCount);
+}
+
+#endif
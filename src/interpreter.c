@@ -0,0 +1,741 @@
+// Threaded interpreter : all the opcode bodies live in runCycles, the
+// registers are kept in locals for the duration of the run loop and
+// each instruction jumps straight to the next one through a table of
+// label addresses (GCC computed gotos).  Compilers without that
+// extension get a plain switch instead.
+//
+// Included at the end of instructions.c when
+// GAMEBOY_THREADED_INTERPRETER is defined.  It must implement exactly
+// the same semantics as the handlers above.
+
+#if defined(__GNUC__) && !defined(GAMEBOY_SWITCH_DISPATCH)
+#define THREADED_COMPUTED_GOTO 1
+#else
+#define THREADED_COMPUTED_GOTO 0
+#endif
+
+#define MASK_Z (1 << FLAG_Z)
+#define MASK_N (1 << FLAG_N)
+#define MASK_H (1 << FLAG_H)
+#define MASK_C (1 << FLAG_C)
+
+#define BC ((uint16)((b << 8) | c))
+#define DE ((uint16)((d << 8) | e))
+#define HL ((uint16)((h << 8) | l))
+#define SET_BC(value) { uint16 v_ = (value); b = v_ >> 8; c = v_ & 0xFF; }
+#define SET_DE(value) { uint16 v_ = (value); d = v_ >> 8; e = v_ & 0xFF; }
+#define SET_HL(value) { uint16 v_ = (value); h = v_ >> 8; l = v_ & 0xFF; }
+
+#define IMM8() RD(pc++)
+#define IMM16(dst) { uint8 lsb_ = IMM8(); uint8 msb_ = IMM8(); dst = (msb_ << 8) | lsb_; }
+
+#define PUSH(value) { sp -= 2; writeMemory16(gb, sp, (value)); }
+#define POP(dst) { dst = readMemory16(gb, sp); sp += 2; }
+
+#define COND_NZ_TRUE (!(f & MASK_Z))
+#define COND_Z_TRUE (f & MASK_Z)
+#define COND_NC_TRUE (!(f & MASK_C))
+#define COND_C_TRUE (f & MASK_C)
+
+// ALU : same flag computations as doAdd, doSub, etc.
+#define ALU_ADD(value) {                                                \
+        uint8 rhs_ = (value);                                           \
+        uint16 result16_ = a + rhs_;                                    \
+        f = ((result16_ & 0xFF) ? 0 : MASK_Z)                           \
+            | ((((a & 0x0F) + (rhs_ & 0x0F)) & 0x10) ? MASK_H : 0)      \
+            | ((result16_ >> 8) ? MASK_C : 0);                          \
+        a = result16_ & 0xFF;                                           \
+    }
+
+#define ALU_ADC(value) {                                                \
+        uint8 rhs_ = (value);                                           \
+        uint8 carry_ = (f & MASK_C) ? 1 : 0;                            \
+        uint16 result16_ = a + rhs_ + carry_;                           \
+        f = ((result16_ & 0xFF) ? 0 : MASK_Z)                           \
+            | ((((a & 0x0F) + (rhs_ & 0x0F) + carry_) & 0x10) ? MASK_H : 0) \
+            | ((result16_ >> 8) ? MASK_C : 0);                          \
+        a = result16_ & 0xFF;                                           \
+    }
+
+#define ALU_SUB(value) {                                                \
+        uint8 rhs_ = (value);                                           \
+        uint16 result16_ = a - rhs_;                                    \
+        f = ((result16_ & 0xFF) ? 0 : MASK_Z)                           \
+            | MASK_N                                                    \
+            | ((((a & 0x0F) - (rhs_ & 0x0F)) & 0x10) ? MASK_H : 0)      \
+            | ((result16_ >> 8) ? MASK_C : 0);                          \
+        a = result16_ & 0xFF;                                           \
+    }
+
+#define ALU_SBC(value) {                                                \
+        uint8 rhs_ = (value);                                           \
+        uint8 carry_ = (f & MASK_C) ? 1 : 0;                            \
+        uint16 result16_ = a - rhs_ - carry_;                           \
+        f = ((result16_ & 0xFF) ? 0 : MASK_Z)                           \
+            | MASK_N                                                    \
+            | ((((a & 0x0F) - (rhs_ & 0x0F) - carry_) & 0x10) ? MASK_H : 0) \
+            | ((result16_ >> 8) ? MASK_C : 0);                          \
+        a = result16_ & 0xFF;                                           \
+    }
+
+#define ALU_AND(value) { a &= (value); f = (a ? 0 : MASK_Z) | MASK_H; }
+#define ALU_XOR(value) { a ^= (value); f = (a ? 0 : MASK_Z); }
+#define ALU_OR(value) { a |= (value); f = (a ? 0 : MASK_Z); }
+
+#define ALU_CP(value) {                                                 \
+        uint8 rhs_ = (value);                                           \
+        f = (a == rhs_ ? MASK_Z : 0)                                    \
+            | MASK_N                                                    \
+            | ((((a & 0x0F) - (rhs_ & 0x0F)) & 0x10) ? MASK_H : 0)      \
+            | (a < rhs_ ? MASK_C : 0);                                  \
+    }
+
+#define INC8(reg) {                                                     \
+        uint8 lhs_ = reg;                                               \
+        reg = lhs_ + 1;                                                 \
+        f = (f & MASK_C)                                                \
+            | (reg ? 0 : MASK_Z)                                        \
+            | ((((lhs_ & 0x0F) + 1) & 0x10) ? MASK_H : 0);              \
+    }
+
+#define DEC8(reg) {                                                     \
+        uint8 lhs_ = reg;                                               \
+        reg = lhs_ - 1;                                                 \
+        f = (f & MASK_C)                                                \
+            | (reg ? 0 : MASK_Z)                                        \
+            | MASK_N                                                    \
+            | ((((lhs_ & 0x0F) - 1) & 0x10) ? MASK_H : 0);              \
+    }
+
+#define ADD_HL(value) {                                                 \
+        uint16 lhs_ = HL;                                               \
+        uint16 rhs_ = (value);                                          \
+        uint32 result32_ = lhs_ + rhs_;                                 \
+        SET_HL(result32_ & 0xFFFF);                                     \
+        f = (f & MASK_Z)                                                \
+            | ((((lhs_ & 0xFFF) + (rhs_ & 0xFFF)) & 0x1000) ? MASK_H : 0) \
+            | ((result32_ >> 16) ? MASK_C : 0);                         \
+    }
+
+#define SP_PLUS_SIGNED(dst) {                                           \
+        uint16 lhs_ = sp;                                               \
+        int16 rhs_ = (int8)IMM8();                                      \
+        uint32 result32_ = lhs_ + rhs_;                                 \
+        dst = result32_ & 0xFFFF;                                       \
+        f = ((((lhs_ & 0xF) + (rhs_ & 0xF)) & 0x10) ? MASK_H : 0)       \
+            | ((((lhs_ & 0xFF) + (rhs_ & 0xFF)) & 0x100) ? MASK_C : 0); \
+    }
+
+// Register operand encoded in the low 3 bits of an opcode, (HL) is 6
+#define GET_R8(index, dst)                              \
+    switch (index) {                                    \
+    case REG_B: dst = b; break;                         \
+    case REG_C: dst = c; break;                         \
+    case REG_D: dst = d; break;                         \
+    case REG_E: dst = e; break;                         \
+    case REG_H: dst = h; break;                         \
+    case REG_L: dst = l; break;                         \
+    case 6: dst = RD(HL); break;                        \
+    default: dst = a; break;                            \
+    }
+
+#define SET_R8(index, value)                            \
+    switch (index) {                                    \
+    case REG_B: b = value; break;                       \
+    case REG_C: c = value; break;                       \
+    case REG_D: d = value; break;                       \
+    case REG_E: e = value; break;                       \
+    case REG_H: h = value; break;                       \
+    case REG_L: l = value; break;                       \
+    case 6: WR(HL, value); break;                       \
+    default: a = value; break;                          \
+    }
+
+#define SAVE_REGISTERS() {                                      \
+        REG8(REG_A) = a;                                        \
+        setFlags(gb, f);                                        \
+        REG8(REG_B) = b;                                        \
+        REG8(REG_C) = c;                                        \
+        REG8(REG_D) = d;                                        \
+        REG8(REG_E) = e;                                        \
+        REG8(REG_H) = h;                                        \
+        REG8(REG_L) = l;                                        \
+        REG(SP) = sp;                                           \
+        REG(PC) = pc;                                           \
+    }
+
+#define LOAD_REGISTERS() {                                      \
+        materializeFlags(gb);                                   \
+        a = REG8(REG_A);                                        \
+        f = getReg8(gb, REG_F);                                 \
+        b = REG8(REG_B);                                        \
+        c = REG8(REG_C);                                        \
+        d = REG8(REG_D);                                        \
+        e = REG8(REG_E);                                        \
+        h = REG8(REG_H);                                        \
+        l = REG8(REG_L);                                        \
+        sp = REG(SP);                                           \
+        pc = REG(PC);                                           \
+    }
+
+// Same as handleInterrupt, which only needs PC and SP
+#define CHECK_INTERRUPTS() {                                    \
+        uint8 ifReg_ = IO(IF);                                  \
+        if (ifReg_) {                                           \
+            gb->halted = false;                                 \
+            if (gb->ime && (ifReg_ & gb->ie & 0x1F)) {          \
+                REG(PC) = pc;                                   \
+                REG(SP) = sp;                                   \
+                handleInterrupt(gb);                            \
+                pc = REG(PC);                                   \
+                sp = REG(SP);                                   \
+            }                                                   \
+        }                                                       \
+    }
+
+#if THREADED_COMPUTED_GOTO
+#define OPCODE(hex) op_##hex:
+#define DISPATCH() { opcode = IMM8(); goto *dispatchTable[opcode]; }
+#define SWITCH_BEGIN() goto *dispatchTable[opcode];
+#define SWITCH_END()
+#else
+#define OPCODE(hex) case 0x##hex:
+#define DISPATCH() goto fetch
+#define SWITCH_BEGIN() switch (opcode) {
+#define SWITCH_END() default: goto invalidOpcode; }
+#endif
+
+// End of an instruction : advance the clock, take interrupts, then go
+// straight to the next opcode unless the run loop has to stop
+#define NEXT(cycles) {                                                  \
+        stepClock(gb, cycles);                                          \
+        elapsed += cycles;                                              \
+        CHECK_INTERRUPTS();                                             \
+        if (gb->halted || gb->frameReady || elapsed >= cycleCount) {    \
+            goto boundary;                                              \
+        }                                                               \
+        DISPATCH();                                                     \
+    }
+
+#define LD_R_R(dst, src) dst = src; NEXT(4)
+#define LD_R_HL(dst) dst = RD(HL); NEXT(8)
+#define LD_HL_R(src) WR(HL, src); NEXT(8)
+
+uint32 runCycles(GameBoy* gb, uint32 cycleCount) {
+    if (gb->tracing || gb->guestProfile) {
+        // tracing and profiling go through the handler table, which
+        // keeps PC up to date in the registers
+        return runCyclesWithHandlers(gb, cycleCount);
+    }
+
+#if THREADED_COMPUTED_GOTO
+#define LABELS16(hi)                                                    \
+    &&op_##hi##0, &&op_##hi##1, &&op_##hi##2, &&op_##hi##3,             \
+    &&op_##hi##4, &&op_##hi##5, &&op_##hi##6, &&op_##hi##7,             \
+    &&op_##hi##8, &&op_##hi##9, &&op_##hi##A, &&op_##hi##B,             \
+    &&op_##hi##C, &&op_##hi##D, &&op_##hi##E, &&op_##hi##F
+
+    static void* const dispatchTable[256] = {
+        LABELS16(0), LABELS16(1), LABELS16(2), LABELS16(3),
+        LABELS16(4), LABELS16(5), LABELS16(6), LABELS16(7),
+        LABELS16(8), LABELS16(9), LABELS16(A), LABELS16(B),
+        LABELS16(C), LABELS16(D), LABELS16(E), LABELS16(F),
+    };
+#undef LABELS16
+#endif
+
+    uint8 a, f, b, c, d, e, h, l;
+    uint16 sp, pc;
+    uint8 opcode;
+    uint32 elapsed = 0;
+
+    LOAD_REGISTERS();
+
+boundary:
+    while (gb->halted && !gb->frameReady && elapsed < cycleCount) {
+        uint32 duration = getHaltDuration(gb, cycleCount - elapsed);
+        stepClock(gb, duration);
+        elapsed += duration;
+        CHECK_INTERRUPTS();
+    }
+
+    if (gb->frameReady || elapsed >= cycleCount) {
+        SAVE_REGISTERS();
+        return elapsed;
+    }
+
+#if !THREADED_COMPUTED_GOTO
+fetch:
+#endif
+    opcode = IMM8();
+
+    SWITCH_BEGIN()
+
+    // 00
+    OPCODE(00) NEXT(4);
+    OPCODE(01) c = IMM8(); b = IMM8(); NEXT(12);
+    OPCODE(02) WR(BC, a); NEXT(8);
+    OPCODE(03) SET_BC(BC + 1); NEXT(8);
+    OPCODE(04) INC8(b); NEXT(4);
+    OPCODE(05) DEC8(b); NEXT(4);
+    OPCODE(06) b = IMM8(); NEXT(8);
+    OPCODE(07) a = rotateLeft(a); f = (a & 1) ? MASK_C : 0; NEXT(4);
+    OPCODE(08) { uint16 address; IMM16(address); writeMemory16(gb, address, sp); } NEXT(20);
+    OPCODE(09) ADD_HL(BC); NEXT(8);
+    OPCODE(0A) a = RD(BC); NEXT(8);
+    OPCODE(0B) SET_BC(BC - 1); NEXT(8);
+    OPCODE(0C) INC8(c); NEXT(4);
+    OPCODE(0D) DEC8(c); NEXT(4);
+    OPCODE(0E) c = IMM8(); NEXT(8);
+    OPCODE(0F) a = rotateRight(a); f = (a >> 7) ? MASK_C : 0; NEXT(4);
+
+    // 10
+    OPCODE(10) IO(DIV) = 0; NEXT(4);
+    OPCODE(11) e = IMM8(); d = IMM8(); NEXT(12);
+    OPCODE(12) WR(DE, a); NEXT(8);
+    OPCODE(13) SET_DE(DE + 1); NEXT(8);
+    OPCODE(14) INC8(d); NEXT(4);
+    OPCODE(15) DEC8(d); NEXT(4);
+    OPCODE(16) d = IMM8(); NEXT(8);
+    OPCODE(17) {
+        uint8 oldCarry = (f & MASK_C) ? 1 : 0;
+        f = (a >> 7) ? MASK_C : 0;
+        a = (a << 1) | oldCarry;
+    } NEXT(4);
+    OPCODE(18) { int8 offset = (int8)IMM8(); pc += offset; } NEXT(12);
+    OPCODE(19) ADD_HL(DE); NEXT(8);
+    OPCODE(1A) a = RD(DE); NEXT(8);
+    OPCODE(1B) SET_DE(DE - 1); NEXT(8);
+    OPCODE(1C) INC8(e); NEXT(4);
+    OPCODE(1D) DEC8(e); NEXT(4);
+    OPCODE(1E) e = IMM8(); NEXT(8);
+    OPCODE(1F) {
+        uint8 oldCarry = (f & MASK_C) ? 1 : 0;
+        f = (a & 1) ? MASK_C : 0;
+        a = (a >> 1) | (oldCarry << 7);
+    } NEXT(4);
+
+    // 20
+    OPCODE(20) if (COND_NZ_TRUE) { int8 offset = (int8)IMM8(); pc += offset; NEXT(12); } else { pc++; NEXT(8); }
+    OPCODE(21) l = IMM8(); h = IMM8(); NEXT(12);
+    OPCODE(22) WR(HL, a); SET_HL(HL + 1); NEXT(8);
+    OPCODE(23) SET_HL(HL + 1); NEXT(8);
+    OPCODE(24) INC8(h); NEXT(4);
+    OPCODE(25) DEC8(h); NEXT(4);
+    OPCODE(26) h = IMM8(); NEXT(8);
+    OPCODE(27) {
+        // same as decimalAdjust
+        if (!(f & MASK_N)) {
+            if ((f & MASK_C) || a > 0x99) {
+                a += 0x60;
+                f |= MASK_C;
+            }
+            if ((f & MASK_H) || (a & 0x0f) > 0x09) {
+                a += 0x6;
+            }
+        } else {
+            if (f & MASK_C) {
+                a -= 0x60;
+            }
+            if (f & MASK_H) {
+                a -= 0x6;
+            }
+        }
+        f = (f & (MASK_N | MASK_C)) | (a ? 0 : MASK_Z);
+    } NEXT(4);
+    OPCODE(28) if (COND_Z_TRUE) { int8 offset = (int8)IMM8(); pc += offset; NEXT(12); } else { pc++; NEXT(8); }
+    OPCODE(29) ADD_HL(HL); NEXT(8);
+    OPCODE(2A) a = RD(HL); SET_HL(HL + 1); NEXT(8);
+    OPCODE(2B) SET_HL(HL - 1); NEXT(8);
+    OPCODE(2C) INC8(l); NEXT(4);
+    OPCODE(2D) DEC8(l); NEXT(4);
+    OPCODE(2E) l = IMM8(); NEXT(8);
+    OPCODE(2F) a = ~a; f |= MASK_N | MASK_H; NEXT(4);
+
+    // 30
+    OPCODE(30) if (COND_NC_TRUE) { int8 offset = (int8)IMM8(); pc += offset; NEXT(12); } else { pc++; NEXT(8); }
+    OPCODE(31) IMM16(sp); NEXT(12);
+    OPCODE(32) WR(HL, a); SET_HL(HL - 1); NEXT(8);
+    OPCODE(33) sp++; NEXT(8);
+    OPCODE(34) {
+        uint8 lhs = RD(HL);
+        WR(HL, lhs + 1);
+        f = (f & MASK_C)
+            | (RD(HL) ? 0 : MASK_Z)
+            | ((((lhs & 0x0F) + 1) & 0x10) ? MASK_H : 0);
+    } NEXT(12);
+    OPCODE(35) {
+        uint8 lhs = RD(HL);
+        WR(HL, lhs - 1);
+        f = (f & MASK_C)
+            | (RD(HL) ? 0 : MASK_Z)
+            | MASK_N
+            | ((((lhs & 0x0F) - 1) & 0x10) ? MASK_H : 0);
+    } NEXT(12);
+    OPCODE(36) WR(HL, IMM8()); NEXT(12);
+    OPCODE(37) f = (f & MASK_Z) | MASK_C; NEXT(4);
+    OPCODE(38) if (COND_C_TRUE) { int8 offset = (int8)IMM8(); pc += offset; NEXT(12); } else { pc++; NEXT(8); }
+    OPCODE(39) ADD_HL(sp); NEXT(8);
+    OPCODE(3A) a = RD(HL); SET_HL(HL - 1); NEXT(8);
+    OPCODE(3B) sp--; NEXT(8);
+    OPCODE(3C) INC8(a); NEXT(4);
+    OPCODE(3D) DEC8(a); NEXT(4);
+    OPCODE(3E) a = IMM8(); NEXT(8);
+    OPCODE(3F) f = (f & MASK_Z) | ((f & MASK_C) ? 0 : MASK_C); NEXT(4);
+
+    // 40
+    OPCODE(40) LD_R_R(b, b);
+    OPCODE(41) LD_R_R(b, c);
+    OPCODE(42) LD_R_R(b, d);
+    OPCODE(43) LD_R_R(b, e);
+    OPCODE(44) LD_R_R(b, h);
+    OPCODE(45) LD_R_R(b, l);
+    OPCODE(46) LD_R_HL(b);
+    OPCODE(47) LD_R_R(b, a);
+    OPCODE(48) LD_R_R(c, b);
+    OPCODE(49) LD_R_R(c, c);
+    OPCODE(4A) LD_R_R(c, d);
+    OPCODE(4B) LD_R_R(c, e);
+    OPCODE(4C) LD_R_R(c, h);
+    OPCODE(4D) LD_R_R(c, l);
+    OPCODE(4E) LD_R_HL(c);
+    OPCODE(4F) LD_R_R(c, a);
+
+    // 50
+    OPCODE(50) LD_R_R(d, b);
+    OPCODE(51) LD_R_R(d, c);
+    OPCODE(52) LD_R_R(d, d);
+    OPCODE(53) LD_R_R(d, e);
+    OPCODE(54) LD_R_R(d, h);
+    OPCODE(55) LD_R_R(d, l);
+    OPCODE(56) LD_R_HL(d);
+    OPCODE(57) LD_R_R(d, a);
+    OPCODE(58) LD_R_R(e, b);
+    OPCODE(59) LD_R_R(e, c);
+    OPCODE(5A) LD_R_R(e, d);
+    OPCODE(5B) LD_R_R(e, e);
+    OPCODE(5C) LD_R_R(e, h);
+    OPCODE(5D) LD_R_R(e, l);
+    OPCODE(5E) LD_R_HL(e);
+    OPCODE(5F) LD_R_R(e, a);
+
+    // 60
+    OPCODE(60) LD_R_R(h, b);
+    OPCODE(61) LD_R_R(h, c);
+    OPCODE(62) LD_R_R(h, d);
+    OPCODE(63) LD_R_R(h, e);
+    OPCODE(64) LD_R_R(h, h);
+    OPCODE(65) LD_R_R(h, l);
+    OPCODE(66) LD_R_HL(h);
+    OPCODE(67) LD_R_R(h, a);
+    OPCODE(68) LD_R_R(l, b);
+    OPCODE(69) LD_R_R(l, c);
+    OPCODE(6A) LD_R_R(l, d);
+    OPCODE(6B) LD_R_R(l, e);
+    OPCODE(6C) LD_R_R(l, h);
+    OPCODE(6D) LD_R_R(l, l);
+    OPCODE(6E) LD_R_HL(l);
+    OPCODE(6F) LD_R_R(l, a);
+
+    // 70
+    OPCODE(70) LD_HL_R(b);
+    OPCODE(71) LD_HL_R(c);
+    OPCODE(72) LD_HL_R(d);
+    OPCODE(73) LD_HL_R(e);
+    OPCODE(74) LD_HL_R(h);
+    OPCODE(75) LD_HL_R(l);
+    OPCODE(76) gb->halted = true; NEXT(4);
+    OPCODE(77) LD_HL_R(a);
+    OPCODE(78) LD_R_R(a, b);
+    OPCODE(79) LD_R_R(a, c);
+    OPCODE(7A) LD_R_R(a, d);
+    OPCODE(7B) LD_R_R(a, e);
+    OPCODE(7C) LD_R_R(a, h);
+    OPCODE(7D) LD_R_R(a, l);
+    OPCODE(7E) LD_R_HL(a);
+    OPCODE(7F) LD_R_R(a, a);
+
+    // 80
+    OPCODE(80) ALU_ADD(b); NEXT(4);
+    OPCODE(81) ALU_ADD(c); NEXT(4);
+    OPCODE(82) ALU_ADD(d); NEXT(4);
+    OPCODE(83) ALU_ADD(e); NEXT(4);
+    OPCODE(84) ALU_ADD(h); NEXT(4);
+    OPCODE(85) ALU_ADD(l); NEXT(4);
+    OPCODE(86) ALU_ADD(RD(HL)); NEXT(8);
+    OPCODE(87) ALU_ADD(a); NEXT(4);
+    OPCODE(88) ALU_ADC(b); NEXT(4);
+    OPCODE(89) ALU_ADC(c); NEXT(4);
+    OPCODE(8A) ALU_ADC(d); NEXT(4);
+    OPCODE(8B) ALU_ADC(e); NEXT(4);
+    OPCODE(8C) ALU_ADC(h); NEXT(4);
+    OPCODE(8D) ALU_ADC(l); NEXT(4);
+    OPCODE(8E) ALU_ADC(RD(HL)); NEXT(8);
+    OPCODE(8F) ALU_ADC(a); NEXT(4);
+
+    // 90
+    OPCODE(90) ALU_SUB(b); NEXT(4);
+    OPCODE(91) ALU_SUB(c); NEXT(4);
+    OPCODE(92) ALU_SUB(d); NEXT(4);
+    OPCODE(93) ALU_SUB(e); NEXT(4);
+    OPCODE(94) ALU_SUB(h); NEXT(4);
+    OPCODE(95) ALU_SUB(l); NEXT(4);
+    OPCODE(96) ALU_SUB(RD(HL)); NEXT(8);
+    OPCODE(97) ALU_SUB(a); NEXT(4);
+    OPCODE(98) ALU_SBC(b); NEXT(4);
+    OPCODE(99) ALU_SBC(c); NEXT(4);
+    OPCODE(9A) ALU_SBC(d); NEXT(4);
+    OPCODE(9B) ALU_SBC(e); NEXT(4);
+    OPCODE(9C) ALU_SBC(h); NEXT(4);
+    OPCODE(9D) ALU_SBC(l); NEXT(4);
+    OPCODE(9E) ALU_SBC(RD(HL)); NEXT(8);
+    OPCODE(9F) ALU_SBC(a); NEXT(4);
+
+    // A0
+    OPCODE(A0) ALU_AND(b); NEXT(4);
+    OPCODE(A1) ALU_AND(c); NEXT(4);
+    OPCODE(A2) ALU_AND(d); NEXT(4);
+    OPCODE(A3) ALU_AND(e); NEXT(4);
+    OPCODE(A4) ALU_AND(h); NEXT(4);
+    OPCODE(A5) ALU_AND(l); NEXT(4);
+    OPCODE(A6) ALU_AND(RD(HL)); NEXT(8);
+    OPCODE(A7) ALU_AND(a); NEXT(4);
+    OPCODE(A8) ALU_XOR(b); NEXT(4);
+    OPCODE(A9) ALU_XOR(c); NEXT(4);
+    OPCODE(AA) ALU_XOR(d); NEXT(4);
+    OPCODE(AB) ALU_XOR(e); NEXT(4);
+    OPCODE(AC) ALU_XOR(h); NEXT(4);
+    OPCODE(AD) ALU_XOR(l); NEXT(4);
+    OPCODE(AE) ALU_XOR(RD(HL)); NEXT(8);
+    OPCODE(AF) ALU_XOR(a); NEXT(4);
+
+    // B0
+    OPCODE(B0) ALU_OR(b); NEXT(4);
+    OPCODE(B1) ALU_OR(c); NEXT(4);
+    OPCODE(B2) ALU_OR(d); NEXT(4);
+    OPCODE(B3) ALU_OR(e); NEXT(4);
+    OPCODE(B4) ALU_OR(h); NEXT(4);
+    OPCODE(B5) ALU_OR(l); NEXT(4);
+    OPCODE(B6) ALU_OR(RD(HL)); NEXT(8);
+    OPCODE(B7) ALU_OR(a); NEXT(4);
+    OPCODE(B8) ALU_CP(b); NEXT(4);
+    OPCODE(B9) ALU_CP(c); NEXT(4);
+    OPCODE(BA) ALU_CP(d); NEXT(4);
+    OPCODE(BB) ALU_CP(e); NEXT(4);
+    OPCODE(BC) ALU_CP(h); NEXT(4);
+    OPCODE(BD) ALU_CP(l); NEXT(4);
+    OPCODE(BE) ALU_CP(RD(HL)); NEXT(8);
+    OPCODE(BF) ALU_CP(a); NEXT(4);
+
+    // C0
+    OPCODE(C0) if (COND_NZ_TRUE) { popCallFrames(gb, sp); POP(pc); NEXT(20); } else { NEXT(8); }
+    OPCODE(C1) { uint16 value; POP(value); SET_BC(value); } NEXT(12);
+    OPCODE(C2) if (COND_NZ_TRUE) { IMM16(pc); NEXT(16); } else { pc += 2; NEXT(12); }
+    OPCODE(C3) IMM16(pc); NEXT(16);
+    OPCODE(C4) if (COND_NZ_TRUE) {
+        uint16 address;
+        IMM16(address);
+        PUSH(pc);
+        pc = address;
+        pushCallFrame(gb, address, sp);
+        NEXT(24);
+    } else {
+        pc += 2;
+        NEXT(12);
+    }
+    OPCODE(C5) PUSH(BC); NEXT(16);
+    OPCODE(C6) ALU_ADD(IMM8()); NEXT(8);
+    OPCODE(C7) PUSH(pc); pc = 0x00; pushCallFrame(gb, pc, sp); NEXT(16);
+    OPCODE(C8) if (COND_Z_TRUE) { popCallFrames(gb, sp); POP(pc); NEXT(20); } else { NEXT(8); }
+    OPCODE(C9) popCallFrames(gb, sp); POP(pc); NEXT(16);
+    OPCODE(CA) if (COND_Z_TRUE) { IMM16(pc); NEXT(16); } else { pc += 2; NEXT(12); }
+    OPCODE(CB) {
+        uint8 cbOpcode = IMM8();
+        uint8 reg = cbOpcode & 0x7;
+        uint8 bitIndex = (cbOpcode >> 3) & 0x7;
+        uint8 value;
+        uint8 cycles;
+
+        GET_R8(reg, value);
+
+        if (cbOpcode < 0x40) {
+            uint8 result;
+            uint8 carry;
+
+            switch (bitIndex) {
+            case 0: // rlc
+                result = rotateLeft(value);
+                carry = value >> 7;
+                break;
+            case 1: // rrc
+                result = rotateRight(value);
+                carry = value & 1;
+                break;
+            case 2: // rl
+                result = (value << 1) | ((f & MASK_C) ? 1 : 0);
+                carry = value >> 7;
+                break;
+            case 3: // rr
+                result = (value >> 1) | ((f & MASK_C) ? 0x80 : 0);
+                carry = value & 1;
+                break;
+            case 4: // sla
+                result = value << 1;
+                carry = value >> 7;
+                break;
+            case 5: // sra
+                result = (value >> 1) | (value & 0x80);
+                carry = value & 1;
+                break;
+            case 6: // swap
+                result = (value >> 4) | (value << 4);
+                carry = 0;
+                break;
+            default: // srl
+                result = value >> 1;
+                carry = value & 1;
+                break;
+            }
+
+            f = (result ? 0 : MASK_Z) | (carry ? MASK_C : 0);
+            SET_R8(reg, result);
+            cycles = (reg == 6) ? 16 : 8;
+        } else if (cbOpcode < 0x80) { // test bit
+            f = (f & MASK_C) | MASK_H | (getBit(value, bitIndex) ? 0 : MASK_Z);
+            cycles = (reg == 6) ? 12 : 8;
+        } else if (cbOpcode < 0xC0) { // reset bit
+            uint8 result = resetBit(value, bitIndex);
+            SET_R8(reg, result);
+            cycles = (reg == 6) ? 16 : 8;
+        } else { // set bit
+            uint8 result = setBit(value, bitIndex);
+            SET_R8(reg, result);
+            cycles = (reg == 6) ? 16 : 8;
+        }
+
+        NEXT(cycles);
+    }
+    OPCODE(CC) if (COND_Z_TRUE) {
+        uint16 address;
+        IMM16(address);
+        PUSH(pc);
+        pc = address;
+        pushCallFrame(gb, address, sp);
+        NEXT(24);
+    } else {
+        pc += 2;
+        NEXT(12);
+    }
+    OPCODE(CD) {
+        uint16 address;
+        IMM16(address);
+        PUSH(pc);
+        pc = address;
+        pushCallFrame(gb, address, sp);
+    } NEXT(24);
+    OPCODE(CE) ALU_ADC(IMM8()); NEXT(8);
+    OPCODE(CF) PUSH(pc); pc = 0x08; pushCallFrame(gb, pc, sp); NEXT(16);
+
+    // D0
+    OPCODE(D0) if (COND_NC_TRUE) { popCallFrames(gb, sp); POP(pc); NEXT(20); } else { NEXT(8); }
+    OPCODE(D1) { uint16 value; POP(value); SET_DE(value); } NEXT(12);
+    OPCODE(D2) if (COND_NC_TRUE) { IMM16(pc); NEXT(16); } else { pc += 2; NEXT(12); }
+    OPCODE(D4) if (COND_NC_TRUE) {
+        uint16 address;
+        IMM16(address);
+        PUSH(pc);
+        pc = address;
+        pushCallFrame(gb, address, sp);
+        NEXT(24);
+    } else {
+        pc += 2;
+        NEXT(12);
+    }
+    OPCODE(D5) PUSH(DE); NEXT(16);
+    OPCODE(D6) ALU_SUB(IMM8()); NEXT(8);
+    OPCODE(D7) PUSH(pc); pc = 0x10; pushCallFrame(gb, pc, sp); NEXT(16);
+    OPCODE(D8) if (COND_C_TRUE) { popCallFrames(gb, sp); POP(pc); NEXT(20); } else { NEXT(8); }
+    OPCODE(D9) gb->ime = 1; popCallFrames(gb, sp); POP(pc); NEXT(16);
+    OPCODE(DA) if (COND_C_TRUE) { IMM16(pc); NEXT(16); } else { pc += 2; NEXT(12); }
+    OPCODE(DC) if (COND_C_TRUE) {
+        uint16 address;
+        IMM16(address);
+        PUSH(pc);
+        pc = address;
+        pushCallFrame(gb, address, sp);
+        NEXT(24);
+    } else {
+        pc += 2;
+        NEXT(12);
+    }
+    OPCODE(DE) ALU_SBC(IMM8()); NEXT(8);
+    OPCODE(DF) PUSH(pc); pc = 0x18; pushCallFrame(gb, pc, sp); NEXT(16);
+
+    // E0
+    OPCODE(E0) { uint8 port = IMM8(); WR(0xFF00 + port, a); } NEXT(12);
+    OPCODE(E1) { uint16 value; POP(value); SET_HL(value); } NEXT(12);
+    OPCODE(E2) WR(0xFF00 + c, a); NEXT(8);
+    OPCODE(E5) PUSH(HL); NEXT(16);
+    OPCODE(E6) ALU_AND(IMM8()); NEXT(8);
+    OPCODE(E7) PUSH(pc); pc = 0x20; pushCallFrame(gb, pc, sp); NEXT(16);
+    OPCODE(E8) SP_PLUS_SIGNED(sp); NEXT(16);
+    OPCODE(E9) pc = HL; NEXT(4);
+    OPCODE(EA) { uint16 address; IMM16(address); WR(address, a); } NEXT(16);
+    OPCODE(EE) ALU_XOR(IMM8()); NEXT(8);
+    OPCODE(EF) PUSH(pc); pc = 0x28; pushCallFrame(gb, pc, sp); NEXT(16);
+
+    // F0
+    OPCODE(F0) { uint8 port = IMM8(); a = RD(0xFF00 + port); } NEXT(12);
+    OPCODE(F1) { uint16 value; POP(value); a = value >> 8; f = value & 0xF0; } NEXT(12);
+    OPCODE(F2) a = RD(0xFF00 + c); NEXT(8);
+    OPCODE(F3) gb->ime = 0; NEXT(4);
+    OPCODE(F5) PUSH((a << 8) | f); NEXT(16);
+    OPCODE(F6) ALU_OR(IMM8()); NEXT(8);
+    OPCODE(F7) PUSH(pc); pc = 0x30; pushCallFrame(gb, pc, sp); NEXT(16);
+    OPCODE(F8) { uint16 result; SP_PLUS_SIGNED(result); SET_HL(result); } NEXT(12);
+    OPCODE(F9) sp = HL; NEXT(8);
+    OPCODE(FA) { uint16 address; IMM16(address); a = RD(address); } NEXT(16);
+    OPCODE(FB) gb->ime = 1; NEXT(4);
+    OPCODE(FE) ALU_CP(IMM8()); NEXT(8);
+    OPCODE(FF) PUSH(pc); pc = 0x38; pushCallFrame(gb, pc, sp); NEXT(16);
+
+    OPCODE(D3)
+    OPCODE(DB)
+    OPCODE(DD)
+    OPCODE(E3)
+    OPCODE(E4)
+    OPCODE(EB)
+    OPCODE(EC)
+    OPCODE(ED)
+    OPCODE(F4)
+    OPCODE(FC)
+    OPCODE(FD)
+    goto invalidOpcode;
+
+    SWITCH_END()
+
+invalidOpcode:
+    fprintf(stderr, "Invalid opcode %X at 0x%04X\n", opcode, (uint16)(pc - 1));
+    exit(1);
+}
+
+#undef THREADED_COMPUTED_GOTO
+#undef MASK_Z
+#undef MASK_N
+#undef MASK_H
+#undef MASK_C
+#undef BC
+#undef DE
+#undef HL
+#undef SET_BC
+#undef SET_DE
+#undef SET_HL
+#undef IMM8
+#undef IMM16
+#undef PUSH
+#undef POP
+#undef OPCODE
+#undef DISPATCH
+#undef SWITCH_BEGIN
+#undef SWITCH_END
+#undef NEXT
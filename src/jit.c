@@ -0,0 +1,716 @@
+// Dynamic recompiler : translates hot ROM blocks from the decode cache
+// into x86-64 code.  Included at the end of instructions.c when
+// GAMEBOY_JIT is defined.
+//
+// Guest registers stay in gb->registers, rbx holds the GameBoy
+// pointer.  Register loads, ALU operations, 16-bit increments and
+// jumps are emitted natively, everything else calls back into the
+// handler table through jitExecuteInstruction.  After every
+// instruction the generated code calls jitTick, which does what the
+// interpreter does between two instructions (stepClock,
+// handleInterrupt) and tells the block to exit when PC went elsewhere,
+// the CPU halted, the frame is done, the cycle budget is spent or the
+// ROM bank of the block was switched out.  Runs of native instructions
+// share a single jitTick when jitCanBatch finds that nothing can
+// happen in between.  The emulated state is therefore the same as with
+// the interpreter.
+//
+// The generated code reads and writes F directly, so the lazy flags are
+// materialized when entering a block and after every handler.
+//
+// The code arena is never writable and executable at once : it is
+// mapped read-write, and the pages of a block are made read-execute
+// once it is emitted.  The arena is unmapped when the library is
+// unloaded, and the host drops the decoded blocks, which point into it,
+// after a reload.  It is shared by every GameBoy, which makes the JIT
+// single-threaded; what a running block needs to know about its
+// runCycles call is in gb->jit.
+
+#if !defined(__x86_64__) || !defined(__linux__)
+#error "GAMEBOY_JIT needs an x86-64 Linux host"
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define JIT_ARENA_SIZE (16 * 1024 * 1024)
+#define JIT_HOT_THRESHOLD 16
+// upper bound of the code emitted for one block
+#define JIT_MAX_BLOCK_SIZE (DECODED_BLOCK_MAX_INSTRUCTIONS * 256 + 64)
+
+#define GB_F_Z 0x80
+#define GB_F_N 0x40
+#define GB_F_H 0x20
+#define GB_F_C 0x10
+
+typedef void JitBlockFn(GameBoy* gb);
+
+static uint8* jitArena;
+static uint32 jitArenaUsed;
+static uint32 jitGeneration;
+
+// lahf flags (ZF bit 6, AF bit 4, CF bit 0) to SM83 Z, H and C
+static uint8 jitFlagTable[256];
+
+static bool32 initializeJit(void) {
+    void* arena = mmap(0, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        return false;
+    }
+
+    for (uint32 ah = 0; ah < 256; ah++) {
+        jitFlagTable[ah] = ((ah & 0x40) ? GB_F_Z : 0)
+            | ((ah & 0x10) ? GB_F_H : 0)
+            | ((ah & 0x01) ? GB_F_C : 0);
+    }
+
+    jitArena = arena;
+    jitArenaUsed = 0;
+    jitGeneration++;
+
+    return true;
+}
+
+// Run by dlclose when the library is unloaded, and at exit
+__attribute__((destructor)) static void releaseJit(void) {
+    if (jitArena) {
+        munmap(jitArena, JIT_ARENA_SIZE);
+        jitArena = 0;
+    }
+}
+
+// Protection of the whole pages of [start, start + size).  When it
+// fails, the pages shared with earlier blocks may have lost PROT_EXEC,
+// so every block compiled so far is dropped.
+static bool32 protectJitCode(uint8* start, uint32 size, int protection) {
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)start & ~(pageSize - 1);
+    uintptr_t last = ((uintptr_t)start + size + pageSize - 1) & ~(pageSize - 1);
+
+    if (mprotect((void*)first, last - first, protection)) {
+        jitArenaUsed = 0;
+        jitGeneration++;
+        return false;
+    }
+
+    return true;
+}
+
+static bool32 jitTick(GameBoy* gb, uint32 cycles, uint32 nextPC) {
+    stepClock(gb, cycles);
+
+    // handleInterrupt, without the call when nothing can be dispatched
+    uint8 ifReg = IO(IF);
+    if (ifReg) {
+        gb->halted = false;
+        if (gb->ime && (ifReg & gb->ie & 0x1F)) {
+            handleInterrupt(gb);
+        }
+    }
+
+    return REG(PC) != nextPC
+        || gb->halted
+        || gb->frameReady
+        || (uint32)(gb->clock - gb->jit.startClock) >= gb->jit.cycleBudget
+        || gb->readPages[gb->jit.codePage] != gb->jit.codePagePointer;
+}
+
+// Call-out for the instructions that have no native code
+static uint8 jitExecuteInstruction(GameBoy* gb, DecodedInstruction* instr) {
+#ifdef GAMEBOY_LAZY_FLAGS_CHECK
+    gb->lazyFlags.checked = REG8(REG_F);
+#endif
+    
+    uint8 duration = executeDecodedInstruction(gb, instr);
+    materializeFlags(gb);
+
+    return duration;
+}
+
+typedef struct JitEmitter {
+    uint8* at;
+} JitEmitter;
+
+static void emit8(JitEmitter* e, uint8 value) {
+    *e->at++ = value;
+}
+
+static void emit16(JitEmitter* e, uint16 value) {
+    memcpy(e->at, &value, 2);
+    e->at += 2;
+}
+
+static void emit32(JitEmitter* e, uint32 value) {
+    memcpy(e->at, &value, 4);
+    e->at += 4;
+}
+
+static void emit64(JitEmitter* e, uint64 value) {
+    memcpy(e->at, &value, 8);
+    e->at += 8;
+}
+
+// rel32 placeholder, returns its address for patchJump
+static uint8* emitJump(JitEmitter* e, uint8 opcode) {
+    if (opcode != 0xE9) { // jcc
+        emit8(e, 0x0F);
+    }
+    emit8(e, opcode);
+    uint8* patch = e->at;
+    emit32(e, 0);
+
+    return patch;
+}
+
+static void patchJump(uint8* patch, uint8* target) {
+    int32 rel = (int32)(target - (patch + 4));
+    memcpy(patch, &rel, 4);
+}
+
+// instruction with a [rbx + disp32] operand
+static void emitRbx(JitEmitter* e, uint8 opcode, uint8 reg, uint32 offset) {
+    emit8(e, opcode);
+    emit8(e, 0x80 | (reg << 3) | 3);
+    emit32(e, offset);
+}
+
+static uint32 jitReg8Offset(uint8 reg) {
+    return offsetof(GameBoy, registers.bytes) + REG8_INDEX(reg);
+}
+
+static uint32 jitReg16Offset(enum Register16 reg) {
+    return offsetof(GameBoy, registers.pairs) + reg * 2;
+}
+
+static void emitCall(JitEmitter* e, void* function) {
+    emit8(e, 0x48); emit8(e, 0xB8); emit64(e, (uint64)function); // mov rax, function
+    emit8(e, 0xFF); emit8(e, 0xD0); // call rax
+}
+
+static void emitStorePC(JitEmitter* e, uint16 pc) {
+    emit8(e, 0x66);
+    emitRbx(e, 0xC7, 0, jitReg16Offset(REG_PC)); // mov word [PC], pc
+    emit16(e, pc);
+}
+
+// cl = SM83 flags for the lahf result in ah, keeping only mask
+static void emitFlagsFromLahf(JitEmitter* e, uint8 mask) {
+    emit8(e, 0x9F); // lahf
+    emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xCC); // movzx ecx, ah
+    emit8(e, 0x48); emit8(e, 0xBA); emit64(e, (uint64)jitFlagTable); // mov rdx, table
+    emit8(e, 0x8A); emit8(e, 0x0C); emit8(e, 0x0A); // mov cl, [rdx + rcx]
+    emit8(e, 0x80); emit8(e, 0xE1); emit8(e, mask); // and cl, mask
+}
+
+static void emitOrCl(JitEmitter* e, uint8 value) {
+    emit8(e, 0x80); emit8(e, 0xC9); emit8(e, value); // or cl, value
+}
+
+// ALU operation on A : x86 computes Z, H and C the same way the
+// handlers do, including the borrows of sub/sbc/cp
+static void emitAlu(JitEmitter* e, uint8 operation, bool32 immediate, uint8 operand) {
+    // x86 "op al, r/m8" and "op al, imm8" opcodes, in SM83 order
+    // add, adc, sub, sbc, and, xor, or, cp
+    uint8 memOpcodes[8] = {0x02, 0x12, 0x2A, 0x1A, 0x22, 0x32, 0x0A, 0x3A};
+    uint8 immOpcodes[8] = {0x04, 0x14, 0x2C, 0x1C, 0x24, 0x34, 0x0C, 0x3C};
+
+    emitRbx(e, 0x8A, 0, jitReg8Offset(REG_A)); // mov al, [A]
+
+    if (operation == 1 || operation == 3) {
+        // CF = SM83 carry
+        emitRbx(e, 0x8A, 1, jitReg8Offset(REG_F)); // mov cl, [F]
+        emit8(e, 0xC0); emit8(e, 0xE9); emit8(e, 5); // shr cl, 5
+    }
+
+    if (immediate) {
+        emit8(e, immOpcodes[operation]);
+        emit8(e, operand);
+    } else {
+        emitRbx(e, memOpcodes[operation], 0, jitReg8Offset(operand));
+    }
+
+    switch (operation) {
+    case 0: case 1: // add, adc
+        emitFlagsFromLahf(e, GB_F_Z | GB_F_H | GB_F_C);
+        break;
+    case 2: case 3: case 7: // sub, sbc, cp
+        emitFlagsFromLahf(e, GB_F_Z | GB_F_H | GB_F_C);
+        emitOrCl(e, GB_F_N);
+        break;
+    case 4: // and
+        emitFlagsFromLahf(e, GB_F_Z);
+        emitOrCl(e, GB_F_H);
+        break;
+    default: // xor, or
+        emitFlagsFromLahf(e, GB_F_Z);
+        break;
+    }
+
+    if (operation != 7) {
+        emitRbx(e, 0x88, 0, jitReg8Offset(REG_A)); // mov [A], al
+    }
+    emitRbx(e, 0x88, 1, jitReg8Offset(REG_F)); // mov [F], cl
+}
+
+// inc r / dec r : Z, N and H from the result, C unchanged
+static void emitIncDec8(JitEmitter* e, uint8 reg, bool32 decrement) {
+    emitRbx(e, 0xFE, decrement ? 1 : 0, jitReg8Offset(reg));
+    emitFlagsFromLahf(e, GB_F_Z | GB_F_H);
+    if (decrement) {
+        emitOrCl(e, GB_F_N);
+    }
+    emitRbx(e, 0x8A, 2, jitReg8Offset(REG_F)); // mov dl, [F]
+    emit8(e, 0x80); emit8(e, 0xE2); emit8(e, GB_F_C); // and dl, C
+    emit8(e, 0x08); emit8(e, 0xD1); // or cl, dl
+    emitRbx(e, 0x88, 1, jitReg8Offset(REG_F)); // mov [F], cl
+}
+
+// Taken/not taken paths of a jump, leaving the cycle count in esi
+static void emitJump16(JitEmitter* e, int8 condition,
+                       uint16 target, uint16 fallthrough,
+                       uint32 takenCycles, uint32 notTakenCycles) {
+    uint8* notTaken = 0;
+
+    if (condition >= 0) {
+        uint8 masks[4] = {GB_F_Z, GB_F_Z, GB_F_C, GB_F_C};
+
+        emit8(e, 0x0F);
+        emitRbx(e, 0xB6, 1, jitReg8Offset(REG_F)); // movzx ecx, byte [F]
+        emit8(e, 0xF6); emit8(e, 0xC1); emit8(e, masks[condition]); // test cl, mask
+        // NZ/NC are taken when the bit is clear
+        notTaken = emitJump(e, (condition == COND_NZ || condition == COND_NC) ? 0x85 : 0x84);
+    }
+
+    emitStorePC(e, target);
+    emit8(e, 0xBE); emit32(e, takenCycles); // mov esi, cycles
+
+    if (notTaken) {
+        uint8* done = emitJump(e, 0xE9);
+        patchJump(notTaken, e->at);
+        emitStorePC(e, fallthrough);
+        emit8(e, 0xBE); emit32(e, notTakenCycles);
+        patchJump(done, e->at);
+    }
+}
+
+enum JitNativeKind {
+    JIT_CALL_HANDLER,
+    JIT_NOP,
+    JIT_LOAD_REG_REG,
+    JIT_LOAD_REG_IMM8,
+    JIT_LOAD_REG16_IMM16,
+    JIT_INC_DEC_REG16,
+    JIT_INC_DEC_REG,
+    JIT_ALU_REG,
+    JIT_ALU_IMM8,
+    JIT_COMPLEMENT,
+    JIT_SET_FLIP_CARRY,
+    JIT_RELATIVE_JUMP,
+    JIT_JUMP,
+};
+
+// Instructions translated natively only touch registers : no memory
+// access, no interrupt or timer state
+static enum JitNativeKind getJitNativeKind(uint8 opcode) {
+    uint8 low = opcode & 0x7;
+    uint8 middle = (opcode >> 3) & 0x7;
+
+    if (opcode == 0x00) {
+        return JIT_NOP;
+    } else if (opcode >= 0x40 && opcode < 0x80) {
+        return (low != 6 && middle != 6) ? JIT_LOAD_REG_REG : JIT_CALL_HANDLER;
+    } else if (opcode >= 0x80 && opcode < 0xC0) {
+        return (low != 6) ? JIT_ALU_REG : JIT_CALL_HANDLER;
+    } else if (opcode >= 0xC0) {
+        switch (opcode) {
+        case 0xC6: case 0xCE: case 0xD6: case 0xDE:
+        case 0xE6: case 0xEE: case 0xF6: case 0xFE:
+            return JIT_ALU_IMM8;
+        case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+            return JIT_JUMP;
+        default:
+            return JIT_CALL_HANDLER;
+        }
+    } else if (opcode == 0x18 || (opcode >= 0x20 && low == 0)) {
+        return JIT_RELATIVE_JUMP;
+    } else if (low == 6) {
+        return (opcode != 0x36) ? JIT_LOAD_REG_IMM8 : JIT_CALL_HANDLER;
+    } else if ((opcode & 0xF) == 0x1) {
+        return JIT_LOAD_REG16_IMM16;
+    } else if ((opcode & 0xF) == 0x3 || (opcode & 0xF) == 0xB) {
+        return JIT_INC_DEC_REG16;
+    } else if (low == 4 || low == 5) {
+        return (middle != 6) ? JIT_INC_DEC_REG : JIT_CALL_HANDLER;
+    } else if (opcode == 0x2F) {
+        return JIT_COMPLEMENT;
+    } else if (opcode == 0x37 || opcode == 0x3F) {
+        return JIT_SET_FLIP_CARRY;
+    } else {
+        return JIT_CALL_HANDLER;
+    }
+}
+
+// Longest duration of a natively translated instruction
+static uint32 getJitMaxCycles(DecodedInstruction* instr) {
+    switch (instr->opcode) {
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        return 12;
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA:
+        return 16;
+    default:
+        return instr->cycles;
+    }
+}
+
+// Native translation of one instruction.  Unless skipPC is set, PC is
+// updated and esi holds the instruction duration.  Jumps always set PC
+// and esi.
+static void emitNativeInstruction(JitEmitter* e, DecodedInstruction* instr,
+                                  uint16 address, bool32 skipPC) {
+    uint8 opcode = instr->opcode;
+    uint16 nextPC = address + instr->length;
+    uint16 imm16 = (instr->operands[1] << 8) | instr->operands[0];
+
+    switch (getJitNativeKind(opcode)) {
+    case JIT_NOP:
+        break;
+    case JIT_LOAD_REG_REG:
+        emitRbx(e, 0x8A, 0, jitReg8Offset(opcode & 0x7)); // mov al, [src]
+        emitRbx(e, 0x88, 0, jitReg8Offset((opcode >> 3) & 0x7)); // mov [dst], al
+        break;
+    case JIT_LOAD_REG_IMM8:
+        emitRbx(e, 0xC6, 0, jitReg8Offset(opcode >> 3)); // mov byte [dst], imm8
+        emit8(e, instr->operands[0]);
+        break;
+    case JIT_LOAD_REG16_IMM16:
+        emit8(e, 0x66);
+        emitRbx(e, 0xC7, 0, jitReg16Offset(BC_DE_HL_SP[opcode >> 4])); // mov word [dst], imm16
+        emit16(e, imm16);
+        break;
+    case JIT_INC_DEC_REG16:
+        emit8(e, 0x66);
+        emitRbx(e, 0xFF, (opcode & 0x8) ? 1 : 0, jitReg16Offset(BC_DE_HL_SP[opcode >> 4]));
+        break;
+    case JIT_INC_DEC_REG:
+        emitIncDec8(e, opcode >> 3, opcode & 0x1);
+        break;
+    case JIT_ALU_REG:
+        emitAlu(e, (opcode >> 3) & 0x7, false, opcode & 0x7);
+        break;
+    case JIT_ALU_IMM8:
+        emitAlu(e, (opcode >> 3) & 0x7, true, instr->operands[0]);
+        break;
+    case JIT_COMPLEMENT:
+        emitRbx(e, 0xF6, 2, jitReg8Offset(REG_A)); // not byte [A]
+        emitRbx(e, 0x80, 1, jitReg8Offset(REG_F)); // or byte [F], N | H
+        emit8(e, GB_F_N | GB_F_H);
+        break;
+    case JIT_SET_FLIP_CARRY:
+        emitRbx(e, 0x80, 4, jitReg8Offset(REG_F)); // and byte [F], mask
+        emit8(e, opcode == 0x37 ? GB_F_Z : (GB_F_Z | GB_F_C));
+        emitRbx(e, 0x80, opcode == 0x37 ? 1 : 6, jitReg8Offset(REG_F)); // or/xor byte [F], C
+        emit8(e, GB_F_C);
+        break;
+    case JIT_RELATIVE_JUMP:
+        emitJump16(e, opcode == 0x18 ? -1 : (opcode - 0x20) >> 3,
+                   nextPC + (int8)instr->operands[0], nextPC, 12, 8);
+        return;
+    case JIT_JUMP:
+        emitJump16(e, opcode == 0xC3 ? -1 : (opcode - 0xC2) >> 3,
+                   imm16, nextPC, 16, 12);
+        return;
+    default:
+        ASSERT(!"not a native instruction");
+    }
+
+    if (!skipPC) {
+        emitStorePC(e, nextPC);
+        emit8(e, 0xBE); emit32(e, instr->cycles); // mov esi, cycles
+    }
+}
+
+// Instruction boundary : esi holds the cycles to step.  Jumps to exit
+// if the block has to stop, unless this is the end of the block.
+static void emitTick(JitEmitter* e, uint16 nextPC, bool32 last,
+                     uint8** exits, uint32* exitCount) {
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF); // mov rdi, rbx
+    emit8(e, 0xBA); emit32(e, nextPC); // mov edx, nextPC
+    emitCall(e, jitTick);
+
+    if (!last) {
+        emit8(e, 0x85); emit8(e, 0xC0); // test eax, eax
+        exits[(*exitCount)++] = emitJump(e, 0x85); // jnz exit
+    }
+}
+
+// True if a run of register-only instructions lasting up to cycles
+// can be followed by a single stepClock/handleInterrupt : no interrupt
+// is pending, no scheduler event (so no new interrupt) comes up in
+// between and the cycle budget doesn't run out in the middle.
+static bool32 jitCanBatch(GameBoy* gb, uint32 cycles) {
+    uint32 elapsed = gb->clock - gb->jit.startClock;
+    if (elapsed + cycles >= gb->jit.cycleBudget) {
+        return false;
+    }
+
+    // interrupt raised by the host (joypad, vblank) since the last
+    // instruction boundary
+    if (gb->ime && (IO(IF) & gb->ie & 0x1F)) {
+        return false;
+    }
+
+    return (int32)(gb->clock + cycles - gb->nextEventClock) < 0;
+}
+
+static void* compileBlock(DecodedBlock* block) {
+    uint32 dataSize = block->instructionCount * sizeof(DecodedInstruction);
+
+    if (!jitArena && !initializeJit()) {
+        return 0;
+    }
+
+    if (jitArenaUsed + JIT_MAX_BLOCK_SIZE + dataSize + 16 > JIT_ARENA_SIZE) {
+        // full : start over, the blocks compiled so far see a new
+        // generation and get compiled again when they are hot
+        jitArenaUsed = 0;
+        jitGeneration++;
+    }
+
+    // The decoded instructions the handlers need are copied next to
+    // the code, which then doesn't depend on the decode cache entry.
+    // Nothing runs while the pages are writable.
+    uint8* start = jitArena + jitArenaUsed;
+    uint32 maxSize = ((dataSize + 15) & ~15) + JIT_MAX_BLOCK_SIZE;
+    if (!protectJitCode(start, maxSize, PROT_READ | PROT_WRITE)) {
+        return 0;
+    }
+    DecodedInstruction* instructions = (DecodedInstruction*)start;
+    memcpy(instructions, block->instructions, dataSize);
+
+    uint8* code = start + ((dataSize + 15) & ~15);
+    JitEmitter e = {code};
+    uint8* exits[3 * DECODED_BLOCK_MAX_INSTRUCTIONS];
+    uint32 exitCount = 0;
+
+    emit8(&e, 0x53); // push rbx
+    emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xFB); // mov rbx, rdi
+
+    uint16 addresses[DECODED_BLOCK_MAX_INSTRUCTIONS + 1];
+    addresses[0] = block->pc;
+    for (uint8 i = 0; i < block->instructionCount; i++) {
+        addresses[i + 1] = addresses[i] + instructions[i].length;
+    }
+
+    uint8 i = 0;
+    while (i < block->instructionCount) {
+        // run of native instructions, a jump can only be the last one
+        uint8 runEnd = i;
+        uint32 runDuration = 0;
+        while (runEnd < block->instructionCount
+               && getJitNativeKind(instructions[runEnd].opcode) != JIT_CALL_HANDLER) {
+            runDuration += getJitMaxCycles(&instructions[runEnd]);
+            runEnd++;
+        }
+
+        if (runEnd - i >= 2) {
+            bool32 last = (runEnd == block->instructionCount);
+            DecodedInstruction* final = &instructions[runEnd - 1];
+            uint32 fixedCycles = runDuration - getJitMaxCycles(final);
+
+            emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xDF); // mov rdi, rbx
+            emit8(&e, 0xBE); emit32(&e, runDuration); // mov esi, cycles
+            emitCall(&e, jitCanBatch);
+            emit8(&e, 0x85); emit8(&e, 0xC0); // test eax, eax
+            uint8* slowPath = emitJump(&e, 0x84); // jz slowPath
+
+            // whole run, then one boundary
+            for (uint8 j = i; j < runEnd - 1; j++) {
+                emitNativeInstruction(&e, &instructions[j], addresses[j], true);
+            }
+            emitNativeInstruction(&e, final, addresses[runEnd - 1], false);
+            emit8(&e, 0x81); emit8(&e, 0xC6); emit32(&e, fixedCycles); // add esi, cycles
+            emitTick(&e, addresses[runEnd], last, exits, &exitCount);
+            uint8* done = emitJump(&e, 0xE9);
+
+            // one boundary per instruction
+            patchJump(slowPath, e.at);
+            for (uint8 j = i; j < runEnd; j++) {
+                emitNativeInstruction(&e, &instructions[j], addresses[j], false);
+                emitTick(&e, addresses[j + 1], j + 1 == block->instructionCount,
+                         exits, &exitCount);
+            }
+            patchJump(done, e.at);
+
+            i = runEnd;
+            continue;
+        }
+
+        DecodedInstruction* instr = &instructions[i];
+        if (getJitNativeKind(instr->opcode) != JIT_CALL_HANDLER) {
+            emitNativeInstruction(&e, instr, addresses[i], false);
+        } else {
+            emit8(&e, 0x48); emit8(&e, 0x89); emit8(&e, 0xDF); // mov rdi, rbx
+            emit8(&e, 0x48); emit8(&e, 0xBE); emit64(&e, (uint64)instr); // mov rsi, instr
+            emitCall(&e, jitExecuteInstruction);
+            emit8(&e, 0x0F); emit8(&e, 0xB6); emit8(&e, 0xF0); // movzx esi, al
+        }
+        emitTick(&e, addresses[i + 1], i + 1 == block->instructionCount,
+                 exits, &exitCount);
+        i++;
+    }
+
+    for (uint32 j = 0; j < exitCount; j++) {
+        patchJump(exits[j], e.at);
+    }
+    emit8(&e, 0x5B); // pop rbx
+    emit8(&e, 0xC3); // ret
+
+    ASSERT(e.at - code <= JIT_MAX_BLOCK_SIZE);
+    if (!protectJitCode(start, maxSize, PROT_READ | PROT_EXEC)) {
+        return 0;
+    }
+    jitArenaUsed = (e.at - jitArena + 15) & ~15;
+
+    block->jitGeneration = jitGeneration;
+
+    return code;
+}
+
+#ifdef GAMEBOY_JIT_CHECK
+
+// Everything an instruction can modify, compared after running each
+// block with both the interpreter and the generated code, plus the
+// cartridge RAM gb->externalRam points to
+#define JIT_CHECKED_FIELDS(X)                                           \
+    X(registers) X(ram) X(vram) X(oam) X(io) X(hram)                    \
+    X(ie) X(ime) X(joypad) X(mbc1) X(clock) X(eventClocks)              \
+    X(nextEventClock) X(scheduledEvents) X(timerClock)                  \
+    X(timerAccumulator) X(timerReads) X(scanlineClock) X(halted)        \
+    X(screen) X(frameReady) X(renderingMode) X(renderInterval)          \
+    X(framesSkipped) X(frameRequested) X(drawingFrame)                  \
+    X(callStackHeight) X(callStack)
+
+typedef struct JitCheckState {
+#define X(field) __typeof__(((GameBoy*)0)->field) field;
+    JIT_CHECKED_FIELDS(X)
+#undef X
+    uint8 externalRam[CART_MAX_RAM_SIZE];
+} JitCheckState;
+
+static JitCheckState jitCheckBefore;
+static JitCheckState jitCheckExpected;
+static JitCheckState jitCheckActual;
+
+static void saveJitCheckState(GameBoy* gb, JitCheckState* state) {
+#define X(field) memcpy(&state->field, &gb->field, sizeof(gb->field));
+    JIT_CHECKED_FIELDS(X)
+#undef X
+    memcpy(state->externalRam, gb->externalRam, gb->mbc1.ramBankCount * 0x2000);
+}
+
+static void restoreJitCheckState(GameBoy* gb, JitCheckState* state) {
+#define X(field) memcpy(&gb->field, &state->field, sizeof(gb->field));
+    JIT_CHECKED_FIELDS(X)
+#undef X
+    memcpy(gb->externalRam, state->externalRam, gb->mbc1.ramBankCount * 0x2000);
+    updateBanks(gb);
+}
+
+static void printJitCheckRegisters(const char* name, JitCheckState* state) {
+    Registers* r = &state->registers;
+    
+    fprintf(stderr, "%s : AF=%02X%02X BC=%04X DE=%04X HL=%04X SP=%04X PC=%04X clock=%u\n",
+            name, r->bytes[REG8_INDEX(REG_A)], r->bytes[REG8_INDEX(REG_F)],
+            r->pairs[REG_BC], r->pairs[REG_DE], r->pairs[REG_HL],
+            r->pairs[REG_SP], r->pairs[REG_PC], state->clock);
+}
+
+static void compareJitCheckStates(DecodedBlock* block) {
+    const char* mismatch = 0;
+
+#define X(field)                                                        \
+    if (!mismatch && memcmp(&jitCheckExpected.field, &jitCheckActual.field, \
+                            sizeof(jitCheckActual.field))) {            \
+        mismatch = #field;                                              \
+    }
+    JIT_CHECKED_FIELDS(X)
+#undef X
+    if (!mismatch && memcmp(jitCheckExpected.externalRam, jitCheckActual.externalRam,
+                            sizeof(jitCheckActual.externalRam))) {
+        mismatch = "externalRam";
+    }
+
+    if (mismatch) {
+        fprintf(stderr, "JIT mismatch in '%s' after block %02X:%04X\n",
+                mismatch, block->bank, block->pc);
+        printJitCheckRegisters("interpreter", &jitCheckExpected);
+        printJitCheckRegisters("jit        ", &jitCheckActual);
+        exit(1);
+    }
+}
+
+#endif
+
+// Runs the block with generated code if it is hot, returns false if
+// the caller has to interpret it
+static bool32 runJitBlock(GameBoy* gb, DecodedBlock* block,
+                          uint32 startClock, uint32 cycleCount) {
+    // only ROM is compiled, RAM code can be overwritten at any time
+    if (block->pc >= VRAM_START) {
+        return false;
+    }
+
+    uint8* code = block->jitCode;
+    if (!code
+        || block->jitGeneration != jitGeneration
+        || code < jitArena
+        || code >= jitArena + jitArenaUsed) {
+        if (++block->hits < JIT_HOT_THRESHOLD) {
+            return false;
+        }
+
+        code = compileBlock(block);
+        block->jitCode = code;
+        if (!code) {
+            return false;
+        }
+    }
+
+    gb->jit.startClock = startClock;
+    gb->jit.cycleBudget = cycleCount;
+    gb->jit.codePage = block->pc / MEMORY_PAGE_SIZE;
+    gb->jit.codePagePointer = gb->readPages[gb->jit.codePage];
+    materializeFlags(gb);
+
+#ifdef GAMEBOY_JIT_CHECK
+    saveJitCheckState(gb, &jitCheckBefore);
+    runDecodedBlock(gb, block, startClock, cycleCount);
+    materializeFlags(gb);
+    saveJitCheckState(gb, &jitCheckExpected);
+    restoreJitCheckState(gb, &jitCheckBefore);
+#endif
+
+    ((JitBlockFn*)code)(gb);
+
+#ifdef GAMEBOY_LAZY_FLAGS_CHECK
+    gb->lazyFlags.checked = REG8(REG_F);
+#endif
+
+#ifdef GAMEBOY_JIT_CHECK
+    saveJitCheckState(gb, &jitCheckActual);
+    compareJitCheckStates(block);
+#endif
+
+    return true;
+}
+
+#undef JIT_ARENA_SIZE
+#undef JIT_HOT_THRESHOLD
+#undef JIT_MAX_BLOCK_SIZE
+#undef GB_F_Z
+#undef GB_F_N
+#undef GB_F_H
+#undef GB_F_C
@@ -0,0 +1,489 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "linux_headless_platform.c"
+
+// Throughput benchmark : runs each ROM of a suite for a fixed number of
+// frames, several times, and writes the timings as JSON on stdout.  With
+// --opcodes, times single instructions instead, see runOpcodeBench.
+
+#define MAX_BENCH_ROMS 64
+#define MAX_BENCH_RUNS 100
+#define BENCH_PATH_SIZE 512
+
+typedef struct BenchRom {
+    char name[64];
+    char romPath[BENCH_PATH_SIZE];
+    char inputPath[BENCH_PATH_SIZE]; // empty if no input script
+    bool32 optional; // skipped if the ROM file is missing
+    Cartridge cartridge;
+} BenchRom;
+
+typedef struct BenchSample {
+    double mean;
+    double stddev;
+    double min;
+    double max;
+} BenchSample;
+
+#if defined(GAMEBOY_JIT)
+#define BENCH_BACKEND "jit"
+#elif defined(GAMEBOY_THREADED_INTERPRETER)
+#define BENCH_BACKEND "threaded"
+#else
+#define BENCH_BACKEND "handlers"
+#endif
+
+// Too big for the stack
+static GameBoy gameboy;
+static uint8 externalRam[CART_MAX_RAM_SIZE];
+static DecodedBlock decodedBlocks[DECODE_CACHE_SIZE];
+static TileCache tileCache;
+static InputScript inputScript;
+static BenchRom benchRoms[MAX_BENCH_ROMS];
+
+// Paths in the suite file are relative to the suite file
+internal void resolveSuitePath(char* result, const char* suiteFilename,
+                               const char* path) {
+    const char* slash = strrchr(suiteFilename, '/');
+
+    if (path[0] == '/' || !slash) {
+        snprintf(result, BENCH_PATH_SIZE, "%s", path);
+    } else {
+        snprintf(result, BENCH_PATH_SIZE, "%.*s/%s",
+                 (int)(slash - suiteFilename), suiteFilename, path);
+    }
+}
+
+// One ROM per line : "<name> <rom> [input script]", '#' starts a comment
+// and '?' before the name makes the ROM optional
+internal uint32 loadSuite(const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return 0;
+    }
+
+    char line[1024];
+    uint32 lineNumber = 0;
+    uint32 romCount = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+
+        char name[64];
+        char romPath[BENCH_PATH_SIZE];
+        char inputPath[BENCH_PATH_SIZE];
+        char first;
+
+        if (sscanf(line, " %c", &first) != 1 || first == '#') {
+            continue;
+        }
+
+        int fields = sscanf(line, "%63s %511s %511s", name, romPath, inputPath);
+        if (fields < 2) {
+            fprintf(stderr, "%s:%u : expected '<name> <rom> [input script]'\n",
+                    filename, lineNumber);
+            romCount = 0;
+            break;
+        }
+
+        if (romCount == MAX_BENCH_ROMS) {
+            fprintf(stderr, "%s : more than %d ROMs\n", filename, MAX_BENCH_ROMS);
+            romCount = 0;
+            break;
+        }
+
+        BenchRom* rom = &benchRoms[romCount++];
+        rom->optional = name[0] == '?';
+        snprintf(rom->name, sizeof(rom->name), "%s", name + rom->optional);
+        resolveSuitePath(rom->romPath, filename, romPath);
+        rom->inputPath[0] = 0;
+        if (fields == 3) {
+            resolveSuitePath(rom->inputPath, filename, inputPath);
+        }
+    }
+
+    fclose(file);
+    return romCount;
+}
+
+internal BenchSample computeSample(double* values, uint32 count) {
+    BenchSample sample = {0};
+    sample.min = values[0];
+    sample.max = values[0];
+
+    for (uint32 i = 0; i < count; i++) {
+        sample.mean += values[i];
+        if (values[i] < sample.min) {
+            sample.min = values[i];
+        }
+        if (values[i] > sample.max) {
+            sample.max = values[i];
+        }
+    }
+    sample.mean /= count;
+
+    if (count > 1) {
+        double squares = 0;
+        for (uint32 i = 0; i < count; i++) {
+            squares += (values[i] - sample.mean) * (values[i] - sample.mean);
+        }
+        sample.stddev = sqrt(squares / (count - 1));
+    }
+
+    return sample;
+}
+
+internal void printJsonString(const char* string) {
+    putchar('"');
+    for (const char* c = string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            printf("\\%c", *c);
+        } else if ((uint8)*c < ' ') {
+            printf("\\u%04x", *c);
+        } else {
+            putchar(*c);
+        }
+    }
+    putchar('"');
+}
+
+internal void printJsonSample(const char* key, BenchSample sample, bool32 last) {
+    printf("      \"%s\": {\"mean\": %.1f, \"stddev\": %.1f, \"min\": %.1f, \"max\": %.1f}%s\n",
+           key, sample.mean, sample.stddev, sample.min, sample.max, last ? "" : ",");
+}
+
+// The cartridge is loaded once per ROM, every run starts over from
+// zeroed memory, like the other frontends, and cleared cartridge RAM.
+// With a frame skip of 0 nothing is drawn and there is no tile cache.
+internal void startBenchRun(GameBoy* gb, const Cartridge* cartridge,
+                            uint32 renderInterval) {
+    memset(gb, 0, sizeof(*gb));
+    initializeGameboy(gb, decodedBlocks, renderInterval ? &tileCache : 0);
+    memset(externalRam, 0, getExternalRamSize(cartridge));
+    insertCartridge(gb, cartridge, externalRam);
+    setFrameSkip(gb, renderInterval);
+    inputScript.nextEvent = 0;
+}
+
+// Loads every ROM and checks its input script before anything is
+// written to stdout, so that a bad suite leaves no partial JSON.  The
+// optional ROMs that are missing are dropped.  Returns the ROMs left, 0
+// on error.
+internal uint32 loadBenchRoms(uint32 romCount) {
+    uint32 loadedCount = 0;
+
+    for (uint32 romIndex = 0; romIndex < romCount; romIndex++) {
+        BenchRom* rom = &benchRoms[romIndex];
+
+        if (rom->optional && access(rom->romPath, F_OK)) {
+            fprintf(stderr, "%s : skipped, no %s\n", rom->name, rom->romPath);
+            continue;
+        }
+
+        if (!loadRom(&rom->cartridge, rom->romPath)) {
+            fprintf(stderr, "Failed to load ROM %s\n", rom->romPath);
+            return 0;
+        }
+
+        inputScript.eventCount = 0;
+        if (rom->inputPath[0] && !loadInputScript(&inputScript, rom->inputPath)) {
+            return 0;
+        }
+
+        benchRoms[loadedCount++] = *rom;
+    }
+
+    if (!loadedCount) {
+        fprintf(stderr, "No ROM to run\n");
+    }
+
+    return loadedCount;
+}
+
+// Untimed pass with executeCycle, one instruction at a time, to count
+// the instructions the timed runs emulate : the fast paths skip idle
+// loops and run whole blocks, they don't count instructions.  HALT is
+// stepped 4 cycles at a time here, so the frames can end a few cycles
+// away from the timed runs'.
+internal uint64 countInstructions(GameBoy* gb, uint32 frameCount) {
+    uint64 instructions = 0;
+
+    for (uint32 frame = 0; frame < frameCount; frame++) {
+        applyInputScript(gb, &inputScript, frame);
+
+        while (!gb->frameReady) {
+            if (!gb->halted) {
+                instructions++;
+            }
+            executeCycle(gb);
+        }
+        gb->frameReady = false;
+        triggerInterrupt(gb, INT_VBLANK);
+    }
+
+    return instructions;
+}
+
+// A few common handlers : register moves, ALU, (HL), CB and the stack
+typedef struct BenchOpcode {
+    const char* name;
+    uint8 bytes[3];
+} BenchOpcode;
+
+static const BenchOpcode benchOpcodes[] = {
+    {"ld b,c", {0x41}},
+    {"ld a,e", {0x7B}},
+    {"ld b,n", {0x06, 0x12}},
+    {"ld b,(hl)", {0x46}},
+    {"add a,b", {0x80}},
+    {"xor b", {0xA8}},
+    {"cp c", {0xB9}},
+    {"inc b", {0x04}},
+    {"dec e", {0x1D}},
+    {"rl c", {0xCB, 0x11}},
+    {"bit 7,d", {0xCB, 0x7A}},
+    {"push bc", {0xC5}},
+    {"jp nn", {0xC3, 0x00, 0xC0}},
+};
+
+// Runs each instruction of benchOpcodes executionCount times in a row
+// through executeInstruction, from WRAM with no cartridge : decoding and
+// dispatch included, no clock, events or interrupts.  PC, SP and HL are
+// put back before every execution.
+internal void runOpcodeBench(GameBoy* gb, uint32 executionCount,
+                              uint32 runCount, uint32 warmupCount) {
+    uint32 opcodeCount = sizeof(benchOpcodes) / sizeof(benchOpcodes[0]);
+
+    printf("  \"opcodes\": [\n");
+
+    for (uint32 index = 0; index < opcodeCount; index++) {
+        const BenchOpcode* opcode = &benchOpcodes[index];
+        double instructionNanoseconds[MAX_BENCH_RUNS];
+
+        memset(gb, 0, sizeof(*gb));
+        initializeGameboy(gb, 0, 0);
+        memcpy(gb->ram, opcode->bytes, sizeof(opcode->bytes));
+
+        for (uint32 run = 0; run < warmupCount + runCount; run++) {
+            uint64 startTime = getNanoseconds();
+            for (uint32 i = 0; i < executionCount; i++) {
+                REG(PC) = INTERNAL_RAM_START;
+                REG(SP) = INTERNAL_RAM_START + 0x1FF0;
+                REG(HL) = INTERNAL_RAM_START + 0x100;
+                executeInstruction(gb);
+            }
+            uint64 elapsed = getNanoseconds() - startTime;
+
+            if (run >= warmupCount) {
+                instructionNanoseconds[run - warmupCount] = (double)elapsed / executionCount;
+            }
+        }
+
+        BenchSample sample = computeSample(instructionNanoseconds, runCount);
+        printf("    {\"name\": ");
+        printJsonString(opcode->name);
+        printf(", \"ns_per_instruction\": "
+               "{\"mean\": %.2f, \"stddev\": %.2f, \"min\": %.2f, \"max\": %.2f}}%s\n",
+               sample.mean, sample.stddev, sample.min, sample.max,
+               index + 1 < opcodeCount ? "," : "");
+    }
+
+    printf("  ]\n");
+}
+
+internal void printUsage() {
+    fprintf(stderr,
+            "Usage : ./gb-bench [options] [rom...]\n"
+            "Runs the ROMs given, or else the ones of the suite file.\n"
+            "Options:\n"
+            " --suite FILE      '<name> <rom> [input script]' lines (default bench/suite.txt)\n"
+            " --frames N        frames per run (default 600)\n"
+            " --runs N          timed runs per ROM (default 5)\n"
+            " --warmup N        untimed runs per ROM first (default 1)\n"
+            " --frame-skip N    render one frame in N (0 : render none)\n"
+            " --opcodes N       time single instructions, N executions per run, no ROMs\n");
+}
+
+int main(int argc, char** argv) {
+    const char* suiteFilename = "bench/suite.txt";
+    uint32 frameCount = 600;
+    uint32 runCount = 5;
+    uint32 warmupCount = 1;
+    uint32 renderInterval = 1;
+    uint32 romCount = 0;
+    uint32 opcodeExecutions = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : 0;
+
+        if (arg[0] != '-') {
+            if (romCount == MAX_BENCH_ROMS) {
+                fprintf(stderr, "More than %d ROMs\n", MAX_BENCH_ROMS);
+                return 1;
+            }
+
+            BenchRom* rom = &benchRoms[romCount++];
+            const char* slash = strrchr(arg, '/');
+            snprintf(rom->name, sizeof(rom->name), "%s", slash ? slash + 1 : arg);
+            snprintf(rom->romPath, sizeof(rom->romPath), "%s", arg);
+            rom->inputPath[0] = 0;
+            rom->optional = false;
+        } else if (!value) {
+            printUsage();
+            return 1;
+        } else {
+            i++;
+            if (!strcmp(arg, "--suite")) {
+                suiteFilename = value;
+            } else if (!strcmp(arg, "--frames")) {
+                frameCount = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--runs")) {
+                runCount = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--warmup")) {
+                warmupCount = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--frame-skip")) {
+                renderInterval = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--opcodes")) {
+                opcodeExecutions = strtoul(value, 0, 10);
+            } else {
+                printUsage();
+                return 1;
+            }
+        }
+    }
+
+    if (!frameCount || !runCount || runCount > MAX_BENCH_RUNS) {
+        fprintf(stderr, "Need at least one frame and 1 to %d runs\n", MAX_BENCH_RUNS);
+        return 1;
+    }
+
+    initializeHeadlessPlatform();
+    GameBoy* gb = &gameboy;
+
+    if (opcodeExecutions) {
+        printf("{\n");
+        printf("  \"backend\": \"%s\",\n", BENCH_BACKEND);
+        printf("  \"executions\": %u,\n", opcodeExecutions);
+        printf("  \"runs\": %u,\n", runCount);
+        printf("  \"warmup\": %u,\n", warmupCount);
+        runOpcodeBench(gb, opcodeExecutions, runCount, warmupCount);
+        printf("}\n");
+        return 0;
+    }
+
+    if (!romCount) {
+        romCount = loadSuite(suiteFilename);
+        if (!romCount) {
+            printUsage();
+            return 1;
+        }
+    }
+
+    romCount = loadBenchRoms(romCount);
+    if (!romCount) {
+        return 1;
+    }
+
+    printf("{\n");
+    printf("  \"backend\": \"%s\",\n", BENCH_BACKEND);
+    printf("  \"frames\": %u,\n", frameCount);
+    printf("  \"runs\": %u,\n", runCount);
+    printf("  \"warmup\": %u,\n", warmupCount);
+    printf("  \"frame_skip\": %u,\n", renderInterval);
+    printf("  \"roms\": [\n");
+
+    for (uint32 romIndex = 0; romIndex < romCount; romIndex++) {
+        BenchRom* rom = &benchRoms[romIndex];
+
+        inputScript.eventCount = 0;
+        if (rom->inputPath[0] && !loadInputScript(&inputScript, rom->inputPath)) {
+            return 1;
+        }
+
+        fprintf(stderr, "%s : counting instructions\n", rom->name);
+        startBenchRun(gb, &rom->cartridge, renderInterval);
+        uint64 instructions = countInstructions(gb, frameCount);
+        uint64 cycles = 0;
+
+        double frameNanoseconds[MAX_BENCH_RUNS];
+        double framesPerSecond[MAX_BENCH_RUNS];
+        double cyclesPerSecond[MAX_BENCH_RUNS];
+        double instructionsPerSecond[MAX_BENCH_RUNS];
+
+        for (uint32 run = 0; run < warmupCount + runCount; run++) {
+            bool32 warmup = run < warmupCount;
+            fprintf(stderr, "%s : %s %u\n", rom->name, warmup ? "warmup" : "run",
+                    warmup ? run + 1 : run - warmupCount + 1);
+
+            startBenchRun(gb, &rom->cartridge, renderInterval);
+
+            uint64 cyclesRun = 0;
+            uint64 startTime = getNanoseconds();
+            for (uint32 frame = 0; frame < frameCount; frame++) {
+                cyclesRun += runHeadlessFrame(gb, &inputScript, frame);
+            }
+            uint64 elapsed = getNanoseconds() - startTime;
+            if (!elapsed) {
+                elapsed = 1;
+            }
+
+            // every run starts from the same state with the same input
+            if (cycles && cyclesRun != cycles) {
+                fprintf(stderr, "%s : ran %llu cycles instead of %llu\n",
+                        rom->name, (unsigned long long)cyclesRun,
+                        (unsigned long long)cycles);
+                return 1;
+            }
+            cycles = cyclesRun;
+
+            if (!warmup) {
+                double seconds = elapsed / 1e9;
+                uint32 index = run - warmupCount;
+                frameNanoseconds[index] = (double)elapsed / frameCount;
+                framesPerSecond[index] = frameCount / seconds;
+                cyclesPerSecond[index] = cycles / seconds;
+                instructionsPerSecond[index] = instructions / seconds;
+            }
+        }
+
+        BenchSample frameTime = computeSample(frameNanoseconds, runCount);
+        double emulatedSeconds = (double)cycles / GAMEBOY_CPU_FREQUENCY;
+        double hostSeconds = frameTime.mean * frameCount / 1e9;
+
+        printf("    {\n");
+        printf("      \"name\": ");
+        printJsonString(rom->name);
+        printf(",\n      \"rom\": ");
+        printJsonString(rom->romPath);
+        printf(",\n      \"input\": ");
+        if (rom->inputPath[0]) {
+            printJsonString(rom->inputPath);
+        } else {
+            printf("null");
+        }
+        printf(",\n");
+        printf("      \"cycles\": %llu,\n", (unsigned long long)cycles);
+        printf("      \"instructions\": %llu,\n", (unsigned long long)instructions);
+        printf("      \"realtime_factor\": %.2f,\n", emulatedSeconds / hostSeconds);
+        printf("      \"mips\": %.2f,\n",
+               computeSample(instructionsPerSecond, runCount).mean / 1e6);
+        printJsonSample("ns_per_frame", frameTime, false);
+        printJsonSample("frames_per_second",
+                        computeSample(framesPerSecond, runCount), false);
+        printJsonSample("cycles_per_second",
+                        computeSample(cyclesPerSecond, runCount), false);
+        printJsonSample("instructions_per_second",
+                        computeSample(instructionsPerSecond, runCount), true);
+        printf("    }%s\n", romIndex + 1 < romCount ? "," : "");
+    }
+
+    printf("  ]\n");
+    printf("}\n");
+
+    return 0;
+}
@@ -64,8 +64,15 @@ internal bool32 readFileIntoMemory_(const char* filepath, void* buffer, uint64 s
         return false;
     }
 
-    if (read(fd, buffer, size) < 0) {
-        return false;
+    // read can return less than asked
+    uint64 done = 0;
+    while (done < size) {
+        ssize_t count = read(fd, (uint8*)buffer + done, size - done);
+        if (count <= 0) {
+            close(fd);
+            return false;
+        }
+        done += count;
     }
 
     close(fd);
@@ -73,6 +80,32 @@ internal bool32 readFileIntoMemory_(const char* filepath, void* buffer, uint64 s
     return true;
 }
 
+internal void* mapFile_(const char* filepath, uint64* size) {
+    int fd = open(filepath, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) < 0 || !file_stat.st_size) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    void* data = mmap(0, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+
+    madvise(data, file_stat.st_size, MADV_WILLNEED);
+
+    *size = file_stat.st_size;
+    return data;
+}
+
+internal void unmapFile_(void* data, uint64 size) {
+    munmap(data, size);
+}
+
 internal void outputBufferInConsole_(uint8* buffer, uint64 size) {
     write(STDOUT_FILENO, buffer, size);
 }
@@ -335,6 +368,8 @@ internal void initializeProgramMemory(ProgramMemory* memory) {
 
     memory->platform.readFileIntoMemory = &readFileIntoMemory_;
     memory->platform.getFileSize = &getFileSize_;
+    memory->platform.mapFile = &mapFile_;
+    memory->platform.unmapFile = &unmapFile_;
     memory->platform.getMicroseconds = &getMicroseconds_;
     memory->platform.outputBufferInConsole = &outputBufferInConsole_;
     memory->platform.resetProgramMemory = &resetProgramMemory_;
@@ -0,0 +1,733 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linux_headless_platform.c"
+
+// Runs a ROM as fast as possible for a fixed number of frames or cycles,
+// for regression runs and quick measurements.
+
+internal bool32 writeScreenshot(GameBoy* gb, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    fprintf(file, "P5\n%d %d\n255\n", GAMEBOY_SCREEN_WIDTH, GAMEBOY_SCREEN_HEIGHT);
+    fwrite(gb->screen, 1, sizeof(gb->screen), file);
+    fclose(file);
+
+    return true;
+}
+
+// Golden frames : one "<frame> <hash>" line per frame, the FNV-1a
+// hash of the screen at the end of the frame.  --frame-hashes writes
+// them, --check-frames compares every frame with such a file.
+typedef struct FrameHashes {
+    const char* filename;
+    FILE* file;
+    bool32 checking;
+    bool32 ended; // checking past the last line of the file
+    uint32 checked;
+} FrameHashes;
+
+internal uint64 hashScreen(GameBoy* gb) {
+    uint8* bytes = &gb->screen[0][0];
+    uint64 hash = 0xCBF29CE484222325ull;
+
+    for (uint32 i = 0; i < sizeof(gb->screen); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+
+    return hash;
+}
+
+internal bool32 openFrameHashes(FrameHashes* hashes, const char* filename, bool32 checking) {
+    hashes->filename = filename;
+    hashes->file = fopen(filename, checking ? "r" : "w");
+    hashes->checking = checking;
+    hashes->ended = false;
+    hashes->checked = 0;
+
+    if (!hashes->file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+// Writes or checks the hash of the frame that just ended, false if it
+// differs from the file
+internal bool32 processFrameHash(FrameHashes* hashes, GameBoy* gb, uint32 frame) {
+    uint64 hash = hashScreen(gb);
+
+    if (!hashes->checking) {
+        fprintf(hashes->file, "%u %016llx\n", frame, (unsigned long long)hash);
+        return true;
+    }
+
+    char line[64];
+    if (hashes->ended || !fgets(line, sizeof(line), hashes->file)) {
+        hashes->ended = true;
+        return true;
+    }
+
+    unsigned int expectedFrame;
+    unsigned long long expectedHash;
+    if (sscanf(line, "%u %llx", &expectedFrame, &expectedHash) != 2
+        || expectedFrame != frame) {
+        printf("%s : expected the line of frame %u, got '%s'\n",
+               hashes->filename, frame, line);
+        return false;
+    }
+
+    if (hash != expectedHash) {
+        printf("Frame %u differs from %s : screen hash %016llx, expected %016llx\n",
+               frame, hashes->filename, (unsigned long long)hash, expectedHash);
+        return false;
+    }
+
+    hashes->checked++;
+    return true;
+}
+
+// Comparison against a reference log (gameboy-doctor or
+// printGameboyLogLine lines) : the instructions are traced into a ring
+// buffer, and the records are checked against the next lines of the log
+// after each runCycles call.  The ring buffer holds more than a frame
+// of instructions, the rest of it is the context shown at a difference.
+#define COMPARE_TRACE_CAPACITY (1 << 16)
+#define COMPARE_MAX_CONTEXT 4096
+#define COMPARE_DEFAULT_CONTEXT 16
+#define COMPARE_LINE_SIZE 256
+
+enum CompareResult {
+    COMPARE_MATCHING,
+    COMPARE_DIVERGED,
+    COMPARE_END_OF_LOG,
+    COMPARE_ERROR,
+};
+
+typedef struct LogComparison {
+    const char* filename;
+    FILE* log;
+    bool32 piped; // from a decompressor, close with pclose
+    uint64 lineNumber;
+    uint64 compared; // trace records checked
+    uint32 context;
+} LogComparison;
+
+internal bool32 openReferenceLog(LogComparison* comparison, const char* filename) {
+    static const struct {
+        const char* extension;
+        const char* command;
+    } decompressors[] = {
+        {".gz", "gzip -dc"},
+        {".zst", "zstd -dc"},
+        {".xz", "xz -dc"},
+        {".bz2", "bzip2 -dc"},
+    };
+
+    comparison->filename = filename;
+    comparison->piped = false;
+
+    const char* extension = strrchr(filename, '.');
+    for (uint32 i = 0; extension && i < ARRAY_COUNT(decompressors); i++) {
+        if (strcmp(extension, decompressors[i].extension)) {
+            continue;
+        }
+
+        char command[1024];
+        if (strchr(filename, '\'')
+            || snprintf(command, sizeof(command), "%s -- '%s'",
+                        decompressors[i].command, filename) >= (int)sizeof(command)) {
+            fprintf(stderr, "Can't pass %s to %s\n", filename, decompressors[i].command);
+            return false;
+        }
+
+        comparison->log = popen(command, "r");
+        comparison->piped = true;
+        break;
+    }
+
+    if (!comparison->piped) {
+        comparison->log = fopen(filename, "r");
+    }
+
+    if (!comparison->log) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    return true;
+}
+
+// Returns false if the decompressor failed
+internal bool32 closeReferenceLog(LogComparison* comparison) {
+    bool32 success = true;
+
+    if (comparison->piped) {
+        success = pclose(comparison->log) == 0;
+    } else {
+        fclose(comparison->log);
+    }
+    comparison->log = 0;
+
+    return success;
+}
+
+internal void printDivergence(LogComparison* comparison, TraceBuffer* buffer,
+                              const char* line, TraceRecord* expected) {
+    uint64 first = comparison->compared;
+    uint64 oldest = buffer->written - getTraceRecordCount(buffer);
+    for (uint32 i = 0; i < comparison->context && first > oldest; i++) {
+        first--;
+    }
+
+    printf("Difference at instruction %llu, %s:%llu\n",
+           (unsigned long long)comparison->compared, comparison->filename,
+           (unsigned long long)comparison->lineNumber);
+
+    for (uint64 i = first; i < comparison->compared; i++) {
+        TraceRecord* record = &buffer->records[i % buffer->capacity];
+        printf("  ");
+        printTraceLogLine(stdout, record);
+        printf("    %02X:%04x ", record->bank, record->pc);
+        disassembleInstruction(stdout, record->bytes);
+        printf("\n");
+    }
+
+    TraceRecord* actual = &buffer->records[comparison->compared % buffer->capacity];
+    printf("expected  %s", line);
+    printf("emulator  ");
+    printTraceLogLine(stdout, actual);
+    printf("    %02X:%04x ", actual->bank, actual->pc);
+    disassembleInstruction(stdout, actual->bytes);
+    printf("\ndiffers   ");
+    printTraceDifferences(stdout, expected, actual);
+    printf("\n");
+}
+
+// Checks the records traced since the last call against the next lines
+// of the log
+internal enum CompareResult compareWithReferenceLog(LogComparison* comparison,
+                                                    TraceBuffer* buffer) {
+    if (buffer->written - comparison->compared > buffer->capacity) {
+        fprintf(stderr, "More than %u instructions in one runCycles call\n",
+                buffer->capacity);
+        return COMPARE_ERROR;
+    }
+
+    char line[COMPARE_LINE_SIZE];
+
+    while (comparison->compared < buffer->written) {
+        TraceRecord* actual = &buffer->records[comparison->compared % buffer->capacity];
+        TraceRecord expected;
+
+        do {
+            if (!fgets(line, sizeof(line), comparison->log)) {
+                return COMPARE_END_OF_LOG;
+            }
+            comparison->lineNumber++;
+        } while (line[0] == '\n');
+
+        if (!parseTraceLogLine(line, &expected)) {
+            fprintf(stderr, "%s:%llu : not a log line\n", comparison->filename,
+                    (unsigned long long)comparison->lineNumber);
+            return COMPARE_ERROR;
+        }
+
+        if (printTraceDifferences(0, &expected, actual)) {
+            printDivergence(comparison, buffer, line, &expected);
+            return COMPARE_DIVERGED;
+        }
+
+        comparison->compared++;
+    }
+
+    return COMPARE_MATCHING;
+}
+
+// Save state round trips (--check-states) : each runCycles call runs
+// twice from the same state, which must give the same state both times
+#define STATE_BUFFER_SIZE (256 * 1024) // more than getSaveStateSize
+
+typedef struct StateCheck {
+    uint64 states[3][STATE_BUFFER_SIZE / sizeof(uint64)]; // before, after, after again
+    uint64 stateSize;
+    uint64 roundTrips;
+    uint64 saveNanoseconds;
+    uint64 loadNanoseconds;
+} StateCheck;
+
+internal void printStateDifferences(SaveStateHeader* expected, SaveStateHeader* actual) {
+    for (uint32 i = 0; i < expected->sectionCount; i++) {
+        SaveStateSection* section = &expected->sections[i];
+        if (memcmp((uint8*)expected + section->offset,
+                   (uint8*)actual + section->offset, section->size)) {
+            printf(" %s", getSaveStateSectionName(section->id));
+        }
+    }
+    printf("\n");
+}
+
+// Returns false if the two runs diverged
+internal bool32 runCyclesTwice(GameBoy* gb, StateCheck* check, uint32 cycleCount) {
+    uint32 startClock = gb->clock;
+
+    uint64 startTime = getNanoseconds();
+    writeSaveState(gb, check->states[0], sizeof(check->states[0]));
+    uint64 saveEnd = getNanoseconds();
+
+    runCycles(gb, cycleCount);
+    writeSaveState(gb, check->states[1], sizeof(check->states[1]));
+
+    uint64 loadStart = getNanoseconds();
+    if (!readSaveState(gb, check->states[0], check->stateSize)) {
+        return false;
+    }
+    uint64 loadEnd = getNanoseconds();
+
+    runCycles(gb, cycleCount);
+    writeSaveState(gb, check->states[2], sizeof(check->states[2]));
+
+    check->roundTrips++;
+    check->saveNanoseconds += saveEnd - startTime;
+    check->loadNanoseconds += loadEnd - loadStart;
+
+    if (memcmp(check->states[1], check->states[2], check->stateSize)) {
+        printf("Different state after running again from clock %u, in :", startClock);
+        printStateDifferences((SaveStateHeader*)check->states[1],
+                              (SaveStateHeader*)check->states[2]);
+        return false;
+    }
+
+    return true;
+}
+
+internal void printUsage() {
+    fprintf(stderr,
+            "Usage : ./gameboy-headless <rom> [options]\n"
+            "Options:\n"
+            " --frames N        run N frames (default 600)\n"
+            " --cycles N        run N cycles instead\n"
+            " --input FILE      apply the '<frame> <button> press|release' lines of FILE\n"
+            " --frame-skip N    render one frame in N (0 : render none)\n"
+            " --screenshot FILE write the last rendered frame as a PGM image\n"
+            " --frame-hashes FILE  write a hash of the screen at the end of every frame\n"
+            " --check-frames FILE  compare every frame with a --frame-hashes file and\n"
+            "                   stop at the first difference (--screenshot shows it)\n"
+            " --stats           print the emulator statistics at exit\n"
+            " --profile PREFIX  sample the guest PC, write PREFIX.txt and PREFIX.folded\n"
+            " --profile-interval N  cycles between samples (default %d)\n"
+            " --symbols FILE    RGBDS symbols for the profile (default : the ROM's .sym)\n"
+            " --trace FILE      record every instruction into FILE, read it with gb-trace\n"
+            " --trace-records N size of the trace ring buffer (default %d)\n"
+            " --compare LOG     check every instruction against a reference log\n"
+            "                   (.gz, .zst, .xz and .bz2 go through the decompressor)\n"
+            "                   and stop at the first difference\n"
+            " --context N       instructions shown before the difference (default %d)\n"
+            " --load-state FILE start from a save state of the ROM\n"
+            " --save-state FILE write a save state at exit\n"
+            " --check-states    run everything twice from a save state and compare\n"
+            " --rewind MB       record every frame in a rewind buffer of MB megabytes\n"
+            " --run-ahead N     emulate N frames ahead of every frame shown (up to %d)\n",
+            PROFILE_DEFAULT_INTERVAL, TRACE_DEFAULT_CAPACITY, COMPARE_DEFAULT_CONTEXT,
+            RUN_AHEAD_MAX_FRAMES);
+}
+
+internal bool32 writeProfileFiles(GuestProfile* profile, const char* prefix) {
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s.txt", prefix);
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+    writeProfileHistogram(file, profile);
+    fclose(file);
+
+    snprintf(filename, sizeof(filename), "%s.folded", prefix);
+    file = fopen(filename, "w");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+    writeFoldedStacks(file, profile);
+    fclose(file);
+
+    return true;
+}
+
+// Too big for the stack
+static GameBoy gameboy;
+static Cartridge cartridge;
+static InputScript inputScript;
+static GuestProfile guestProfile;
+static LogComparison logComparison;
+static FrameHashes frameHashes;
+static StateCheck stateCheck;
+static RewindBuffer rewindBuffer;
+static RunAhead runAhead;
+static uint64 runAheadState[STATE_BUFFER_SIZE / sizeof(uint64)];
+static uint64 compareTraceStorage[TRACE_BUFFER_SIZE(COMPARE_TRACE_CAPACITY) / sizeof(uint64) + 1];
+
+int main(int argc, char** argv) {
+    const char* romFilename = 0;
+    const char* inputFilename = 0;
+    const char* screenshotFilename = 0;
+    const char* frameHashesFilename = 0;
+    bool32 checkFrames = false;
+    uint64 frameCount = 600;
+    uint64 cycleCount = 0;
+    uint32 renderInterval = 1;
+    bool32 printStats = false;
+    const char* profilePrefix = 0;
+    const char* symbolsFilename = 0;
+    uint32 sampleInterval = PROFILE_DEFAULT_INTERVAL;
+    const char* traceFilename = 0;
+    uint32 traceCapacity = TRACE_DEFAULT_CAPACITY;
+    const char* compareFilename = 0;
+    uint32 compareContext = COMPARE_DEFAULT_CONTEXT;
+    const char* loadStateFilename = 0;
+    const char* saveStateFilename = 0;
+    bool32 checkStates = false;
+    uint64 rewindBudget = 0;
+    int32 runAheadFrames = -1;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : 0;
+
+        if (!strcmp(arg, "--stats")) {
+            printStats = true;
+        } else if (!strcmp(arg, "--check-states")) {
+            checkStates = true;
+        } else if (arg[0] != '-') {
+            romFilename = arg;
+        } else if (!value) {
+            printUsage();
+            return 1;
+        } else {
+            i++;
+            if (!strcmp(arg, "--frames")) {
+                frameCount = strtoull(value, 0, 10);
+                cycleCount = 0;
+            } else if (!strcmp(arg, "--cycles")) {
+                cycleCount = strtoull(value, 0, 10);
+            } else if (!strcmp(arg, "--input")) {
+                inputFilename = value;
+            } else if (!strcmp(arg, "--frame-skip")) {
+                renderInterval = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--screenshot")) {
+                screenshotFilename = value;
+            } else if (!strcmp(arg, "--frame-hashes")) {
+                frameHashesFilename = value;
+                checkFrames = false;
+            } else if (!strcmp(arg, "--check-frames")) {
+                frameHashesFilename = value;
+                checkFrames = true;
+            } else if (!strcmp(arg, "--profile")) {
+                profilePrefix = value;
+            } else if (!strcmp(arg, "--profile-interval")) {
+                sampleInterval = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--symbols")) {
+                symbolsFilename = value;
+            } else if (!strcmp(arg, "--trace")) {
+                traceFilename = value;
+            } else if (!strcmp(arg, "--trace-records")) {
+                traceCapacity = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--compare")) {
+                compareFilename = value;
+            } else if (!strcmp(arg, "--context")) {
+                compareContext = strtoul(value, 0, 10);
+            } else if (!strcmp(arg, "--load-state")) {
+                loadStateFilename = value;
+            } else if (!strcmp(arg, "--save-state")) {
+                saveStateFilename = value;
+            } else if (!strcmp(arg, "--rewind")) {
+                rewindBudget = strtoull(value, 0, 10) * 1024 * 1024;
+            } else if (!strcmp(arg, "--run-ahead")) {
+                runAheadFrames = strtoul(value, 0, 10);
+            } else {
+                printUsage();
+                return 1;
+            }
+        }
+    }
+
+    if (!romFilename || !sampleInterval || !traceCapacity) {
+        printUsage();
+        return 1;
+    }
+
+    if (compareFilename && traceFilename) {
+        fprintf(stderr, "--compare traces into its own buffer, it can't be used with --trace\n");
+        return 1;
+    }
+
+    if (checkStates && (compareFilename || traceFilename)) {
+        fprintf(stderr, "--check-states runs every instruction twice, it can't be traced\n");
+        return 1;
+    }
+
+    if (runAheadFrames >= 0
+        && (runAheadFrames > RUN_AHEAD_MAX_FRAMES || cycleCount || checkStates
+            || compareFilename || traceFilename)) {
+        fprintf(stderr, "--run-ahead runs whole frames, up to %d ahead, and can't be"
+                " traced or checked\n", RUN_AHEAD_MAX_FRAMES);
+        return 1;
+    }
+
+    if (compareContext > COMPARE_MAX_CONTEXT) {
+        compareContext = COMPARE_MAX_CONTEXT;
+    }
+
+    initializeHeadlessPlatform();
+
+    if (inputFilename && !loadInputScript(&inputScript, inputFilename)) {
+        return 1;
+    }
+
+    GameBoy* gb = &gameboy;
+    initializeGameboy(gb, allocateMemory(DECODE_CACHE_SIZE * sizeof(DecodedBlock)),
+                      allocateMemory(sizeof(TileCache)));
+#ifdef GAMEBOY_OPCODE_PROFILE
+    setOpcodeProfile(gb, allocateMemory(sizeof(OpcodeProfile)));
+#endif
+
+    if (!loadRom(&cartridge, romFilename)) {
+        fprintf(stderr, "Failed to load ROM\n");
+        return 1;
+    }
+    if (!insertNewCartridge(gb, &cartridge)) {
+        return 1;
+    }
+
+    setFrameSkip(gb, renderInterval);
+
+    if (getSaveStateSize(gb) > STATE_BUFFER_SIZE) {
+        fprintf(stderr, "Save states of %llu bytes, more than %d\n",
+                (unsigned long long)getSaveStateSize(gb), STATE_BUFFER_SIZE);
+        return 1;
+    }
+    stateCheck.stateSize = getSaveStateSize(gb);
+
+    if (runAheadFrames >= 0) {
+        initializeRunAhead(&runAhead, runAheadState, getSaveStateSize(gb));
+        setRunAheadFrames(gb, &runAhead, runAheadFrames);
+    }
+
+    if (rewindBudget) {
+        void* memory = mmap(0, rewindBudget, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED
+            || !initializeRewindBuffer(&rewindBuffer, getSaveStateSize(gb),
+                                       memory, rewindBudget)) {
+            fprintf(stderr, "No rewind buffer of %llu MB\n",
+                    (unsigned long long)(rewindBudget / (1024 * 1024)));
+            return 1;
+        }
+    }
+
+    if (loadStateFilename) {
+        uint64 stateSize;
+        void* state = platform.mapFile(loadStateFilename, &stateSize);
+        if (!state) {
+            fprintf(stderr, "Could not open %s\n", loadStateFilename);
+            return 1;
+        }
+
+        bool32 loaded = readSaveState(gb, state, stateSize);
+        platform.unmapFile(state, stateSize);
+        if (!loaded) {
+            return 1;
+        }
+    }
+
+    if (profilePrefix) {
+        if (symbolsFilename) {
+            if (!loadProfileSymbols(&guestProfile, symbolsFilename)) {
+                fprintf(stderr, "Could not open %s\n", symbolsFilename);
+                return 1;
+            }
+        } else {
+            loadRomSymbols(&guestProfile, romFilename);
+        }
+        startGuestProfile(gb, &guestProfile, sampleInterval);
+    }
+
+    TraceBuffer* traceBuffer = 0;
+    if (traceFilename) {
+        traceBuffer = mapTraceFile(traceFilename, traceCapacity);
+        if (!traceBuffer) {
+            fprintf(stderr, "Could not map %s\n", traceFilename);
+            return 1;
+        }
+        startTrace(gb, traceBuffer, ~0);
+    }
+
+    LogComparison* comparison = 0;
+    if (compareFilename) {
+        comparison = &logComparison;
+        comparison->context = compareContext;
+        if (!openReferenceLog(comparison, compareFilename)) {
+            return 1;
+        }
+
+        traceBuffer = (TraceBuffer*)compareTraceStorage;
+        initializeTraceBuffer(traceBuffer, COMPARE_TRACE_CAPACITY);
+        startTrace(gb, traceBuffer, ~0);
+    }
+    enum CompareResult compareResult = COMPARE_MATCHING;
+
+    if (frameHashesFilename
+        && !openFrameHashes(&frameHashes, frameHashesFilename, checkFrames)) {
+        return 1;
+    }
+    bool32 framesMatch = true;
+
+    // runHeadlessFrame with a cycle budget
+    uint64 startTime = platform.getMicroseconds();
+    uint64 cyclesRun = 0;
+    uint32 frame = 0;
+
+    while ((cycleCount ? cyclesRun < cycleCount : frame < frameCount)
+           && compareResult == COMPARE_MATCHING && framesMatch) {
+        applyInputScript(gb, &inputScript, frame);
+
+        if (runAheadFrames >= 0) {
+            uint32 startClock = gb->clock;
+            runFrameAhead(gb, &runAhead);
+            cyclesRun += (uint32)(gb->clock - startClock);
+            gb->frameReady = true; // the end of the frame as usual below
+        }
+
+        while (!gb->frameReady && (!cycleCount || cyclesRun < cycleCount)) {
+            uint64 budget = GAMEBOY_CYCLES_PER_FRAME;
+            if (cycleCount && cycleCount - cyclesRun < budget) {
+                budget = cycleCount - cyclesRun;
+            }
+            uint32 startClock = gb->clock;
+            if (checkStates) {
+                if (!runCyclesTwice(gb, &stateCheck, budget)) {
+                    return 1;
+                }
+            } else {
+                runCycles(gb, budget);
+            }
+            cyclesRun += (uint32)(gb->clock - startClock);
+
+            if (comparison) {
+                compareResult = compareWithReferenceLog(comparison, traceBuffer);
+                if (compareResult != COMPARE_MATCHING) {
+                    break;
+                }
+            }
+        }
+
+        if (gb->frameReady) {
+            gb->frameReady = false;
+            if (frameHashesFilename && !processFrameHash(&frameHashes, gb, frame)) {
+                framesMatch = false;
+            }
+            if (rewindBudget) {
+                recordRewindFrame(&rewindBuffer, gb);
+            }
+            triggerInterrupt(gb, INT_VBLANK);
+            frame++;
+        }
+    }
+
+    uint64 elapsed = platform.getMicroseconds() - startTime;
+    if (!elapsed) {
+        elapsed = 1;
+    }
+
+    double seconds = elapsed / 1e6;
+    double emulatedSeconds = (double)cyclesRun / GAMEBOY_CPU_FREQUENCY;
+
+    printf("%u frames, %llu cycles in %.1f ms : %.1f fps, %.2fx realtime\n",
+           frame, (unsigned long long)cyclesRun, seconds * 1000,
+           frame / seconds, emulatedSeconds / seconds);
+
+    if (printStats) {
+        printGameboyStats(stdout, gb);
+    }
+
+    if (rewindBudget) {
+        printRewindStats(stdout, &rewindBuffer);
+    }
+
+    if (runAheadFrames >= 0) {
+        printRunAheadStats(stdout, &runAhead);
+    }
+
+    if (checkStates && stateCheck.roundTrips) {
+        printf("%llu save state round trips of %llu bytes : save %.1f us, load %.1f us\n",
+               (unsigned long long)stateCheck.roundTrips,
+               (unsigned long long)stateCheck.stateSize,
+               stateCheck.saveNanoseconds / 1e3 / stateCheck.roundTrips,
+               stateCheck.loadNanoseconds / 1e3 / stateCheck.roundTrips);
+    }
+
+#ifdef GAMEBOY_OPCODE_PROFILE
+    printOpcodeProfile(stdout, gb);
+#endif
+
+    if (comparison) {
+        stopTrace(gb);
+        bool32 logRead = closeReferenceLog(comparison);
+
+        if (compareResult == COMPARE_END_OF_LOG && !logRead) {
+            fprintf(stderr, "Could not decompress %s\n", compareFilename);
+            compareResult = COMPARE_ERROR;
+        }
+
+        if (compareResult == COMPARE_MATCHING || compareResult == COMPARE_END_OF_LOG) {
+            printf("%llu instructions match %s%s\n",
+                   (unsigned long long)comparison->compared, compareFilename,
+                   compareResult == COMPARE_END_OF_LOG ? " (end of the log)" : "");
+        } else {
+            return 1;
+        }
+    } else if (traceBuffer) {
+        stopTrace(gb);
+        unmapTraceFile(traceBuffer, traceFilename);
+    }
+
+    if (saveStateFilename) {
+        uint64 size = writeSaveState(gb, stateCheck.states[0], sizeof(stateCheck.states[0]));
+        FILE* file = fopen(saveStateFilename, "wb");
+        if (!file) {
+            fprintf(stderr, "Could not open %s\n", saveStateFilename);
+            return 1;
+        }
+        fwrite(stateCheck.states[0], size, 1, file);
+        fclose(file);
+    }
+
+    if (profilePrefix && !writeProfileFiles(&guestProfile, profilePrefix)) {
+        return 1;
+    }
+
+    if (screenshotFilename && !writeScreenshot(gb, screenshotFilename)) {
+        return 1;
+    }
+
+    if (frameHashesFilename) {
+        fclose(frameHashes.file);
+
+        if (!framesMatch) {
+            return 1;
+        }
+        if (checkFrames) {
+            printf("%u frames match %s%s\n", frameHashes.checked, frameHashesFilename,
+                   frameHashes.ended ? " (end of the file)" : "");
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "handmade.h"
+#include "gameboy.h"
+
+// Platform layer shared by the programs without a window
+// (linux_headless.c, linux_bench.c) : file loading, a clock and
+// scripted input.
+
+PlatformFunctions platform;
+
+internal uint64 getFileSize_(const char* filepath, bool32* success) {
+    struct stat file_stat;
+    if (stat(filepath, &file_stat) < 0) {
+        if (success) {
+            *success = false;
+        }
+        return 0;
+    }
+
+    if (success) {
+        *success = true;
+    }
+    return file_stat.st_size;
+}
+
+internal bool32 readFileIntoMemory_(const char* filepath, void* buffer, uint64 size) {
+    int fd = open(filepath, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+
+    // read can return less than asked
+    uint64 done = 0;
+    while (done < size) {
+        ssize_t count = read(fd, (uint8*)buffer + done, size - done);
+        if (count <= 0) {
+            close(fd);
+            return false;
+        }
+        done += count;
+    }
+
+    close(fd);
+
+    return true;
+}
+
+internal uint64 getMicroseconds_() {
+    struct timespec res;
+    clock_gettime(CLOCK_MONOTONIC, &res);
+    return res.tv_sec * 1000 * 1000 + res.tv_nsec / 1000;
+}
+
+internal uint64 getNanoseconds() {
+    struct timespec res;
+    clock_gettime(CLOCK_MONOTONIC, &res);
+    return (uint64)res.tv_sec * 1000 * 1000 * 1000 + res.tv_nsec;
+}
+
+// Read-only mapping of a whole file, 0 if it can't be mapped
+internal void* mapFile_(const char* filename, uint64* size) {
+    int fd = open(filename, O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) < 0 || !fileStat.st_size) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+
+    void* data = mmap(0, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return 0;
+    }
+
+    // read through right away (ROM hash, save state sections)
+    madvise(data, fileStat.st_size, MADV_WILLNEED);
+
+    *size = fileStat.st_size;
+    return data;
+}
+
+internal void unmapFile_(void* data, uint64 size) {
+    munmap(data, size);
+}
+
+internal void initializeHeadlessPlatform() {
+    platform.getFileSize = &getFileSize_;
+    platform.readFileIntoMemory = &readFileIntoMemory_;
+    platform.mapFile = &mapFile_;
+    platform.unmapFile = &unmapFile_;
+    platform.getMicroseconds = &getMicroseconds_;
+    platform.isInitialized = true;
+}
+
+// Trace ring buffer backed by a file, so that the records are on disk
+// even if the emulator crashes
+internal TraceBuffer* mapTraceFile(const char* filename, uint32 capacity) {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+
+    uint64 size = TRACE_BUFFER_SIZE(capacity);
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    TraceBuffer* buffer = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        return 0;
+    }
+
+    initializeTraceBuffer(buffer, capacity);
+    return buffer;
+}
+
+// Unmaps the buffer and cuts the unused records off the file
+internal void unmapTraceFile(TraceBuffer* buffer, const char* filename) {
+    uint64 usedSize = TRACE_BUFFER_SIZE(getTraceRecordCount(buffer));
+    munmap(buffer, TRACE_BUFFER_SIZE(buffer->capacity));
+    truncate(filename, usedSize);
+}
+
+// Zeroed pages, 0 if size is 0 or they can't be mapped
+internal void* allocateMemory(uint64 size) {
+    if (!size) {
+        return 0;
+    }
+
+    void* memory = mmap(0, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? 0 : memory;
+}
+
+// Inserts the cartridge with RAM of its own, which starts zeroed
+internal bool32 insertNewCartridge(GameBoy* gb, Cartridge* cartridge) {
+    uint64 ramSize = getExternalRamSize(cartridge);
+    uint8* externalRam = allocateMemory(ramSize);
+    if (ramSize && !externalRam) {
+        fprintf(stderr, "Could not allocate %llu bytes of cartridge RAM\n",
+                (unsigned long long)ramSize);
+        return false;
+    }
+
+    insertCartridge(gb, cartridge, externalRam);
+    return true;
+}
+
+#define MAX_INPUT_EVENTS 4096
+
+// One line of an input script : "<frame> <button> press|release"
+typedef struct ScriptEvent {
+    uint32 frame;
+    enum JoypadButton button;
+    bool32 pressed;
+} ScriptEvent;
+
+typedef struct InputScript {
+    uint32 eventCount;
+    uint32 nextEvent;
+    ScriptEvent events[MAX_INPUT_EVENTS];
+} InputScript;
+
+internal bool32 parseButton(const char* name, enum JoypadButton* button) {
+    static const struct {
+        const char* name;
+        enum JoypadButton button;
+    } buttons[] = {
+        {"a", JP_A},
+        {"b", JP_B},
+        {"select", JP_SELECT},
+        {"start", JP_START},
+        {"right", JP_RIGHT},
+        {"left", JP_LEFT},
+        {"up", JP_UP},
+        {"down", JP_DOWN},
+    };
+
+    for (uint32 i = 0; i < ARRAY_COUNT(buttons); i++) {
+        if (!strcmp(name, buttons[i].name)) {
+            *button = buttons[i].button;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Events must be sorted by frame. Blank lines and lines starting with '#'
+// are ignored.
+internal bool32 loadInputScript(InputScript* script, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    char line[256];
+    uint32 lineNumber = 0;
+    uint32 lastFrame = 0;
+    bool32 success = true;
+
+    while (success && fgets(line, sizeof(line), file)) {
+        lineNumber++;
+
+        char buttonName[32];
+        char action[32];
+        uint32 frame;
+        char first;
+
+        if (sscanf(line, " %c", &first) != 1 || first == '#') {
+            continue;
+        }
+
+        ScriptEvent event;
+        if (sscanf(line, "%u %31s %31s", &frame, buttonName, action) != 3
+            || !parseButton(buttonName, &event.button)
+            || (strcmp(action, "press") && strcmp(action, "release"))) {
+            fprintf(stderr, "%s:%u : expected '<frame> <button> press|release'\n",
+                    filename, lineNumber);
+            success = false;
+        } else if (frame < lastFrame) {
+            fprintf(stderr, "%s:%u : events are not sorted by frame\n",
+                    filename, lineNumber);
+            success = false;
+        } else if (script->eventCount == MAX_INPUT_EVENTS) {
+            fprintf(stderr, "%s : more than %d events\n",
+                    filename, MAX_INPUT_EVENTS);
+            success = false;
+        } else {
+            event.frame = frame;
+            event.pressed = !strcmp(action, "press");
+            script->events[script->eventCount++] = event;
+            lastFrame = frame;
+        }
+    }
+
+    fclose(file);
+    return success;
+}
+
+internal void applyInputScript(GameBoy* gb, InputScript* script, uint32 frame) {
+    bool32 changed = false;
+
+    while (script->nextEvent < script->eventCount
+           && script->events[script->nextEvent].frame <= frame) {
+        ScriptEvent* event = &script->events[script->nextEvent++];
+
+        if (event->pressed) {
+            pressButton(gb, event->button);
+        } else {
+            releaseButton(gb, event->button);
+        }
+        changed = true;
+    }
+
+    if (changed) {
+        triggerInterrupt(gb, INT_JOYPAD);
+    }
+}
+
+// Same frame loop as updateProgramAndRender, without waiting for vsync.
+// Returns the number of cycles run.
+internal uint32 runHeadlessFrame(GameBoy* gb, InputScript* script, uint32 frame) {
+    uint32 startClock = gb->clock;
+
+    applyInputScript(gb, script, frame);
+
+    while (!gb->frameReady) {
+        runCycles(gb, GAMEBOY_CYCLES_PER_FRAME);
+    }
+    gb->frameReady = false;
+    triggerInterrupt(gb, INT_VBLANK);
+
+    return gb->clock - startClock;
+}
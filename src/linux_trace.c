@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "linux_headless_platform.c"
+
+// Decodes a binary trace (gameboy-headless --trace, or trace.bin from
+// the T key) into text : the registers in the log line format, then
+// the disassembly of the instruction.
+
+internal void printUsage() {
+    fprintf(stderr,
+            "Usage : ./gb-trace <trace> [options]\n"
+            "Options:\n"
+            " --doctor          only the register lines, to diff against other emulators\n"
+            " --cycles          start the disassembly lines with the clock\n"
+            " --last N          only the last N records\n");
+}
+
+int main(int argc, char** argv) {
+    const char* filename = 0;
+    bool32 doctor = false;
+    bool32 cycles = false;
+    uint32 last = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+
+        if (!strcmp(arg, "--doctor")) {
+            doctor = true;
+        } else if (!strcmp(arg, "--cycles")) {
+            cycles = true;
+        } else if (!strcmp(arg, "--last") && i + 1 < argc) {
+            last = strtoul(argv[++i], 0, 10);
+        } else if (arg[0] != '-') {
+            filename = arg;
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    if (!filename) {
+        printUsage();
+        return 1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) < 0) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return 1;
+    }
+
+    uint64 fileSize = fileStat.st_size;
+    TraceBuffer* buffer = 0;
+    if (fileSize >= sizeof(TraceBuffer)) {
+        buffer = mmap(0, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (!buffer || buffer == MAP_FAILED
+        || buffer->magic != TRACE_MAGIC
+        || !buffer->capacity
+        || fileSize < TRACE_BUFFER_SIZE(getTraceRecordCount(buffer))) {
+        fprintf(stderr, "%s is not a trace\n", filename);
+        return 1;
+    }
+
+    uint32 count = getTraceRecordCount(buffer);
+    uint32 first = (last && last < count) ? count - last : 0;
+
+    for (uint32 i = first; i < count; i++) {
+        TraceRecord* record = getTraceRecord(buffer, i);
+
+        printTraceLogLine(stdout, record);
+        if (doctor) {
+            continue;
+        }
+
+        if (cycles) {
+            printf("%10u ", record->clock);
+        }
+        printf("%04x ", record->pc);
+        disassembleInstruction(stdout, record->bytes);
+        printf("\n");
+    }
+
+    return 0;
+}
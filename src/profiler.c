@@ -0,0 +1,260 @@
+#include "gameboy.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Guest sampling profiler : the EVENT_PROFILE_SAMPLE event calls
+// recordProfileSample every sampleInterval cycles (see
+// startGuestProfile), which counts the current (bank, PC) in a flat
+// histogram and, under the frames of the shadow call stack, in a call
+// tree exported as folded stacks for flamegraph.pl.
+
+static ProfileKey makeProfileKey(uint16 bank, uint16 address) {
+    return ((uint32)bank << 16) | address;
+}
+
+static uint32 hashProfileKey(ProfileKey key) {
+    return (key * 2654435761u) >> 16;
+}
+
+// Child of the parent node with the key, created if needed, 0 if the
+// tree is full
+static uint32 getProfileChild(GuestProfile* profile, uint32 parent, ProfileKey key) {
+    uint32 child = profile->nodes[parent].firstChild;
+    while (child) {
+        if (profile->nodes[child].key == key) {
+            return child;
+        }
+        child = profile->nodes[child].nextSibling;
+    }
+
+    if (profile->nodeCount == PROFILE_NODE_COUNT) {
+        return 0;
+    }
+
+    child = profile->nodeCount++;
+    ProfileNode* node = &profile->nodes[child];
+    node->key = key;
+    node->parent = parent;
+    node->firstChild = 0;
+    node->nextSibling = profile->nodes[parent].firstChild;
+    node->count = 0;
+    profile->nodes[parent].firstChild = child;
+
+    return child;
+}
+
+static bool32 countInHistogram(GuestProfile* profile, ProfileKey key) {
+    uint32 slot = hashProfileKey(key);
+
+    for (uint32 probe = 0; probe < PROFILE_HISTOGRAM_SIZE; probe++) {
+        ProfileEntry* entry = &profile->histogram[(slot + probe) % PROFILE_HISTOGRAM_SIZE];
+        if (!entry->count || entry->key == key) {
+            entry->key = key;
+            entry->count++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void recordProfileSample(GameBoy* gb) {
+    GuestProfile* profile = gb->guestProfile;
+    if (!profile) {
+        return;
+    }
+
+    // zeroed memory is an empty profile
+    if (!profile->nodeCount) {
+        memset(&profile->nodes[0], 0, sizeof(profile->nodes[0]));
+        profile->nodeCount = 1;
+    }
+
+    uint16 pc = REG(PC);
+    ProfileKey key = makeProfileKey(getAddressBank(gb, pc), pc);
+    profile->sampleCount++;
+
+    // root, one node per frame, then the PC
+    uint32 node = 0;
+    for (uint16 i = 0; i <= gb->callStackHeight; i++) {
+        ProfileKey nodeKey = key;
+        if (i < gb->callStackHeight) {
+            CallFrame* frame = &gb->callStack[i];
+            nodeKey = makeProfileKey(frame->bank, frame->address);
+        }
+
+        node = getProfileChild(profile, node, nodeKey);
+        if (!node) {
+            break;
+        }
+    }
+
+    if (node) {
+        profile->nodes[node].count++;
+    }
+
+    if (!countInHistogram(profile, key) || !node) {
+        profile->droppedSamples++;
+    }
+}
+
+void clearGuestProfile(GuestProfile* profile) {
+    profile->sampleCount = 0;
+    profile->droppedSamples = 0;
+    memset(profile->histogram, 0, sizeof(profile->histogram));
+    profile->nodeCount = 0;
+}
+
+static int compareProfileSymbols(const void* a, const void* b) {
+    ProfileKey keyA = ((ProfileSymbol*)a)->key;
+    ProfileKey keyB = ((ProfileSymbol*)b)->key;
+    return (keyA > keyB) - (keyA < keyB);
+}
+
+// RGBDS .sym file : "BB:AAAA Name" lines, ';' starts a comment
+bool32 loadProfileSymbols(GuestProfile* profile, const char* filename) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        return false;
+    }
+
+    char line[256];
+    profile->symbolCount = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        uint32 bank;
+        uint32 address;
+        char name[PROFILE_SYMBOL_LENGTH];
+
+        if (sscanf(line, "%x:%x %47s", &bank, &address, name) != 3) {
+            continue;
+        }
+
+        if (profile->symbolCount == PROFILE_MAX_SYMBOLS) {
+            fprintf(stderr, "%s : more than %d symbols, ignoring the rest\n",
+                    filename, PROFILE_MAX_SYMBOLS);
+            break;
+        }
+
+        // samples only have a bank number in the switchable ROM area
+        if (address < ROM_SWITCHABLE_BANK_START || address >= VRAM_START) {
+            bank = 0;
+        }
+
+        ProfileSymbol* symbol = &profile->symbols[profile->symbolCount++];
+        symbol->key = makeProfileKey(bank, address);
+        memcpy(symbol->name, name, sizeof(symbol->name));
+    }
+
+    fclose(file);
+
+    qsort(profile->symbols, profile->symbolCount, sizeof(ProfileSymbol),
+          compareProfileSymbols);
+
+    return true;
+}
+
+// Symbols of the ROM file with its extension replaced by .sym, as
+// written by rgblink -n, if there is such a file
+bool32 loadRomSymbols(GuestProfile* profile, const char* romFilename) {
+    char filename[512];
+    const char* dot = strrchr(romFilename, '.');
+    const char* slash = strrchr(romFilename, '/');
+    int32 length = (dot && (!slash || dot > slash)) ? dot - romFilename : (int32)strlen(romFilename);
+
+    if (snprintf(filename, sizeof(filename), "%.*s.sym", length, romFilename)
+        >= (int)sizeof(filename)) {
+        return false;
+    }
+
+    return loadProfileSymbols(profile, filename);
+}
+
+// Closest symbol at or before the key in the same bank, or 0
+static ProfileSymbol* findProfileSymbol(GuestProfile* profile, ProfileKey key) {
+    uint32 low = 0;
+    uint32 high = profile->symbolCount;
+
+    while (low < high) {
+        uint32 middle = (low + high) / 2;
+        if (profile->symbols[middle].key <= key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    if (!low || (profile->symbols[low - 1].key >> 16) != (key >> 16)) {
+        return 0;
+    }
+
+    return &profile->symbols[low - 1];
+}
+
+static void printProfileKey(FILE* file, GuestProfile* profile, ProfileKey key,
+                            bool32 withOffset) {
+    ProfileSymbol* symbol = findProfileSymbol(profile, key);
+
+    if (!symbol) {
+        fprintf(file, "%02X:%04X", key >> 16, key & 0xFFFF);
+    } else if (withOffset && symbol->key != key) {
+        fprintf(file, "%s+%X", symbol->name, key - symbol->key);
+    } else {
+        fprintf(file, "%s", symbol->name);
+    }
+}
+
+static int compareProfileEntries(const void* a, const void* b) {
+    uint32 countA = ((ProfileEntry*)a)->count;
+    uint32 countB = ((ProfileEntry*)b)->count;
+    return (countA < countB) - (countA > countB);
+}
+
+// One "count percent bank:address symbol+offset" line per sampled
+// address, most sampled first
+void writeProfileHistogram(FILE* file, GuestProfile* profile) {
+    uint32 entryCount = 0;
+    for (uint32 slot = 0; slot < PROFILE_HISTOGRAM_SIZE; slot++) {
+        if (profile->histogram[slot].count) {
+            profile->sorted[entryCount++] = profile->histogram[slot];
+        }
+    }
+
+    qsort(profile->sorted, entryCount, sizeof(ProfileEntry), compareProfileEntries);
+
+    fprintf(file, "# %u samples, %u dropped\n",
+            profile->sampleCount, profile->droppedSamples);
+
+    for (uint32 i = 0; i < entryCount; i++) {
+        ProfileEntry* entry = &profile->sorted[i];
+        fprintf(file, "%10u %5.1f%%  %02X:%04X  ",
+                entry->count,
+                profile->sampleCount ? 100.0 * entry->count / profile->sampleCount : 0.0,
+                entry->key >> 16, entry->key & 0xFFFF);
+        printProfileKey(file, profile, entry->key, true);
+        fprintf(file, "\n");
+    }
+}
+
+// "outer;...;inner count" lines, the input of flamegraph.pl
+void writeFoldedStacks(FILE* file, GuestProfile* profile) {
+    for (uint32 node = 1; node < profile->nodeCount; node++) {
+        if (!profile->nodes[node].count) {
+            continue;
+        }
+
+        uint32 path[CALL_STACK_SIZE + 1];
+        uint32 depth = 0;
+        for (uint32 at = node; at && depth < ARRAY_COUNT(path); at = profile->nodes[at].parent) {
+            path[depth++] = at;
+        }
+
+        while (depth--) {
+            printProfileKey(file, profile, profile->nodes[path[depth]].key, false);
+            fprintf(file, depth ? ";" : " ");
+        }
+        fprintf(file, "%u\n", profile->nodes[node].count);
+    }
+}
@@ -1,6 +1,11 @@
 #include "gameboy.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 uint8 getGrayLevel(uint8 color) {
     uint8 shades[4] = {255, 170, 85, 0};
@@ -14,279 +19,237 @@ uint8 getPaletteColor(uint8 palette, uint8 id) {
     return color;
 }
 
-void fetchSpritePixelRow(GameBoy* gb, uint8 ly, uint8 lx) {
-    // TODO(octave) : 10 sprites per scan line limitation
-    uint8 lyInSprite = ly + 16;
-    uint8 lxInSprite = lx + 8;
+// Color indices of a row of a tile (numbered from 0x8000), left to
+// right, decoded again if it was written since.  Without a tile cache,
+// the result is only valid until the next call.
+uint8* getTileRow(GameBoy* gb, uint16 tile, uint8 row, bool32 flipped) {
+    TileCache* tileCache = gb->tileCache;
 
-    uint8 lcdc = IO(LCDC);
-    uint8 spriteHeight = getBit(lcdc, 2) ? 16 : 8;
+    if (tileCache && !(gb->dirtyTileRows[tile] & (1 << row))) {
+        return (*tileCache)[flipped ? 1 : 0][tile][row];
+    }
 
-    uint8 wantedEnd = gb->spriteFifo.end + 8;
-    
-    for (uint32 spriteIndex = 0; spriteIndex < 40; spriteIndex++) {
-        uint16 spriteAddr = SPRITE_ATTRIBUTE_TABLE + spriteIndex * 4;
-        
-        uint8 spriteY =   readMemory(gb, spriteAddr);
-        uint8 spriteX =   readMemory(gb, spriteAddr + 1);
-        uint8 tileIndex = readMemory(gb, spriteAddr + 2);
-        uint8 flags =     readMemory(gb, spriteAddr + 3);
+    uint8* pixels = tileCache ? (*tileCache)[0][tile][row] : gb->decodedTileRow[0];
+    uint8* flippedPixels = tileCache ? (*tileCache)[1][tile][row] : gb->decodedTileRow[1];
+    uint8 tileDataLow = gb->vram[tile * 16 + row * 2];
+    uint8 tileDataHigh = gb->vram[tile * 16 + row * 2 + 1];
 
-        uint16 tileAddr = SPRITE_TILES_TABLE + tileIndex * 16;
+    for (uint8 pixel = 0; pixel < 8; pixel++) {
+        uint8 pixelColorIndex =
+            (getBit(tileDataHigh, 7 - pixel) << 1) | getBit(tileDataLow, 7 - pixel);
 
-        uint8 palette = getBit(flags, 4) ?
-            readMemory(gb, IO_OBP1) :
-            readMemory(gb, IO_OBP0);
-
-        if (lyInSprite >= spriteY && lyInSprite < spriteY + spriteHeight
-            && lxInSprite >= spriteX && lxInSprite < spriteX + 8) {
-            
-            // TODO(octave) : factor this into function ?
-            uint8 tileDataLow = readMemory(gb, tileAddr + (lyInSprite - spriteY) * 2);
-            uint8 tileDataHigh = readMemory(gb, tileAddr + (lyInSprite - spriteY) * 2 + 1);
-
-            // push up to 8 pixels to sprite fifo
-            uint8 dx = lxInSprite - spriteX;
-            for (uint8 pixel = 7; pixel < 8; pixel--) {
-                uint8 pixelColorIndex =
-                    (getBit(tileDataHigh, pixel) << 1) | getBit(tileDataLow, pixel);
-
-                if (dx > 0) {
-                    dx--;
-                } else {
-                    gb->spriteFifo.pixels[gb->spriteFifo.end++] =
-                        (FIFOPixel){pixelColorIndex};
-                }
-            }
+        pixels[pixel] = pixelColorIndex;
+        flippedPixels[7 - pixel] = pixelColorIndex;
+    }
 
-            break;
-        }
+    if (tileCache) {
+        gb->dirtyTileRows[tile] &= ~(1 << row);
     }
 
-    /* while (gb->spriteFifo.end < wantedEnd) { */
-        /* gb->spriteFifo.pixels[gb->spriteFifo.end++] = */
-            /* (FIFOPixel){0}; */
-    /* } */
+    return flipped ? flippedPixels : pixels;
 }
 
-void fetchBackgroundPixelRow(GameBoy* gb, uint8 ly, uint8 lx) {
-    uint8 lcdc = IO(LCDC);
-    uint8 wx = IO(WX);
-    uint8 wy = IO(WY);
-
-    bool32 inWindow =
-        getBit(lcdc, 5)
-        && lx >= wx
-        && ly >= wy;
-
-    inWindow = false;
-
-    // find tilemap
-    uint16 tilemapAddr;
-    if (inWindow) {
-        tilemapAddr = getBit(lcdc, 6) ? TILEMAP1 : TILEMAP0;
-    } else {
-        tilemapAddr = getBit(lcdc, 3) ? TILEMAP1 : TILEMAP0;
-    }
-
-    // compute tile row coordinates
-    uint8 tileX, rowY;
-    if (inWindow) {
-        // TODO(octave) : offset x by 7 ?
-        tileX = (lx - wx) / 8;
-        rowY = (ly - wy);
-    } else {
-        uint8 scx = IO(SCX);
-        uint8 scy = IO(SCY);
-        
-        tileX = (scx / 8 + lx / 8) & 0x1F;
-        rowY = (ly + scy) & 0xFF;
-    }
+// Tile viewer : every tile of VRAM in 16 columns, in shades of gray
+// without palette
+void drawTileSheet(GameBoy* gb, uint8 pixels[TILE_SHEET_HEIGHT][TILE_SHEET_WIDTH]) {
+    for (uint16 tile = 0; tile < TILE_COUNT; tile++) {
+        for (uint8 row = 0; row < 8; row++) {
+            uint8* tileRow = getTileRow(gb, tile, row, false);
 
-    // compute tile address
-    uint8 tileIndex = readMemory(gb, tilemapAddr + (rowY / 8) * 32 + tileX);
-
-    uint16 tileAddr;
-    if (getBit(lcdc, 4)) {
-        tileAddr = TILE_DATA_BLOCK0 + tileIndex * 16;
-    } else {
-        if (tileIndex < 128) {
-            tileAddr = TILE_DATA_BLOCK2 + tileIndex * 16;
-        } else {
-            tileAddr = TILE_DATA_BLOCK1 + (tileIndex - 128) * 16;
+            for (uint8 pixel = 0; pixel < 8; pixel++) {
+                pixels[tile / 16 * 8 + row][tile % 16 * 8 + pixel] =
+                    getGrayLevel(tileRow[pixel]);
+            }
         }
     }
+}
 
-    uint8 tileDataLow = readMemory(gb, tileAddr + (rowY % 8) * 2);
-    uint8 tileDataHigh = readMemory(gb, tileAddr + (rowY % 8) * 2 + 1);
-
-    // push 8 pixels to background fifo
-    ASSERT((gb->backgroundFifo.end == 0 && gb->backgroundFifo.start == 0)
-           || gb->backgroundFifo.end == 8);
-    for (uint8 pixel = 7; pixel < 8; pixel--) {
-        uint8 pixelColorIndex =
-            (getBit(tileDataHigh, pixel) << 1) | getBit(tileDataLow, pixel);
+// Mode 2 OAM search : the first 10 sprites in OAM order that overlap
+// line ly, sorted by drawing priority (lowest X first, then lowest OAM
+// index)
+static uint8 scanOam(GameBoy* gb, uint8 ly, uint8 sprites[MAX_SPRITES_PER_LINE]) {
+    uint8 lyInSprite = ly + 16;
+    uint8 spriteHeight = getBit(IO(LCDC), 2) ? 16 : 8;
+    uint8 count = 0;
+
+    for (uint8 spriteIndex = 0;
+         spriteIndex < 40 && count < MAX_SPRITES_PER_LINE;
+         spriteIndex++) {
+        uint8 spriteY = gb->oam[spriteIndex * 4];
+        uint8 spriteX = gb->oam[spriteIndex * 4 + 1];
         
-        gb->backgroundFifo.pixels[gb->backgroundFifo.end++] =
-            (FIFOPixel){pixelColorIndex};
+        if (lyInSprite >= spriteY && lyInSprite < spriteY + spriteHeight) {
+            // insertion sort, sprites with the same X stay in OAM order
+            uint8 i = count++;
+            while (i > 0 && gb->oam[sprites[i - 1] * 4 + 1] > spriteX) {
+                sprites[i] = sprites[i - 1];
+                i--;
+            }
+            sprites[i] = spriteIndex;
+        }
     }
-}
-
-uint8 popBackgroundPixelColor(GameBoy* gb) {
-    uint8 palette = IO(BGP);
 
-    ASSERT(gb->backgroundFifo.start < 8 && gb->backgroundFifo.start < gb->backgroundFifo.end);
-
-    FIFOPixel backgroundPixel = gb->backgroundFifo.pixels[gb->backgroundFifo.start++];
-
-    return getPaletteColor(palette, backgroundPixel.colorIndex);
+    return count;
 }
 
-uint8 getNextBackgroundPixel(GameBoy* gb, uint8 y, uint8 x) {
-    uint8 lcdc = IO(LCDC);
+// Sprite pixels of drawSpriteRow : the color index in the low 2 bits,
+// with the OAM palette and priority flags above it
+#define SPRITE_PIXEL_OBP1 0x4 // OBP1 instead of OBP0
+#define SPRITE_PIXEL_BEHIND_BG 0x8 // only over background color 0
 
-    ASSERT(gb->backgroundFifo.start <= gb->backgroundFifo.end);
-    
-    // Fill up FIFOs if necessary
-    if (gb->backgroundFifo.start >= 8) {
-        ASSERT(gb->backgroundFifo.start == 8);
-        ASSERT(gb->backgroundFifo.end == 16);
-
-        // shift fifo 8 spots to the left
-        for (uint8 i = 0; i < 8; i++) {
-            gb->backgroundFifo.pixels[i] = gb->backgroundFifo.pixels[i+8];
-        }
-        gb->backgroundFifo.end -= 8;
-        gb->backgroundFifo.start -= 8;
-
-        fetchBackgroundPixelRow(gb, y, x + 8);
+// Pixels of the sprites on line ly, 0 where there is none.  Where
+// sprites overlap, the one with the highest priority wins even when it
+// is behind the background.
+static void drawSpriteRow(GameBoy* gb, uint8 ly, uint8 colors[GAMEBOY_SCREEN_WIDTH]) {
+    for (uint8 x = 0; x < GAMEBOY_SCREEN_WIDTH; x++) {
+        colors[x] = 0;
     }
 
-    uint8 popped = popBackgroundPixelColor(gb);
-    
-    if (getBit(lcdc, 0)) {
-        return popped;
-    } else {
-        return 0;
+    if (!getBit(IO(LCDC), 1)) {
+        return;
     }
 
-}
+    uint8 sprites[MAX_SPRITES_PER_LINE];
+    uint8 count = scanOam(gb, ly, sprites);
+    uint8 lyInSprite = ly + 16;
 
-#if 0
+    // lowest priority first, the sprites drawn after it win
+    for (uint8 i = count; i-- > 0;) {
+        uint8* sprite = &gb->oam[sprites[i] * 4];
+        uint8 spriteY = sprite[0];
+        uint8 spriteX = sprite[1];
+        uint8 tileIndex = sprite[2];
+        uint8 flags = sprite[3];
 
-void drawScreen(GameBoy* gb) {
-    for (uint8 y = 0; y < GAMEBOY_SCREEN_HEIGHT; y++) {
-        // clear FIFOs
-        gb->backgroundFifo.start = 0;
-        gb->backgroundFifo.end = 0;
-        
-        gb->spriteFifo.start = 0;
-        gb->spriteFifo.end = 0;
-        
-        // fetch first 2 tiles
-        fetchBackgroundPixelRow(gb, y, 0);
-        fetchBackgroundPixelRow(gb, y, 8);
-        
-        // fetch first 2 tiles
-        fetchSpritePixelRow(gb, y, 0);
-        fetchSpritePixelRow(gb, y, 8);
-        
-        // skip the first few pixels if scrolled
-        for (uint8 i = 0; i < IO(SCX) % 8; i++) {
-            getNextBackgroundPixel(gb, y, 0);
+        uint16 tileAddr = SPRITE_TILES_TABLE + tileIndex * 16;
+
+        uint8 dy = lyInSprite - spriteY;
+        if (getBit(flags, 6)) {
+            dy = 7 - dy;
         }
 
-        for (uint8 x = 0; x < GAMEBOY_SCREEN_WIDTH; x++) {
-            uint8 colorIndex = getNextBackgroundPixel(gb, y, x);
-            uint8 gray = getGrayLevel(colorIndex);
+        uint16 rowOffset = (uint16)(tileAddr + dy * 2) - VRAM_START;
+        uint8* tileRow = getTileRow(gb, rowOffset / 16, rowOffset % 16 / 2,
+                                    getBit(flags, 5));
+        uint8 attributes = (getBit(flags, 4) ? SPRITE_PIXEL_OBP1 : 0)
+            | (getBit(flags, 7) ? SPRITE_PIXEL_BEHIND_BG : 0);
+
+        for (uint8 dx = 0; dx < 8; dx++) {
+            int32 x = spriteX - 8 + dx;
+            if (x < 0 || x >= GAMEBOY_SCREEN_WIDTH) {
+                continue;
+            }
 
-            gb->screen[y][x] = gray;
+            if (tileRow[dx]) {
+                colors[x] = tileRow[dx] | attributes;
+            }
         }
     }
 }
 
-#endif
-
-uint8 getSpriteColor(GameBoy* gb, uint8 ly, uint8 lx) {
-    uint8 lyInSprite = ly + 16;
-    uint8 lxInSprite = lx + 8;
-
+// Color indices of the background on line ly, before the palette
+static void drawBackgroundRow(GameBoy* gb, uint8 ly, uint8 colors[GAMEBOY_SCREEN_WIDTH]) {
     uint8 lcdc = IO(LCDC);
-    uint8 spriteHeight = getBit(lcdc, 2) ? 16 : 8;
-
-    uint8 colorIndex = 0;
-    uint8 minSpriteX = 255;
-    uint8 minSpriteIndex = 255;
-
-    for (uint8 spriteIndex = 0; spriteIndex < 40; spriteIndex++) {
-        uint16 spriteAddr = SPRITE_ATTRIBUTE_TABLE + spriteIndex * 4;
+    uint8 scx = IO(SCX);
+    uint8 fineX = scx % 8;
+
+    // no window : the pixel FIFO this replaces had it disabled too
+    uint16 tilemapAddr = getBit(lcdc, 3) ? TILEMAP1 : TILEMAP0;
+    uint8 rowY = (ly + IO(SCY)) & 0xFF;
+
+    // whole tiles covering the line, the first fineX pixels are skipped
+    uint8 pixels[GAMEBOY_SCREEN_WIDTH + 8];
+    for (uint8 column = 0; column < GAMEBOY_SCREEN_WIDTH / 8 + 1; column++) {
+        // when scrolled by part of a tile, the second tile is fetched
+        // twice, as the pixel FIFO did : the frames stay the same
+        uint8 tileX = scx / 8 + column;
+        if (fineX && column >= 2) {
+            tileX--;
+        }
+        tileX &= 0x1F;
         
-        uint8 spriteY =   readMemory(gb, spriteAddr);
-        uint8 spriteX =   readMemory(gb, spriteAddr + 1);
-        uint8 tileIndex = readMemory(gb, spriteAddr + 2);
-        uint8 flags =     readMemory(gb, spriteAddr + 3);
+        uint8 tileIndex = gb->vram[tilemapAddr - VRAM_START + (rowY / 8) * 32 + tileX];
 
-        uint16 tileAddr = SPRITE_TILES_TABLE + tileIndex * 16;
+        // tiles 0-127 come from 0x9000 unless LCDC bit 4 is set
+        uint16 tile = (getBit(lcdc, 4) || tileIndex >= 128) ? tileIndex : 256 + tileIndex;
 
-        uint8 palette = getBit(flags, 4) ?
-            readMemory(gb, IO_OBP1) :
-            readMemory(gb, IO_OBP0);
+        memcpy(&pixels[column * 8], getTileRow(gb, tile, rowY % 8, false), 8);
+    }
 
-        uint8 dx = lxInSprite - spriteX;
-        uint8 dy = lyInSprite - spriteY;
+    memcpy(colors, pixels + fineX, GAMEBOY_SCREEN_WIDTH);
+}
 
-        if (getBit(flags, 6)) {
-            dy = 7 - dy;
-        }
-            
-        if (getBit(flags, 5)) {
-            dx = 7 - dx;
-        }
-            
-        if (lyInSprite >= spriteY && lyInSprite < spriteY + spriteHeight
-            && lxInSprite >= spriteX && lxInSprite < spriteX + 8) {
-            // TODO(octave) : factor this into function ?
-            
-            uint8 tileDataLow = readMemory(gb, tileAddr + dy * 2);
-            uint8 tileDataHigh = readMemory(gb, tileAddr + dy * 2 + 1);
-
-            uint8 pixelColorIndex =
-                (getBit(tileDataHigh, 7 - dx) << 1) | getBit(tileDataLow, 7 - dx);
-
-            if (pixelColorIndex &&
-                (spriteX < minSpriteX ||
-                 (spriteX == minSpriteX && spriteIndex < minSpriteIndex))) {
-                colorIndex = pixelColorIndex;
-                minSpriteX = spriteX;
-                minSpriteIndex = spriteIndex;
-            }
-        }
+#ifdef __SSE2__
+// lut[index] for 16 indices (below lutSize) at once
+static __m128i lookupColors(__m128i indices, uint8* lut, uint8 lutSize) {
+    __m128i result = _mm_setzero_si128();
+
+    for (uint8 i = 0; i < lutSize; i++) {
+        __m128i match = _mm_cmpeq_epi8(indices, _mm_set1_epi8(i));
+        result = _mm_or_si128(result, _mm_and_si128(match, _mm_set1_epi8(lut[i])));
     }
 
-    return colorIndex;
+    return result;
 }
+#endif
 
-void drawScreenRow(GameBoy* gb, uint8 y) {
-    // clear FIFOs
-    gb->backgroundFifo.start = 0;
-    gb->backgroundFifo.end = 0;
-        
-    // fetch first 2 tiles
-    fetchBackgroundPixelRow(gb, y, 0);
-    fetchBackgroundPixelRow(gb, y, 8);
-        
-    // skip the first few pixels if scrolled
-    for (uint8 i = 0; i < IO(SCX) % 8; i++) {
-        getNextBackgroundPixel(gb, y, 0);
+// Gray levels of a line : sprite pixels over the background, unless
+// they are behind it and the background isn't color 0.  spriteLut is
+// OBP0 then OBP1.
+static void composeRow(uint8 out[GAMEBOY_SCREEN_WIDTH],
+                       uint8 background[GAMEBOY_SCREEN_WIDTH], uint8 backgroundLut[4],
+                       uint8 sprites[GAMEBOY_SCREEN_WIDTH], uint8 spriteLut[8]) {
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+    __m128i behindBit = _mm_set1_epi8(SPRITE_PIXEL_BEHIND_BG);
+    __m128i lutBits = _mm_set1_epi8(SPRITE_PIXEL_OBP1 | 0x3);
+
+    for (uint8 x = 0; x < GAMEBOY_SCREEN_WIDTH; x += 16) {
+        __m128i bg = _mm_loadu_si128((__m128i*)&background[x]);
+        __m128i sprite = _mm_loadu_si128((__m128i*)&sprites[x]);
+
+        __m128i behind = _mm_cmpeq_epi8(_mm_and_si128(sprite, behindBit), behindBit);
+        __m128i bgHides = _mm_andnot_si128(_mm_cmpeq_epi8(bg, zero), behind);
+        __m128i showBg = _mm_or_si128(_mm_cmpeq_epi8(sprite, zero), bgHides);
+        __m128i result = _mm_or_si128(
+            _mm_and_si128(showBg, lookupColors(bg, backgroundLut, 4)),
+            _mm_andnot_si128(showBg, lookupColors(_mm_and_si128(sprite, lutBits),
+                                                  spriteLut, 8)));
+
+        _mm_storeu_si128((__m128i*)&out[x], result);
     }
-
+#else
     for (uint8 x = 0; x < GAMEBOY_SCREEN_WIDTH; x++) {
-        uint8 sprite = getSpriteColor(gb, y, x);
-        uint8 bg = getNextBackgroundPixel(gb, y, x);
-            
-        uint8 gray = getGrayLevel(sprite ? sprite : bg);
+        uint8 sprite = sprites[x];
+        bool32 showBg = !sprite || ((sprite & SPRITE_PIXEL_BEHIND_BG) && background[x]);
 
-        gb->screen[y][x] = gray;
+        out[x] = showBg ? backgroundLut[background[x]]
+            : spriteLut[sprite & (SPRITE_PIXEL_OBP1 | 0x3)];
     }
+#endif
 }
 
+void drawScreenRow(GameBoy* gb, uint8 y) {
+    uint8 background[GAMEBOY_SCREEN_WIDTH];
+    drawBackgroundRow(gb, y, background);
+
+    uint8 sprites[GAMEBOY_SCREEN_WIDTH];
+    drawSpriteRow(gb, y, sprites);
+
+    // with LCDC bit 0 off the background is white and never hides the
+    // sprites
+    if (!getBit(IO(LCDC), 0)) {
+        memset(background, 0, sizeof(background));
+    }
+
+    uint8 backgroundLut[4];
+    uint8 spriteLut[8];
+    for (uint8 i = 0; i < 4; i++) {
+        uint8 color = getBit(IO(LCDC), 0) ? getPaletteColor(IO(BGP), i) : 0;
+        backgroundLut[i] = getGrayLevel(color);
+        spriteLut[i] = getGrayLevel(getPaletteColor(IO(OBP0), i));
+        spriteLut[SPRITE_PIXEL_OBP1 | i] = getGrayLevel(getPaletteColor(IO(OBP1), i));
+    }
+
+    composeRow(gb->screen[y], background, backgroundLut, sprites, spriteLut);
+}
@@ -0,0 +1,284 @@
+#include "gameboy.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Records : a list of (zero count, literal count) uint16 pairs, each
+// followed by its literal bytes.  A record is the XOR of a state with
+// its keyframe, mostly zeros from one frame to the next, or with zeros
+// for the keyframe itself.  A literal run ends at the first 4 zero
+// bytes in a row, so every pair but the last covers at least 4 bytes
+// of state : a record is never more than twice the state size.
+#define REWIND_RUN_MAX 0xFFFF
+#define REWIND_MIN_ZERO_RUN 4
+
+static uint8 getXorByte(uint8* state, uint8* base, uint64 at) {
+    return base ? state[at] ^ base[at] : state[at];
+}
+
+// Number of bytes from at on where state and base are the same, up to end
+static uint64 countZeroRun(uint8* state, uint8* base, uint64 at, uint64 end) {
+    uint64 start = at;
+
+#ifdef __SSE2__
+    __m128i zero = _mm_setzero_si128();
+
+    while (at + 16 <= end) {
+        __m128i bytes = _mm_loadu_si128((__m128i*)&state[at]);
+        if (base) {
+            bytes = _mm_xor_si128(bytes, _mm_loadu_si128((__m128i*)&base[at]));
+        }
+
+        uint32 zeroMask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero));
+        if (zeroMask != 0xFFFF) {
+            return at + __builtin_ctz(~zeroMask) - start;
+        }
+        at += 16;
+    }
+#endif
+
+    while (at < end && !getXorByte(state, base, at)) {
+        at++;
+    }
+
+    return at - start;
+}
+
+// base 0 : XOR with zeros
+static uint64 encodeXorDelta(uint8* state, uint8* base, uint64 size, uint8* output) {
+    uint8* out = output;
+    uint64 at = 0;
+
+    while (at < size) {
+        uint64 runEnd = at + REWIND_RUN_MAX < size ? at + REWIND_RUN_MAX : size;
+        uint16 zeros = countZeroRun(state, base, at, runEnd);
+        at += zeros;
+
+        uint64 literalStart = at;
+        uint32 zeroRun = 0;
+        while (at < size && at - literalStart < REWIND_RUN_MAX) {
+            if (getXorByte(state, base, at)) {
+                zeroRun = 0;
+            } else if (++zeroRun == REWIND_MIN_ZERO_RUN) {
+                at -= REWIND_MIN_ZERO_RUN - 1;
+                break;
+            }
+            at++;
+        }
+        uint16 literals = at - literalStart;
+
+        if (!literals && at == size) {
+            break;
+        }
+
+        memcpy(out, &zeros, sizeof(zeros));
+        memcpy(out + 2, &literals, sizeof(literals));
+        out += 4;
+        for (uint64 i = literalStart; i < at; i++) {
+            *out++ = getXorByte(state, base, i);
+        }
+    }
+
+    return out - output;
+}
+
+static void applyXorDelta(uint8* state, uint64 size, uint8* record, uint64 recordSize) {
+    uint64 at = 0;
+    uint8* in = record;
+
+    while (in < record + recordSize) {
+        uint16 zeros;
+        uint16 literals;
+        memcpy(&zeros, in, sizeof(zeros));
+        memcpy(&literals, in + 2, sizeof(literals));
+        in += 4;
+
+        at += zeros;
+        ASSERT(at + literals <= size);
+        for (uint16 i = 0; i < literals; i++) {
+            state[at++] ^= *in++;
+        }
+    }
+}
+
+static RewindFrame* getRewindFrame(RewindBuffer* buffer, uint64 frame) {
+    return &buffer->frames[frame % REWIND_MAX_FRAMES];
+}
+
+// The scratch buffers and the frame table come out of the memory
+// block, the rest is the ring
+bool32 initializeRewindBuffer(RewindBuffer* buffer, uint64 stateSize,
+                              void* memory, uint64 memorySize) {
+    uint64 encodedSize = 2 * stateSize + 16;
+    uint64 tablesSize = 2 * stateSize + encodedSize
+        + REWIND_MAX_FRAMES * sizeof(RewindFrame);
+
+    // room for a few keyframes at least
+    if (memorySize < tablesSize + 4 * encodedSize) {
+        return false;
+    }
+
+    uint8* at = memory;
+    buffer->stateSize = stateSize;
+    buffer->state = at;
+    at += stateSize;
+    buffer->keyframe = at;
+    at += stateSize;
+    buffer->encoded = at;
+    at += encodedSize;
+    buffer->frames = (RewindFrame*)at;
+    at += REWIND_MAX_FRAMES * sizeof(RewindFrame);
+
+    buffer->data = at;
+    buffer->capacity = memorySize - tablesSize;
+
+    buffer->firstFrame = 0;
+    buffer->endFrame = 0;
+    buffer->keyframeFrame = 0;
+    buffer->end = 0;
+    buffer->recordedFrames = 0;
+    buffer->recordedBytes = 0;
+
+    return true;
+}
+
+// Drops the oldest keyframe and its deltas
+static void dropOldestGroup(RewindBuffer* buffer) {
+    do {
+        buffer->firstFrame++;
+    } while (buffer->firstFrame < buffer->endFrame
+             && !getRewindFrame(buffer, buffer->firstFrame)->keyframe);
+}
+
+// Makes room for the record in buffer->encoded and copies it in the
+// ring.  Fails if that would drop the keyframe of a delta.
+static bool32 storeRewindRecord(RewindBuffer* buffer, uint32 size, bool32 keyframe) {
+    uint64 start;
+
+    for (;;) {
+        // records don't wrap around the end of the ring
+        start = buffer->end;
+        if (start % buffer->capacity + size > buffer->capacity) {
+            start += buffer->capacity - start % buffer->capacity;
+        }
+
+        if (buffer->firstFrame == buffer->endFrame) {
+            if (size > buffer->capacity) {
+                return false;
+            }
+            break;
+        }
+
+        if (buffer->endFrame - buffer->firstFrame < REWIND_MAX_FRAMES
+            && start + size - getRewindFrame(buffer, buffer->firstFrame)->start
+               <= buffer->capacity) {
+            break;
+        }
+
+        if (!keyframe && buffer->firstFrame == buffer->keyframeFrame) {
+            return false;
+        }
+        dropOldestGroup(buffer);
+    }
+
+    memcpy(buffer->data + start % buffer->capacity, buffer->encoded, size);
+
+    RewindFrame* frame = getRewindFrame(buffer, buffer->endFrame);
+    frame->start = start;
+    frame->size = size;
+    frame->keyframe = keyframe;
+
+    if (keyframe) {
+        buffer->keyframeFrame = buffer->endFrame;
+    }
+    buffer->endFrame++;
+    buffer->end = start + size;
+
+    return true;
+}
+
+// Call once per emulated frame
+void recordRewindFrame(RewindBuffer* buffer, GameBoy* gb) {
+    writeSaveState(gb, buffer->state, buffer->stateSize);
+
+    bool32 keyframe = buffer->firstFrame == buffer->endFrame
+        || buffer->endFrame - buffer->keyframeFrame >= REWIND_KEYFRAME_INTERVAL;
+    uint64 size = 0;
+
+    if (!keyframe) {
+        size = encodeXorDelta(buffer->state, buffer->keyframe,
+                              buffer->stateSize, buffer->encoded);
+        if (!storeRewindRecord(buffer, size, false)) {
+            // the ring only has room for the newest group : start another
+            keyframe = true;
+        }
+    }
+
+    if (keyframe) {
+        size = encodeXorDelta(buffer->state, 0, buffer->stateSize, buffer->encoded);
+        if (!storeRewindRecord(buffer, size, true)) {
+            buffer->firstFrame = buffer->endFrame;
+            return;
+        }
+        memcpy(buffer->keyframe, buffer->state, buffer->stateSize);
+    }
+
+    buffer->recordedFrames++;
+    buffer->recordedBytes += size;
+}
+
+static void decodeRewindFrame(RewindBuffer* buffer, uint64 frame, uint8* state) {
+    RewindFrame* record = getRewindFrame(buffer, frame);
+    applyXorDelta(state, buffer->stateSize,
+                  buffer->data + record->start % buffer->capacity, record->size);
+}
+
+// Drops the newest frame and goes back to the one before it.  Returns
+// false when there is nothing left to go back to.
+bool32 rewindFrame(RewindBuffer* buffer, GameBoy* gb) {
+    if (buffer->endFrame - buffer->firstFrame < 2) {
+        return false;
+    }
+
+    buffer->endFrame--;
+    uint64 newest = buffer->endFrame - 1;
+    RewindFrame* newestRecord = getRewindFrame(buffer, newest);
+    buffer->end = newestRecord->start + newestRecord->size;
+
+    // went past the keyframe of the newest group : the previous group
+    // becomes the newest, decode its keyframe
+    if (newest < buffer->keyframeFrame) {
+        uint64 keyframe = newest;
+        while (!getRewindFrame(buffer, keyframe)->keyframe) {
+            keyframe--;
+        }
+
+        memset(buffer->keyframe, 0, buffer->stateSize);
+        decodeRewindFrame(buffer, keyframe, buffer->keyframe);
+        buffer->keyframeFrame = keyframe;
+    }
+
+    memcpy(buffer->state, buffer->keyframe, buffer->stateSize);
+    if (newest != buffer->keyframeFrame) {
+        decodeRewindFrame(buffer, newest, buffer->state);
+    }
+
+    return readSaveState(gb, buffer->state, buffer->stateSize);
+}
+
+void printRewindStats(FILE* file, RewindBuffer* buffer) {
+    uint64 frameCount = buffer->endFrame - buffer->firstFrame;
+    uint64 used = frameCount ? buffer->end - getRewindFrame(buffer, buffer->firstFrame)->start : 0;
+
+    fprintf(file, "Rewind : %llu frames (%.1f s) in %.1f of %.1f MB, "
+            "%.0f bytes per frame for a %llu byte state\n",
+            (unsigned long long)frameCount,
+            (double)frameCount * GAMEBOY_CYCLES_PER_FRAME / GAMEBOY_CPU_FREQUENCY,
+            used / (1024.0 * 1024.0), buffer->capacity / (1024.0 * 1024.0),
+            buffer->recordedFrames ? (double)buffer->recordedBytes / buffer->recordedFrames : 0.0,
+            (unsigned long long)buffer->stateSize);
+}
@@ -0,0 +1,88 @@
+#include "gameboy.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Run-ahead, see RunAhead.  Only the frame shown is drawn : the frame
+// skip is off while it is on, the frames are asked with requestFrame.
+
+void initializeRunAhead(RunAhead* runAhead, void* state, uint64 stateSize) {
+    memset(runAhead, 0, sizeof(*runAhead));
+    runAhead->state = state;
+    runAhead->stateSize = stateSize;
+}
+
+void setRunAheadFrames(GameBoy* gb, RunAhead* runAhead, uint32 frames) {
+    ASSERT(frames <= RUN_AHEAD_MAX_FRAMES);
+
+    runAhead->frames = frames;
+    setFrameSkip(gb, frames ? 0 : 1);
+
+    runAhead->frameCount = 0;
+    runAhead->maxTime = 0;
+    runAhead->totalTime = 0;
+    runAhead->emulationTime = 0;
+    runAhead->saveTime = 0;
+    runAhead->loadTime = 0;
+}
+
+// One frame shown.  Leaves gb where a plain frame would, just before the
+// host triggers the vblank interrupt, but with the screen of the frame
+// runAhead->frames later.
+void runFrameAhead(GameBoy* gb, RunAhead* runAhead) {
+    uint64 startTime = platform.getMicroseconds();
+    uint64 saveTime = 0;
+
+    for (uint32 frame = 0; frame <= runAhead->frames; frame++) {
+        // the frame skip decides at the start of a frame
+        if (frame + 1 == runAhead->frames) {
+            requestFrame(gb);
+        }
+
+        if (frame) {
+            triggerInterrupt(gb, INT_VBLANK);
+        }
+
+        while (!gb->frameReady) {
+            runCycles(gb, GAMEBOY_CYCLES_PER_FRAME);
+        }
+        gb->frameReady = false;
+
+        if (!frame && runAhead->frames) {
+            uint64 saveStart = platform.getMicroseconds();
+            writeSaveState(gb, runAhead->state, runAhead->stateSize);
+            saveTime = platform.getMicroseconds() - saveStart;
+        }
+    }
+
+    uint64 loadStart = platform.getMicroseconds();
+    if (runAhead->frames) {
+        // keep the frame drawn ahead on screen
+        uint8 screen[GAMEBOY_SCREEN_HEIGHT][GAMEBOY_SCREEN_WIDTH];
+        memcpy(screen, gb->screen, sizeof(screen));
+        readSaveState(gb, runAhead->state, runAhead->stateSize);
+        memcpy(gb->screen, screen, sizeof(screen));
+    }
+    uint64 endTime = platform.getMicroseconds();
+
+    runAhead->lastTime = endTime - startTime;
+    if (runAhead->lastTime > runAhead->maxTime) {
+        runAhead->maxTime = runAhead->lastTime;
+    }
+    runAhead->frameCount++;
+    runAhead->totalTime += runAhead->lastTime;
+    runAhead->saveTime += saveTime;
+    runAhead->loadTime += endTime - loadStart;
+    runAhead->emulationTime += loadStart - startTime - saveTime;
+}
+
+void printRunAheadStats(FILE* file, RunAhead* runAhead) {
+    uint64 count = runAhead->frameCount ? runAhead->frameCount : 1;
+
+    fprintf(file, "Run-ahead of %u frames, %llu frames shown : %.2f ms per frame (max %.2f), "
+            "emulation %.2f ms, save %.1f us, load %.1f us\n",
+            runAhead->frames, (unsigned long long)runAhead->frameCount,
+            runAhead->totalTime / 1e3 / count, runAhead->maxTime / 1e3,
+            runAhead->emulationTime / 1e3 / count,
+            (double)runAhead->saveTime / count, (double)runAhead->loadTime / count);
+}
@@ -0,0 +1,199 @@
+#include "gameboy.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// Save states : the fields below are copied as is, everything else in
+// GameBoy is either the cartridge (matched by hash), derived from these fields
+// and rebuilt by readSaveState (memory map, bank pointers, decode cache,
+// tile cache), or belongs to the host (frame skip, tracing, profiling,
+// statistics).  externalRam points to the cartridge RAM, which is saved
+// in its place.
+//
+// Adding, removing or resizing a field changes the layout : bump
+// SAVESTATE_VERSION.
+
+#define SAVESTATE_FIELDS(X)                                             \
+    X(registers) X(ie) X(ime) X(lazyFlags) X(joypad) X(halted)          \
+    X(ram) X(externalRam) X(vram) X(oam) X(io) X(hram)                  \
+    X(mbc1.ramEnable) X(mbc1.romBankIndex) X(mbc1.ramBankIndex)         \
+    X(mbc1.bankingMode)                                                 \
+    X(clock) X(eventClocks) X(nextEventClock)                           \
+    X(scheduledEvents) X(timerClock) X(timerAccumulator)                \
+    X(scanlineClock) X(timerReads)                                      \
+    X(screen) X(frameReady) X(renderingMode)                            \
+    X(callStackHeight) X(callStack)
+
+typedef struct SaveStateField {
+    const char* name;
+    uint32 offset; // in GameBoy
+    uint32 size;
+} SaveStateField;
+
+static const SaveStateField saveStateFields[] = {
+#define X(field) {#field, offsetof(GameBoy, field), sizeof(((GameBoy*)0)->field)},
+    SAVESTATE_FIELDS(X)
+#undef X
+};
+
+static uint64 alignStateOffset(uint64 offset) {
+    return (offset + SAVESTATE_ALIGNMENT - 1) & ~(uint64)(SAVESTATE_ALIGNMENT - 1);
+}
+
+static uint32 getSectionSize(GameBoy* gb, uint32 id) {
+    if (saveStateFields[id].offset == offsetof(GameBoy, externalRam)) {
+        return gb->mbc1.ramBankCount * 0x2000;
+    }
+
+    return saveStateFields[id].size;
+}
+
+static uint8* getFieldData(GameBoy* gb, uint32 id) {
+    if (saveStateFields[id].offset == offsetof(GameBoy, externalRam)) {
+        return gb->externalRam;
+    }
+
+    return (uint8*)gb + saveStateFields[id].offset;
+}
+
+const char* getSaveStateSectionName(uint32 id) {
+    return id < ARRAY_COUNT(saveStateFields) ? saveStateFields[id].name : "?";
+}
+
+static void* getSectionData(void* buffer, uint32 fieldOffset) {
+    SaveStateHeader* header = (SaveStateHeader*)buffer;
+
+    for (uint32 id = 0; id < ARRAY_COUNT(saveStateFields); id++) {
+        if (saveStateFields[id].offset == fieldOffset) {
+            return (uint8*)buffer + header->sections[id].offset;
+        }
+    }
+
+    return 0;
+}
+
+// Depends on the cartridge only, the same for every state of a ROM
+uint64 getSaveStateSize(GameBoy* gb) {
+    uint64 size = alignStateOffset(sizeof(SaveStateHeader));
+
+    for (uint32 id = 0; id < ARRAY_COUNT(saveStateFields); id++) {
+        size = alignStateOffset(size + getSectionSize(gb, id));
+    }
+
+    return size;
+}
+
+// Returns the size of the state, 0 if the buffer is too small
+uint64 writeSaveState(GameBoy* gb, void* buffer, uint64 bufferSize) {
+    ASSERT(ARRAY_COUNT(saveStateFields) <= SAVESTATE_MAX_SECTIONS);
+
+    uint64 size = getSaveStateSize(gb);
+    if (bufferSize < size) {
+        return 0;
+    }
+
+    SaveStateHeader* header = (SaveStateHeader*)buffer;
+    memset(header, 0, sizeof(*header));
+    header->magic = SAVESTATE_MAGIC;
+    header->version = SAVESTATE_VERSION;
+    header->romHash = gb->cartridge ? gb->cartridge->hash : 0;
+    header->size = size;
+    header->sectionCount = ARRAY_COUNT(saveStateFields);
+
+    uint64 offset = alignStateOffset(sizeof(SaveStateHeader));
+    for (uint32 id = 0; id < ARRAY_COUNT(saveStateFields); id++) {
+        SaveStateSection* section = &header->sections[id];
+        section->id = id;
+        section->size = getSectionSize(gb, id);
+        section->offset = offset;
+
+        memcpy((uint8*)buffer + offset, getFieldData(gb, id), section->size);
+        offset = alignStateOffset(offset + section->size);
+    }
+
+    // F is stale while the lazy flags are pending, and the backends
+    // materialize them at different points : store F evaluated, so
+    // that the same machine state is always the same bytes
+    uint8 flags = evaluateFlags(gb);
+    Registers* registers = getSectionData(buffer, offsetof(GameBoy, registers));
+    registers->bytes[REG8_INDEX(REG_F)] = flags;
+
+    __typeof__(gb->lazyFlags)* lazyFlags = getSectionData(buffer, offsetof(GameBoy, lazyFlags));
+    memset(lazyFlags, 0, sizeof(*lazyFlags));
+    lazyFlags->op = LAZY_FLAGS_NONE;
+    lazyFlags->checked = flags;
+
+    return size;
+}
+
+// Replaces the state of gb, which must have the cartridge of the state
+// inserted.  Nothing is changed if the state doesn't fit.
+bool32 readSaveState(GameBoy* gb, void* buffer, uint64 size) {
+    SaveStateHeader* header = (SaveStateHeader*)buffer;
+
+    if (size < sizeof(SaveStateHeader) || header->magic != SAVESTATE_MAGIC) {
+        fprintf(stderr, "Not a save state\n");
+        return false;
+    }
+
+    if (header->version != SAVESTATE_VERSION) {
+        fprintf(stderr, "Save state version %u, expected %u\n",
+                header->version, SAVESTATE_VERSION);
+        return false;
+    }
+
+    if (!gb->cartridge || header->romHash != gb->cartridge->hash) {
+        fprintf(stderr, "The save state is for another ROM\n");
+        return false;
+    }
+
+    if (header->size > size || header->sectionCount != ARRAY_COUNT(saveStateFields)) {
+        fprintf(stderr, "Truncated or corrupt save state\n");
+        return false;
+    }
+
+    for (uint32 i = 0; i < header->sectionCount; i++) {
+        SaveStateSection* section = &header->sections[i];
+
+        if (section->id != i
+            || section->size != getSectionSize(gb, section->id)
+            || section->offset > header->size
+            || section->size > header->size - section->offset) {
+            fprintf(stderr, "Save state section %u (%s) doesn't fit\n",
+                    i, getSaveStateSectionName(section->id));
+            return false;
+        }
+    }
+
+    // The values that index arrays, or that the emulator can't run with
+    uint16* callStackHeight = getSectionData(buffer, offsetof(GameBoy, callStackHeight));
+    if (*callStackHeight > CALL_STACK_SIZE) {
+        fprintf(stderr, "Save state with a call stack of %u frames, at most %d\n",
+                *callStackHeight, CALL_STACK_SIZE);
+        return false;
+    }
+
+    __typeof__(gb->lazyFlags)* lazyFlags = getSectionData(buffer, offsetof(GameBoy, lazyFlags));
+    if (lazyFlags->op > LAZY_FLAGS_ROTATE_A) {
+        fprintf(stderr, "Save state with unknown lazy flags operation %u\n", lazyFlags->op);
+        return false;
+    }
+
+    for (uint32 i = 0; i < header->sectionCount; i++) {
+        SaveStateSection* section = &header->sections[i];
+        memcpy(getFieldData(gb, section->id), (uint8*)buffer + section->offset,
+               section->size);
+    }
+
+    // Everything derived from the fields above.  Only the bank mapping
+    // depends on them, the rest of the memory map is fixed.
+    updateBanks(gb);
+    flushRamDecodeCache(gb);
+    for (uint32 tile = 0; tile < TILE_COUNT; tile++) {
+        gb->dirtyTileRows[tile] = 0xFF;
+    }
+    resumeScheduler(gb);
+
+    return true;
+}
@@ -0,0 +1,238 @@
+#include "gameboy.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+// Instruction trace : executeDecodedInstruction calls recordTrace while
+// gb->tracing is set, which copies the registers and the bytes at PC
+// into the next slot of the ring buffer.  Formatting is left to the
+// reader of the buffer (gb-trace), with printTraceLogLine and
+// disassembleInstruction.
+
+void initializeTraceBuffer(TraceBuffer* buffer, uint32 capacity) {
+    ASSERT(capacity);
+
+    buffer->magic = TRACE_MAGIC;
+    buffer->capacity = capacity;
+    buffer->written = 0;
+}
+
+// Traces the next instructionCount instructions (~0 : until stopTrace)
+void startTrace(GameBoy* gb, TraceBuffer* buffer, uint32 instructionCount) {
+    ASSERT(buffer->magic == TRACE_MAGIC);
+
+    gb->traceBuffer = buffer;
+    gb->tracing = instructionCount;
+}
+
+void stopTrace(GameBoy* gb) {
+    gb->tracing = 0;
+}
+
+void fillTraceRecord(GameBoy* gb, TraceRecord* record) {
+    uint16 pc = REG(PC);
+
+    record->clock = gb->clock;
+    record->pc = pc;
+    record->bank = getAddressBank(gb, pc);
+    record->sp = REG(SP);
+    record->a = getReg8(gb, REG_A);
+    record->f = getReg8(gb, REG_F);
+    record->b = getReg8(gb, REG_B);
+    record->c = getReg8(gb, REG_C);
+    record->d = getReg8(gb, REG_D);
+    record->e = getReg8(gb, REG_E);
+    record->h = getReg8(gb, REG_H);
+    record->l = getReg8(gb, REG_L);
+
+    for (uint16 i = 0; i < ARRAY_COUNT(record->bytes); i++) {
+        record->bytes[i] = readMemory(gb, pc + i);
+    }
+}
+
+void recordTrace(GameBoy* gb) {
+    TraceBuffer* buffer = gb->traceBuffer;
+    if (!buffer) {
+        gb->tracing = 0;
+        return;
+    }
+
+    fillTraceRecord(gb, &buffer->records[buffer->written % buffer->capacity]);
+    buffer->written++;
+    gb->tracing--;
+}
+
+void printTraceLogLine(FILE* file, TraceRecord* record) {
+    fprintf(file, "A: %02X F: %02X B: %02X C: %02X D: %02X E: %02X H: %02X L: %02X SP: %04X PC: %02X:%04X (%02X %02X %02X %02X)\n",
+            record->a, record->f, record->b, record->c,
+            record->d, record->e, record->h, record->l,
+            record->sp, record->bank, record->pc,
+            record->bytes[0], record->bytes[1], record->bytes[2], record->bytes[3]);
+}
+
+// The records in the order they were written
+uint32 getTraceRecordCount(TraceBuffer* buffer) {
+    return buffer->written < buffer->capacity ? buffer->written : buffer->capacity;
+}
+
+TraceRecord* getTraceRecord(TraceBuffer* buffer, uint32 index) {
+    uint64 first = buffer->written - getTraceRecordCount(buffer);
+    return &buffer->records[(first + index) % buffer->capacity];
+}
+
+// Same layout as the ring buffer, without the unused records
+bool32 writeTraceBuffer(TraceBuffer* buffer, const char* filename) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", filename);
+        return false;
+    }
+
+    fwrite(buffer, TRACE_BUFFER_SIZE(getTraceRecordCount(buffer)), 1, file);
+    fclose(file);
+
+    return true;
+}
+
+static const char* skipLogFieldName(const char* at, const char* name) {
+    while (*at == ' ' || *at == '\t') {
+        at++;
+    }
+    while (*name) {
+        if (*at++ != *name++) {
+            return 0;
+        }
+    }
+    if (*at++ != ':') {
+        return 0;
+    }
+    while (*at == ' ') {
+        at++;
+    }
+    return at;
+}
+
+// Up to 4 hex digits, 0 if there are none
+static const char* readLogHex(const char* at, uint16* value) {
+    uint32 digits = 0;
+    *value = 0;
+
+    for (; digits < 4; digits++, at++) {
+        char c = *at;
+        uint16 digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else {
+            break;
+        }
+        *value = (*value << 4) | digit;
+    }
+
+    return digits ? at : 0;
+}
+
+// Reads a line in the printTraceLogLine format, or in the gameboy-doctor
+// one ("A:01 F:B0 ... SP:FFFE PC:0100 PCMEM:00,C3,13,02").  This runs
+// once per instruction when comparing against a reference log, hence no
+// sscanf.  What the line doesn't have (clock, bank) is left at 0.
+bool32 parseTraceLogLine(const char* line, TraceRecord* record) {
+    static const char* registerNames[] = {"A", "F", "B", "C", "D", "E", "H", "L"};
+    uint8* registers[] = {
+        &record->a, &record->f, &record->b, &record->c,
+        &record->d, &record->e, &record->h, &record->l,
+    };
+
+    const char* at = line;
+    uint16 value;
+
+    memset(record, 0, sizeof(*record));
+
+    for (uint32 i = 0; i < ARRAY_COUNT(registerNames); i++) {
+        if (!(at = skipLogFieldName(at, registerNames[i]))
+            || !(at = readLogHex(at, &value))) {
+            return false;
+        }
+        *registers[i] = (uint8)value;
+    }
+
+    if (!(at = skipLogFieldName(at, "SP")) || !(at = readLogHex(at, &record->sp))
+        || !(at = skipLogFieldName(at, "PC")) || !(at = readLogHex(at, &record->pc))) {
+        return false;
+    }
+
+    char separator;
+    if (*at == ':') {
+        // "PC: BB:AAAA (XX XX XX XX)"
+        record->bank = record->pc;
+        if (!(at = readLogHex(at + 1, &record->pc))) {
+            return false;
+        }
+        while (*at == ' ') {
+            at++;
+        }
+        if (*at++ != '(') {
+            return false;
+        }
+        separator = ' ';
+    } else {
+        // "PC:AAAA PCMEM:XX,XX,XX,XX"
+        if (!(at = skipLogFieldName(at, "PCMEM"))) {
+            return false;
+        }
+        separator = ',';
+    }
+
+    for (uint32 i = 0; i < ARRAY_COUNT(record->bytes); i++) {
+        if (i && *at++ != separator) {
+            return false;
+        }
+        if (!(at = readLogHex(at, &value))) {
+            return false;
+        }
+        record->bytes[i] = (uint8)value;
+    }
+
+    return true;
+}
+
+// Writes the names of the fields that differ, space separated, and
+// returns whether there are any.  The clock and the bank aren't
+// compared : the logs of other emulators don't have them.
+bool32 printTraceDifferences(FILE* file, TraceRecord* expected, TraceRecord* actual) {
+    static const struct {
+        const char* name;
+        uint32 offset;
+        uint32 size;
+    } fields[] = {
+        {"A", offsetof(TraceRecord, a), 1},
+        {"F", offsetof(TraceRecord, f), 1},
+        {"B", offsetof(TraceRecord, b), 1},
+        {"C", offsetof(TraceRecord, c), 1},
+        {"D", offsetof(TraceRecord, d), 1},
+        {"E", offsetof(TraceRecord, e), 1},
+        {"H", offsetof(TraceRecord, h), 1},
+        {"L", offsetof(TraceRecord, l), 1},
+        {"SP", offsetof(TraceRecord, sp), 2},
+        {"PC", offsetof(TraceRecord, pc), 2},
+        {"PCMEM", offsetof(TraceRecord, bytes), 4},
+    };
+
+    bool32 different = false;
+
+    for (uint32 i = 0; i < ARRAY_COUNT(fields); i++) {
+        if (memcmp((uint8*)expected + fields[i].offset,
+                   (uint8*)actual + fields[i].offset, fields[i].size)) {
+            if (file) {
+                fprintf(file, "%s%s", different ? " " : "", fields[i].name);
+            }
+            different = true;
+        }
+    }
+
+    return different;
+}